@@ -33,12 +33,22 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <sys/time.h>
+#include <time.h>
 #include <assert.h>
 #include <omp.h>
 #include <math.h>
 #include <stdint.h>
+#include <limits.h>
+#include <pthread.h>
 #include <x86intrin.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
 
 /* the following two definitions of DEBUGGING control whether or not
    debugging information is written out. To put the program into
@@ -57,6 +67,23 @@ struct sparse_matrix
   int *kernel_starts;
   float *values;
   int *channel_numbers;
+  uint16_t *values_f16; // half precision copy of values, NULL until needed
+  // compact channel numbers made by kernels_encode_indices; the int32
+  // channel_numbers are always kept for the simple routines
+  int index_encoding;          // which form team_conv_sparse reads
+  uint16_t *channel_numbers16; // INDEX_UINT16: absolute channel numbers
+  uint8_t *channel_deltas;     // INDEX_DELTA8: byte deltas, 0 escapes
+  int *delta_starts;           // INDEX_DELTA8: first delta of each kernel
+};
+
+// forms of the channel numbers that team_conv_sparse can decode
+enum index_encoding
+{
+  INDEX_INT32 = 0,  // channel_numbers only
+  INDEX_UINT16 = 1, // channel_numbers16, half the bytes of int
+  INDEX_DELTA8 = 2  // one byte per non-zero that follows the previous
+                    // one within 255 channels, otherwise a 0 escape
+                    // byte and the channel number in two bytes
 };
 
 // return a new sparse matrix with the provided dimensions
@@ -77,8 +104,13 @@ struct sparse_matrix *sparse_matrix_new(int nkernels, int nchannels, int nvalues
   DEBUGGING(fprintf(stderr, "  %p\n", result->kernel_starts));
   result->values = malloc(sizeof(float) * nvalues);
   DEBUGGING(fprintf(stderr, "  %p\n", result->values));
-  result->channel_numbers = malloc(sizeof(float) * nvalues);
+  result->channel_numbers = malloc(sizeof(int) * nvalues);
   DEBUGGING(fprintf(stderr, "  %p\n", result->channel_numbers));
+  result->values_f16 = NULL;
+  result->index_encoding = INDEX_INT32;
+  result->channel_numbers16 = NULL;
+  result->channel_deltas = NULL;
+  result->delta_starts = NULL;
 
   DEBUGGING(fprintf(stderr, "Exiting sparse matrix new %d %d %d\n", nkernels, nchannels, nvalues));
 
@@ -152,6 +184,106 @@ struct sparse_matrix ***kernels_dense2sparse(float ****kernels, int kernel_order
   return result;
 }
 
+/* store the channel numbers of a sparse matrix in a compact form as
+   well as in channel_numbers, and make team_conv_sparse read it */
+void sparse_matrix_encode_indices(struct sparse_matrix *kernel, int encoding)
+{
+  int m, index;
+
+  if (encoding == INDEX_UINT16)
+  {
+    assert(kernel->nchannels <= 65536);
+    kernel->channel_numbers16 = malloc(sizeof(uint16_t) * (kernel->non_zeros + 1));
+    for (index = 0; index < kernel->non_zeros; index++)
+    {
+      kernel->channel_numbers16[index] = kernel->channel_numbers[index];
+    }
+  }
+  else if (encoding == INDEX_DELTA8)
+  {
+    // at most three bytes for each non-zero
+    uint8_t *delta = malloc(3 * kernel->non_zeros + 1);
+    int ndeltas = 0;
+
+    assert(kernel->nchannels <= 65536);
+    kernel->channel_deltas = delta;
+    kernel->delta_starts = malloc(sizeof(int) * (kernel->nkernels + 1));
+    for (m = 0; m < kernel->nkernels; m++)
+    {
+      int previous = -1;
+      kernel->delta_starts[m] = ndeltas;
+      for (index = kernel->kernel_starts[m]; index < kernel->kernel_starts[m + 1]; index++)
+      {
+        int c = kernel->channel_numbers[index];
+        if (c > previous && c - previous <= 255)
+        {
+          delta[ndeltas++] = c - previous;
+        }
+        else
+        { // too far, or not in increasing order
+          delta[ndeltas++] = 0;
+          delta[ndeltas++] = c & 0xff;
+          delta[ndeltas++] = c >> 8;
+        }
+        previous = c;
+      }
+    }
+    kernel->delta_starts[kernel->nkernels] = ndeltas;
+    kernel->channel_deltas = realloc(delta, ndeltas + 1);
+  }
+  kernel->index_encoding = encoding;
+}
+
+/* encode the channel numbers of the sparse matrix of every kernel position */
+void kernels_encode_indices(struct sparse_matrix ***kernels, int kernel_order, int encoding)
+{
+  int x, y;
+
+  for (x = 0; x < kernel_order; x++)
+  {
+    for (y = 0; y < kernel_order; y++)
+    {
+      sparse_matrix_encode_indices(kernels[x][y], encoding);
+    }
+  }
+}
+
+/* print the bytes per non-zero of the sparse kernels with each index
+   encoding, counting the values, the channel numbers and the starts */
+void report_index_bytes(struct sparse_matrix ***kernels, int kernel_order, int nkernels)
+{
+  long long non_zeros = 0, delta_bytes = 0;
+  long long starts_bytes = (long long)kernel_order * kernel_order * (nkernels + 1) * sizeof(int);
+  int x, y;
+
+  for (x = 0; x < kernel_order; x++)
+  {
+    for (y = 0; y < kernel_order; y++)
+    {
+      struct sparse_matrix *kernel = kernels[x][y];
+      non_zeros += kernel->non_zeros;
+      if (kernel->channel_deltas != NULL)
+      {
+        delta_bytes += kernel->delta_starts[nkernels];
+      }
+    }
+  }
+  if (non_zeros == 0)
+  {
+    return;
+  }
+
+  printf("Bytes per non-zero: int32 %.2f, uint16 %.2f",
+         (non_zeros * (sizeof(float) + sizeof(int)) + starts_bytes) / (double)non_zeros,
+         (non_zeros * (sizeof(float) + sizeof(uint16_t)) + starts_bytes) / (double)non_zeros);
+  if (delta_bytes > 0)
+  {
+    // the delta encoding needs its own starts as well as kernel_starts
+    printf(", delta8 %.2f", (non_zeros * sizeof(float) + delta_bytes + 2 * starts_bytes) / (double)non_zeros);
+  }
+  printf("\n");
+}
+
 /* write 3d matrix to stdout */
 void write_out(float ***a, int dim0, int dim1, int dim2)
 {
@@ -251,22 +383,47 @@ float ****copy_4d_matrix(float ****source_matrix, int dim0,
   return result;
 }
 
+/* seed for the random generators given with -seed; a negative value
+   means that the time of day is used as before */
+static long long random_seed = -1;
+/* number of matrices generated so far, so that with a fixed seed the
+   image and the kernels still get different (but repeatable) values */
+static int random_seed_calls = 0;
+
+/* seed the C library generator with a 64-bit seed; srandom only takes
+   an unsigned int, so the high half is mixed into the low half rather
+   than cut off */
+void srandom_seed(long long seed)
+{
+  unsigned long long bits = (unsigned long long)seed;
+
+  srandom((unsigned int)bits ^ ((unsigned int)(bits >> 32) * 0x9e3779b9u));
+}
+
 /* create a matrix and fill it with random numbers */
 float ****gen_random_4d_matrix(int dim0, int dim1, int dim2, int dim3, int nz_ratio)
 {
   float ****result;
   int i, j, k, l;
   struct timeval seedtime;
-  int seed;
+  long long seed;
 
   assert(nz_ratio >= 1);
 
   result = new_empty_4d_matrix(dim0, dim1, dim2, dim3);
 
-  /* use the microsecond part of the current time as a pseudorandom seed */
-  gettimeofday(&seedtime, NULL);
-  seed = seedtime.tv_usec;
-  srandom(seed);
+  if (random_seed < 0)
+  {
+    /* use the microsecond part of the current time as a pseudorandom seed */
+    gettimeofday(&seedtime, NULL);
+    seed = seedtime.tv_usec;
+  }
+  else
+  {
+    seed = random_seed + random_seed_calls;
+  }
+  random_seed_calls++;
+  srandom_seed(seed);
 
   /* fill the matrix with random numbers */
   const int range = 1 << 10; // 2^10
@@ -326,446 +483,8331 @@ float ***gen_random_3d_matrix(int dim0, int dim1, int dim2, int nz_ratio)
   return mat3d;
 }
 
-/* check the sum of absolute differences is within reasonable epsilon */
-void check_result(float ***result, float ***control,
-                  int dim0, int dim1, int dim2)
+/* starting value of a FNV-1a hash */
+#define FNV1A_INIT 14695981039346656037ULL
+
+/* continue a FNV-1a hash over an array of 32 bit words */
+uint64_t fnv1a_words(uint64_t hash, const uint32_t *words, long long nwords)
 {
-  int i, j, k;
-  double sum_abs_diff = 0.0;
-  const double EPSILON = 0.0625;
+  long long i;
 
-  DEBUGGING(printf("SAD\n"));
+  for (i = 0; i < nwords; i++)
+  {
+    hash = (hash ^ words[i]) * 1099511628211ULL;
+  }
+  return hash;
+}
+
+/* Binary tensor files
+
+   Dense tensors and sparse kernels can be saved to and loaded from a
+   simple versioned binary format, so that real activations and real
+   pruned weights can be fed into the harness. Every file starts with
+   a tensor_file_header. Each array in the file starts on a 64 byte
+   boundary and is stored in native byte order, which lets the loader
+   mmap the file and point the harness data structures straight into
+   the mapping without copying or parsing anything.
+
+   Dense file:  header, then dims[0] * ... * dims[ndims - 1] floats.
+   Sparse file: header with dims {kernel_order, kernel_order, nkernels,
+                nchannels}, then kernel_order * kernel_order
+                tensor_file_sparse_entry records (one per kernel
+                position, x major), then the arrays they point to.
+   Plan file:   a sparse file that also has a conv_plan_record between
+                the header and the entry table, and after the arrays
+                of the kernels the arrays that the record points to. */
+
+#define TENSOR_FILE_MAGIC 0x534e5443 // "CTNS"
+#define TENSOR_FILE_VERSION 1
+#define TENSOR_FILE_ALIGN 64
+
+enum tensor_file_kind
+{
+  TENSOR_FILE_DENSE = 1,
+  TENSOR_FILE_SPARSE_KERNELS = 2,
+  TENSOR_FILE_KERNEL_PLAN = 3
+};
+
+struct tensor_file_header
+{
+  uint32_t magic;
+  uint32_t version;
+  uint32_t kind;
+  uint32_t ndims;
+  int64_t dims[4];
+  uint64_t data_offset; // offset of the data (dense) or entry table (sparse)
+  uint64_t file_bytes;  // total length, to detect truncated files
+};
+
+// location of the arrays of one struct sparse_matrix in a sparse file
+struct tensor_file_sparse_entry
+{
+  int64_t non_zeros;
+  uint64_t kernel_starts_offset;
+  uint64_t channel_numbers_offset;
+  uint64_t values_offset;
+};
+
+/* round a file offset up to the array alignment */
+uint64_t tensor_file_align(uint64_t offset)
+{
+  return (offset + TENSOR_FILE_ALIGN - 1) & ~(uint64_t)(TENSOR_FILE_ALIGN - 1);
+}
+
+/* write zero bytes to move a file up to the given offset */
+void tensor_file_pad(FILE *file, uint64_t offset)
+{
+  while ((uint64_t)ftell(file) < offset)
+  {
+    fputc(0, file);
+  }
+}
+
+/* create a 3d matrix whose index arrays point into existing contiguous
+   data, in the same layout as new_empty_3d_matrix */
+float ***view_3d_matrix(float *data, int dim0, int dim1, int dim2)
+{
+  float ***result;
+  float **mat2;
+  int i, j;
+
+  assert((dim0 > 0) && (dim1 > 0) && (dim2 > 0));
+
+  result = malloc(dim0 * sizeof(float **));
+  mat2 = malloc(dim0 * dim1 * sizeof(float *));
+  assert(result != NULL);
+  assert(mat2 != NULL);
 
   for (i = 0; i < dim0; i++)
   {
+    result[i] = &(mat2[i * dim1]);
     for (j = 0; j < dim1; j++)
     {
-      for (k = 0; k < dim2; k++)
-      {
-        double diff = fabs(control[i][j][k] - result[i][j][k]);
-        assert(diff >= 0.0);
-        sum_abs_diff = sum_abs_diff + diff;
-      }
+      result[i][j] = &(data[(long long)i * dim1 * dim2 + (long long)j * dim2]);
     }
   }
+  return result;
+}
 
-  if (sum_abs_diff > EPSILON)
-  {
-    fprintf(stderr, "WARNING: sum of absolute differences (%f) > EPSILON (%f)\n",
-            sum_abs_diff, EPSILON);
-  }
-  else
+/* save a contiguous 3d matrix as a dense tensor file */
+void save_dense_3d_file(const char *path, float ***a, int dim0, int dim1, int dim2)
+{
+  struct tensor_file_header header;
+  uint64_t nbytes = (uint64_t)dim0 * dim1 * dim2 * sizeof(float);
+  FILE *file = fopen(path, "wb");
+
+  if (file == NULL)
   {
-    printf("COMMENT: sum of absolute differences (%f)  within acceptable range (%f)\n", sum_abs_diff, EPSILON);
+    fprintf(stderr, "FATAL: cannot create %s\n", path);
+    exit(1);
   }
+
+  memset(&header, 0, sizeof(header));
+  header.magic = TENSOR_FILE_MAGIC;
+  header.version = TENSOR_FILE_VERSION;
+  header.kind = TENSOR_FILE_DENSE;
+  header.ndims = 3;
+  header.dims[0] = dim0;
+  header.dims[1] = dim1;
+  header.dims[2] = dim2;
+  header.data_offset = tensor_file_align(sizeof(header));
+  header.file_bytes = header.data_offset + nbytes;
+
+  fwrite(&header, sizeof(header), 1, file);
+  tensor_file_pad(file, header.data_offset);
+  fwrite(&(a[0][0][0]), 1, nbytes, file);
+  fclose(file);
 }
 
-/* a slow but correct version of dense convolution written by David */
-void multichannel_conv_dense(float ***image, float ****kernels,
-                             float ***output, int width, int height,
-                             int nchannels, int nkernels, int kernel_order)
+/* write sparse kernels to a file of the given kind, with an optional
+   extra record stored between the header and the entry table; returns
+   the length of the file, or 0 if it cannot be written */
+uint64_t write_sparse_kernels_file(const char *path, uint32_t kind,
+                                   const void *extra, size_t extra_bytes,
+                                   struct sparse_matrix ***kernels,
+                                   int kernel_order, int nkernels, int nchannels)
 {
-  int h, w, x, y, c, m;
+  struct tensor_file_header header;
+  struct tensor_file_sparse_entry *entries;
+  int npositions = kernel_order * kernel_order;
+  uint64_t offset;
+  int x, y, i, failed;
+  FILE *file = fopen(path, "wb");
 
-  // initialize the output matrix to zero
-  for (m = 0; m < nkernels; m++)
+  if (file == NULL)
   {
-    for (h = 0; h < height; h++)
-    {
-      for (w = 0; w < width; w++)
-      {
-        output[m][h][w] = 0.0;
-      }
-    }
+    return 0;
   }
 
-  for (m = 0; m < nkernels; m++)
+  // lay out the arrays of every kernel position after the entry table
+  entries = malloc(sizeof(struct tensor_file_sparse_entry) * npositions);
+  offset = tensor_file_align(tensor_file_align(sizeof(header)) + extra_bytes);
+  offset = tensor_file_align(offset + sizeof(struct tensor_file_sparse_entry) * npositions);
+  for (x = 0; x < kernel_order; x++)
   {
-    for (w = 0; w < width; w++)
+    for (y = 0; y < kernel_order; y++)
     {
-      for (h = 0; h < height; h++)
-      {
-        for (x = 0; x < kernel_order; x++)
-        {
-          for (y = 0; y < kernel_order; y++)
-          {
-            for (c = 0; c < nchannels; c++)
-            {
-              output[m][h][w] += image[w + x][h + y][c] * kernels[x][y][m][c];
-            }
-          }
-        }
-      }
+      struct sparse_matrix *kernel = kernels[x][y];
+      i = x * kernel_order + y;
+      entries[i].non_zeros = kernel->non_zeros;
+      entries[i].kernel_starts_offset = offset;
+      offset = tensor_file_align(offset + sizeof(int) * (nkernels + 1));
+      entries[i].channel_numbers_offset = offset;
+      offset = tensor_file_align(offset + sizeof(int) * kernel->non_zeros);
+      entries[i].values_offset = offset;
+      offset = tensor_file_align(offset + sizeof(float) * kernel->non_zeros);
     }
   }
-}
 
-/* a slow but correct version of sparse convolution written by David */
-void multichannel_conv_sparse(float ***image, struct sparse_matrix ***kernels,
-                              float ***output, int width, int height,
-                              int nchannels, int nkernels, int kernel_order)
-{
-  int h, w, x, y, c, m, index;
-  float value;
+  memset(&header, 0, sizeof(header));
+  header.magic = TENSOR_FILE_MAGIC;
+  header.version = TENSOR_FILE_VERSION;
+  header.kind = kind;
+  header.ndims = 4;
+  header.dims[0] = kernel_order;
+  header.dims[1] = kernel_order;
+  header.dims[2] = nkernels;
+  header.dims[3] = nchannels;
+  header.data_offset = tensor_file_align(tensor_file_align(sizeof(header)) + extra_bytes);
+  header.file_bytes = offset;
 
-  // initialize the output matrix to zero
-  for (m = 0; m < nkernels; m++)
+  fwrite(&header, sizeof(header), 1, file);
+  if (extra_bytes > 0)
   {
-    for (h = 0; h < height; h++)
+    tensor_file_pad(file, tensor_file_align(sizeof(header)));
+    fwrite(extra, 1, extra_bytes, file);
+  }
+  tensor_file_pad(file, header.data_offset);
+  fwrite(entries, sizeof(struct tensor_file_sparse_entry), npositions, file);
+  for (x = 0; x < kernel_order; x++)
+  {
+    for (y = 0; y < kernel_order; y++)
     {
-      for (w = 0; w < width; w++)
-      {
-        output[m][h][w] = 0.0;
-      }
+      struct sparse_matrix *kernel = kernels[x][y];
+      i = x * kernel_order + y;
+      tensor_file_pad(file, entries[i].kernel_starts_offset);
+      fwrite(kernel->kernel_starts, sizeof(int), nkernels + 1, file);
+      tensor_file_pad(file, entries[i].channel_numbers_offset);
+      fwrite(kernel->channel_numbers, sizeof(int), kernel->non_zeros, file);
+      tensor_file_pad(file, entries[i].values_offset);
+      fwrite(kernel->values, sizeof(float), kernel->non_zeros, file);
     }
   }
+  tensor_file_pad(file, offset);
+  failed = ferror(file);
+  failed |= fclose(file) != 0;
+  free(entries);
+  return failed ? 0 : offset;
+}
 
-  DEBUGGING(fprintf(stderr, "w=%d, h=%d, c=%d\n", w, h, c));
-
-  // now compute multichannel, multikernel convolution
-  for (w = 0; w < width; w++)
+/* save the sparse kernels of every kernel position to a sparse file */
+void save_sparse_kernels_file(const char *path, struct sparse_matrix ***kernels,
+                              int kernel_order, int nkernels, int nchannels)
+{
+  if (write_sparse_kernels_file(path, TENSOR_FILE_SPARSE_KERNELS, NULL, 0, kernels,
+                                kernel_order, nkernels, nchannels) == 0)
   {
-    for (h = 0; h < height; h++)
-    {
-      double sum = 0.0;
-      for (x = 0; x < kernel_order; x++)
-      {
-        for (y = 0; y < kernel_order; y++)
-        {
-          struct sparse_matrix *kernel = kernels[x][y];
-          for (m = 0; m < nkernels; m++)
-          {
-            for (index = kernel->kernel_starts[m]; index < kernel->kernel_starts[m + 1]; index++)
-            {
-              int this_c = kernel->channel_numbers[index];
-              assert((this_c >= 0) && (this_c < nchannels));
-              value = kernel->values[index];
-              output[m][h][w] += image[w + x][h + y][this_c] * value;
-            }
-          } // m
-        }   // y
-      }     // x
-    }       // h
-  }         // w
+    fprintf(stderr, "FATAL: cannot create %s\n", path);
+    exit(1);
+  }
 }
 
-/* the fast version of sparse convolution written by the team */
-void team_conv_sparse(float ***image, struct sparse_matrix ***kernels,
-                      float ***output, int width, int height,
-                      int nchannels, int nkernels, int kernel_order)
+/* mmap a tensor file and check its header; exits on any error. The
+   mapping is private and writable, so later in-place changes to the
+   data (for example folding) only copy the pages they touch */
+void *map_tensor_file(const char *path, uint32_t kind, struct tensor_file_header *header)
 {
-  int h, w, x, y, c, m, index;
-  float value;
-  int OpenMP_flag = 0;
-
-  /* the threshold to use OpenMP,
-     if the inputs width * nchannels * nkernels * kernel_order
-     are greater than 270 * 32 * 64 * 3,
-     then the program will use OpenMp to speed up and let OpenMP_flag = 1. 
-     this threshold is gained from multiple different inputs tests, so this threshold may be not very accurate. */
-  long long check = width * nchannels * nkernels * kernel_order;
-  long long threshold = 270 * 32 * 64 * 3;
+  struct stat st;
+  void *base;
+  int fd = open(path, O_RDONLY);
 
-  if (check >= threshold)
+  if (fd < 0 || fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(*header))
   {
-    OpenMP_flag = 1;
+    fprintf(stderr, "FATAL: cannot open tensor file %s\n", path);
+    exit(1);
   }
 
-  /*
-    ______________
-    |          | |
-    |     1    | |
-    |          |2|
-    |__________| |
-    |_____3____|_|
-  
-    The output matrix in initialization and convolution parts is divided to 3 parts.
-    Part 1 size is (height - height%4) * (width - width%4), so both part 1's height and width can be exactly divided by 4.
-    Part 2 size is height * (width%4).
-    Part 3 size is (height%4) * (width - width%4).
-    If image's height and width can be exactly divided by 4, then part 2 and 3 won't exist.
-    The loop unrolling and SSE are used in part 1 to speed up.
-    Because of small values of height and width in part 2 and 3, I haven't use SSE to speed up these part.
-  */
+  base = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (base == MAP_FAILED)
+  {
+    fprintf(stderr, "FATAL: cannot mmap tensor file %s\n", path);
+    exit(1);
+  }
 
-  // initialize the output matrix to zero
-  float init = 0.0;
-  __m128 initValue = _mm_set1_ps(init);
-  for (m = 0; m < nkernels; m++)
+  memcpy(header, base, sizeof(*header));
+  if (header->magic != TENSOR_FILE_MAGIC || header->version != TENSOR_FILE_VERSION)
   {
-    // Using loop unrolling to speedup and assign four rows in one iteration.
-    for (h = 0; h < height - height % 4; h += 4)
-    {
-      // Using SSE to speedup and assign four colums each time.
-      for (w = 0; w < width - width % 4; w += 4)
-      {
-        // output[i][j][k] = 0.0;
-        // Using SSE will assign four colums each time, so four elements in output will be initialized to 0.
-        // And because of loop unrolling, four rows will be operated in one interation. 
-        _mm_storeu_ps(&output[m][h][w], initValue);
-        _mm_storeu_ps(&output[m][h + 1][w], initValue);
-        _mm_storeu_ps(&output[m][h + 2][w], initValue);
-        _mm_storeu_ps(&output[m][h + 3][w], initValue);
-      }
-    }
+    fprintf(stderr, "FATAL: %s is not a version %d tensor file\n", path, TENSOR_FILE_VERSION);
+    exit(1);
+  }
+  if (header->kind != kind || header->file_bytes > (uint64_t)st.st_size ||
+      header->data_offset % TENSOR_FILE_ALIGN != 0)
+  {
+    fprintf(stderr, "FATAL: %s has the wrong kind or a damaged header\n", path);
+    exit(1);
   }
+  return base;
+}
+
+/* load a dense 3d tensor file without copying the data */
+float ***load_dense_3d_file(const char *path, int dim0, int dim1, int dim2)
+{
+  struct tensor_file_header header;
+  char *base = map_tensor_file(path, TENSOR_FILE_DENSE, &header);
 
-  // Handle the rest parts.
-  // I put m (nkernels) as the innermost loop to avoid unnecessary for loop when the width or height is exactly divided by 4.
-  // Handle part 2
-  for (h = height - height % 4; h < height; h++)
+  if (header.ndims != 3 || header.dims[0] != dim0 || header.dims[1] != dim1 ||
+      header.dims[2] != dim2)
   {
-    for (w = 0; w < width; w++)
-    {
-      for (m = 0; m < nkernels; m++)
-      {
-        output[m][h][w] = 0.0;
-      }
-    }
+    fprintf(stderr, "FATAL: %s does not hold a %d x %d x %d tensor\n",
+            path, dim0, dim1, dim2);
+    exit(1);
   }
-  // Handle part 3
-  for (h = 0; h < height - height % 4 && (width % 4 != 0); h++)
+  if (header.data_offset + (uint64_t)dim0 * dim1 * dim2 * sizeof(float) > header.file_bytes)
   {
-    for (w = width - width % 4; w < width; w++)
-    {
-      for (m = 0; m < nkernels; m++)
-      {
-        output[m][h][w] = 0.0;
-      }
-    }
+    fprintf(stderr, "FATAL: %s is truncated\n", path);
+    exit(1);
   }
+  return view_3d_matrix((float *)(base + header.data_offset), dim0, dim1, dim2);
+}
 
+/* check that an array of the given size at the given offset is aligned
+   and lies between the end of the entry table and the end of the file;
+   written without adding to the offset so a damaged one cannot wrap */
+int tensor_file_array_fits(uint64_t offset, uint64_t nbytes, uint64_t table_end,
+                           uint64_t file_bytes)
+{
+  return offset % TENSOR_FILE_ALIGN == 0 && offset >= table_end &&
+         offset <= file_bytes && nbytes <= file_bytes - offset;
+}
 
-// now compute multichannel, multikernel convolution
+/* map a file of sparse kernels of the given kind without copying; the
+   sparse matrices point straight into the mapped file. If extra is not
+   NULL it is set to the record stored after the header */
+struct sparse_matrix ***map_sparse_kernels_file(const char *path, uint32_t kind,
+                                                void **extra, size_t extra_bytes,
+                                                int kernel_order, int nkernels,
+                                                int nchannels)
+{
+  struct tensor_file_header header;
+  struct tensor_file_sparse_entry *entries;
+  struct sparse_matrix ***result;
+  struct sparse_matrix **temp;
+  char *base = map_tensor_file(path, kind, &header);
+  uint64_t table_end;
+  int i, j, m;
 
-// First handle the part 1 that both the length and width exactly divisible by 4.
-// If input dataset reached threshold then OpenMP_flag = 1 and program will use OpenMP to speedup.
-#pragma omp parallel for if (OpenMP_flag) private(w, h, m, x, y) shared(kernels, image, output)
-  // I got some ideas when I read multichannel_conv_dense(), so I put m’s for loop as the outermost loop in convolution part. 
-  // In this order, I can implement the SSE on h (height).
-  for (m = 0; m < nkernels; m++)
+  if (tensor_file_align(sizeof(header)) + extra_bytes > header.data_offset)
   {
-    // Using loop unrolling to speedup and calculate four colums in one iteration.
-    for (w = 0; w < width - width % 4; w += 4)
+    fprintf(stderr, "FATAL: %s has a damaged header\n", path);
+    exit(1);
+  }
+  if (extra != NULL)
+  {
+    *extra = base + tensor_file_align(sizeof(header));
+  }
+
+  if (header.ndims != 4 || header.dims[0] != kernel_order ||
+      header.dims[1] != kernel_order || header.dims[2] != nkernels ||
+      header.dims[3] != nchannels)
+  {
+    fprintf(stderr, "FATAL: %s does not hold %d x %d kernels of %d x %d\n",
+            path, kernel_order, kernel_order, nkernels, nchannels);
+    exit(1);
+  }
+
+  table_end = header.data_offset +
+              (uint64_t)kernel_order * kernel_order * sizeof(struct tensor_file_sparse_entry);
+  if (table_end > header.file_bytes)
+  {
+    fprintf(stderr, "FATAL: %s is truncated\n", path);
+    exit(1);
+  }
+  entries = (struct tensor_file_sparse_entry *)(base + header.data_offset);
+  result = malloc(sizeof(struct sparse_matrix **) * kernel_order);
+  temp = malloc(sizeof(struct sparse_matrix *) * kernel_order * kernel_order);
+
+  for (i = 0; i < kernel_order; i++)
+  {
+    result[i] = &(temp[i * kernel_order]);
+    for (j = 0; j < kernel_order; j++)
     {
-      // Using SSE to speedup and calculate four rows each time.
-      for (h = 0; h < height - height % 4; h += 4)
+      struct tensor_file_sparse_entry *entry = &entries[i * kernel_order + j];
+      struct sparse_matrix *kernel = malloc(sizeof(struct sparse_matrix));
+
+      // a kernel position holds at most one non-zero for each kernel
+      // and channel, which also keeps the array sizes below from
+      // overflowing
+      if (entry->non_zeros < 0 || entry->non_zeros > (int64_t)nkernels * nchannels ||
+          entry->non_zeros > INT_MAX)
       {
-        // double sum = 0.0;
-        __m128 sum1 = _mm_setzero_ps();
-        __m128 sum2 = _mm_setzero_ps();
-        __m128 sum3 = _mm_setzero_ps();
-        __m128 sum4 = _mm_setzero_ps();
-        for (x = 0; x < kernel_order; x++)
+        fprintf(stderr, "FATAL: %s has a damaged entry table\n", path);
+        exit(1);
+      }
+      if (!tensor_file_array_fits(entry->kernel_starts_offset, sizeof(int) * (uint64_t)(nkernels + 1),
+                                  table_end, header.file_bytes) ||
+          !tensor_file_array_fits(entry->channel_numbers_offset, sizeof(int) * (uint64_t)entry->non_zeros,
+                                  table_end, header.file_bytes) ||
+          !tensor_file_array_fits(entry->values_offset, sizeof(float) * (uint64_t)entry->non_zeros,
+                                  table_end, header.file_bytes))
+      {
+        fprintf(stderr, "FATAL: %s is truncated\n", path);
+        exit(1);
+      }
+
+      kernel->nkernels = nkernels;
+      kernel->nchannels = nchannels;
+      kernel->non_zeros = entry->non_zeros;
+      kernel->kernel_starts = (int *)(base + entry->kernel_starts_offset);
+      kernel->channel_numbers = (int *)(base + entry->channel_numbers_offset);
+      kernel->values = (float *)(base + entry->values_offset);
+      kernel->values_f16 = NULL;
+      kernel->index_encoding = INDEX_INT32;
+      kernel->channel_numbers16 = NULL;
+      kernel->channel_deltas = NULL;
+      kernel->delta_starts = NULL;
+
+      // the convolution routines trust these, so check them once here
+      if (kernel->kernel_starts[0] != 0 || kernel->kernel_starts[nkernels] != kernel->non_zeros)
+      {
+        fprintf(stderr, "FATAL: %s has inconsistent kernel starts\n", path);
+        exit(1);
+      }
+      for (m = 0; m < nkernels; m++)
+      {
+        if (kernel->kernel_starts[m] > kernel->kernel_starts[m + 1])
         {
-          for (y = 0; y < kernel_order; y++)
-          {
-            struct sparse_matrix *kernel = kernels[x][y];
-            for (index = kernel->kernel_starts[m]; index < kernel->kernel_starts[m + 1]; index++)
-            {
-              int this_c = kernel->channel_numbers[index];
-              assert((this_c >= 0) && (this_c < nchannels));
+          fprintf(stderr, "FATAL: %s has inconsistent kernel starts\n", path);
+          exit(1);
+        }
+      }
+      for (m = 0; m < kernel->non_zeros; m++)
+      {
+        if (kernel->channel_numbers[m] < 0 || kernel->channel_numbers[m] >= nchannels)
+        {
+          fprintf(stderr, "FATAL: %s has a channel number out of range\n", path);
+          exit(1);
+        }
+      }
+      result[i][j] = kernel;
+    }
+  }
+  return result;
+}
 
-              // value = kernel->values[index];
-              // Load four copies of value.
-              __m128 value = _mm_set1_ps(kernel->values[index]);
+/* load a sparse kernels file without copying */
+struct sparse_matrix ***load_sparse_kernels_file(const char *path, int kernel_order,
+                                                 int nkernels, int nchannels)
+{
+  return map_sparse_kernels_file(path, TENSOR_FILE_SPARSE_KERNELS, NULL, 0,
+                                 kernel_order, nkernels, nchannels);
+}
 
-              // output[m][h][w] += image[w + x][h + y][this_c] * value;
-              // Load four elements in height and calculate four multiplication at same time.
-              // Becasue of the loop unrolling, four elements in width will be assigned in one iteration.
-              __m128 value1 = _mm_setr_ps(image[w + x][h + y][this_c], image[w + x][h + y + 1][this_c], image[w + x][h + y + 2][this_c], image[w + x][h + y + 3][this_c]);
-              value1 = _mm_mul_ps(value1, value);
+/* Convolution plans
 
-              __m128 value2 = _mm_setr_ps(image[w + x + 1][h + y][this_c], image[w + x + 1][h + y + 1][this_c], image[w + x + 1][h + y + 2][this_c], image[w + x + 1][h + y + 3][this_c]);
-              value2 = _mm_mul_ps(value2, value);
+   A plan holds the kernels after the preprocessing that the team
+   convolution needs: the conversion to the sparse format, the compact
+   channel numbers of -index and the channel order that -reorder
+   chooses. Plans are cached on disk with -plan-cache, in files named
+   by a hash of the kernel weights, so that later runs with the same
+   weights map the preprocessed kernels straight from the cache instead
+   of converting them again. The flags of the plan record say which
+   optional steps the file holds; a run that needs a step the cached
+   plan lacks does it and saves the plan again. The plan record is
+   versioned so that the cache never hands back a plan built by an
+   older preprocessing. */
 
-              __m128 value3 = _mm_setr_ps(image[w + x + 2][h + y][this_c], image[w + x + 2][h + y + 1][this_c], image[w + x + 2][h + y + 2][this_c], image[w + x + 2][h + y + 3][this_c]);
-              value3 = _mm_mul_ps(value3, value);
+#define CONV_PLAN_VERSION 2
 
-              __m128 value4 = _mm_setr_ps(image[w + x + 3][h + y][this_c], image[w + x + 3][h + y + 1][this_c], image[w + x + 3][h + y + 2][this_c], image[w + x + 3][h + y + 3][this_c]);
-              value4 = _mm_mul_ps(value4, value);
+// optional preprocessing steps stored in a plan file
+enum conv_plan_flags
+{
+  PLAN_INDEX_UINT16 = 1,  // channel_numbers16 of every kernel position
+  PLAN_INDEX_DELTA8 = 2,  // channel_deltas and delta_starts of every kernel position
+  PLAN_CHANNEL_ORDER = 4  // the channel order chosen by plan_channel_order
+};
 
-              // Four additions each time and four loop unrolling in one iteration.
-              sum1 = _mm_add_ps(sum1, value1);
-              sum2 = _mm_add_ps(sum2, value2);
-              sum3 = _mm_add_ps(sum3, value3);
-              sum4 = _mm_add_ps(sum4, value4);
-            }
-          } // y
-        }   // x
+// the choices made when a plan was built; stored in the plan file
+struct conv_plan_record
+{
+  uint32_t version;
+  uint32_t flags; // conv_plan_flags of the steps stored
+  uint64_t weights_hash;
+  int64_t non_zeros;
+  uint64_t index_table_offset; // a conv_plan_index_entry per kernel position
+  uint64_t order_offset;       // nchannels ints, order[new] = old channel
+};
 
-        // Load to result sum to output
-        float sum[4];
-        _mm_storeu_ps(sum, sum1);
-        output[m][h][w] = sum[0];
-        output[m][h + 1][w] = sum[1];
-        output[m][h + 2][w] = sum[2];
-        output[m][h + 3][w] = sum[3];
+// location of the compact channel numbers of one kernel position
+struct conv_plan_index_entry
+{
+  uint64_t indices_offset;      // channel_numbers16 or channel_deltas
+  uint64_t indices_bytes;
+  uint64_t delta_starts_offset; // PLAN_INDEX_DELTA8 only
+};
 
-        _mm_storeu_ps(sum, sum2);
-        output[m][h][w + 1] = sum[0];
-        output[m][h + 1][w + 1] = sum[1];
-        output[m][h + 2][w + 1] = sum[2];
-        output[m][h + 3][w + 1] = sum[3];
+// preprocessed kernels ready for the team convolution
+struct conv_plan
+{
+  int kernel_order;
+  int nkernels;
+  int nchannels;
+  struct conv_plan_record record;
+  struct sparse_matrix ***kernels;
+  int *order; // channel order for -reorder, NULL until planned
+};
 
-        _mm_storeu_ps(sum, sum3);
-        output[m][h][w + 2] = sum[0];
-        output[m][h + 1][w + 2] = sum[1];
-        output[m][h + 2][w + 2] = sum[2];
-        output[m][h + 3][w + 2] = sum[3];
+/* hash of the shape of a convolution, mixed into every weights hash */
+uint64_t hash_conv_shape(int kernel_order, int nkernels, int nchannels)
+{
+  uint32_t shape[4] = {CONV_PLAN_VERSION, kernel_order, nkernels, nchannels};
 
-        _mm_storeu_ps(sum, sum4);
-        output[m][h][w + 3] = sum[0];
-        output[m][h + 1][w + 3] = sum[1];
-        output[m][h + 2][w + 3] = sum[2];
-        output[m][h + 3][w + 3] = sum[3];
-      } // h
-    }   // w
-  }     // m
+  return fnv1a_words(FNV1A_INIT, shape, 4);
+}
 
-  // Then handle the part 2 that leaves in right.
-  for (w = width - width % 4; w < width; w++)
+/* content hash of dense kernels made by new_empty_4d_matrix */
+uint64_t hash_dense_kernels(float ****kernels, int kernel_order, int nkernels, int nchannels)
+{
+  return fnv1a_words(hash_conv_shape(kernel_order, nkernels, nchannels),
+                     (const uint32_t *)&(kernels[0][0][0][0]),
+                     (long long)kernel_order * kernel_order * nkernels * nchannels);
+}
+
+/* content hash of sparse kernels; the same weights in the dense and the
+   sparse form hash differently, which only costs an extra cache entry */
+uint64_t hash_sparse_kernels(struct sparse_matrix ***kernels, int kernel_order,
+                             int nkernels, int nchannels)
+{
+  uint64_t hash = hash_conv_shape(kernel_order, nkernels, nchannels);
+  int x, y;
+
+  for (x = 0; x < kernel_order; x++)
   {
-    for (h = 0; h < height; h++)
+    for (y = 0; y < kernel_order; y++)
     {
-      for (x = 0; x < kernel_order; x++)
+      struct sparse_matrix *kernel = kernels[x][y];
+      hash = fnv1a_words(hash, (const uint32_t *)kernel->kernel_starts, nkernels + 1);
+      hash = fnv1a_words(hash, (const uint32_t *)kernel->channel_numbers, kernel->non_zeros);
+      hash = fnv1a_words(hash, (const uint32_t *)kernel->values, kernel->non_zeros);
+    }
+  }
+  return hash;
+}
+
+/* build a plan from kernels that are already in the sparse format */
+struct conv_plan *conv_plan_from_sparse(struct sparse_matrix ***kernels, uint64_t weights_hash,
+                                        int kernel_order, int nkernels, int nchannels)
+{
+  struct conv_plan *plan = malloc(sizeof(struct conv_plan));
+  int x, y;
+
+  plan->kernel_order = kernel_order;
+  plan->nkernels = nkernels;
+  plan->nchannels = nchannels;
+  plan->kernels = kernels;
+  plan->order = NULL;
+
+  memset(&plan->record, 0, sizeof(plan->record));
+  plan->record.version = CONV_PLAN_VERSION;
+  plan->record.weights_hash = weights_hash;
+  for (x = 0; x < kernel_order; x++)
+  {
+    for (y = 0; y < kernel_order; y++)
+    {
+      plan->record.non_zeros += kernels[x][y]->non_zeros;
+    }
+  }
+  return plan;
+}
+
+/* build a plan from dense kernels */
+struct conv_plan *conv_plan_from_dense(float ****kernels, uint64_t weights_hash,
+                                       int kernel_order, int nkernels, int nchannels)
+{
+  return conv_plan_from_sparse(kernels_dense2sparse(kernels, kernel_order, nkernels, nchannels),
+                               weights_hash, kernel_order, nkernels, nchannels);
+}
+
+/* name of the cache file of the plan for some weights */
+void conv_plan_path(char *path, size_t size, const char *dir, uint64_t weights_hash)
+{
+  snprintf(path, size, "%s/plan-%016llx.bin", dir, (unsigned long long)weights_hash);
+}
+
+/* check that the compact channel numbers of a sparse matrix give the
+   same channels as channel_numbers */
+int sparse_matrix_indices_agree(const struct sparse_matrix *kernel)
+{
+  int m, index;
+
+  for (m = 0; m < kernel->nkernels; m++)
+  {
+    int delta = (kernel->index_encoding == INDEX_DELTA8) ? kernel->delta_starts[m] : 0;
+    int previous = -1;
+
+    for (index = kernel->kernel_starts[m]; index < kernel->kernel_starts[m + 1]; index++)
+    {
+      int c;
+      if (kernel->index_encoding == INDEX_UINT16)
       {
-        for (y = 0; y < kernel_order; y++)
-        {
-          struct sparse_matrix *kernel = kernels[x][y];
-          for (m = 0; m < nkernels; m++)
-          {
-            for (index = kernel->kernel_starts[m]; index < kernel->kernel_starts[m + 1]; index++)
-            {
-              int this_c = kernel->channel_numbers[index];
-              assert((this_c >= 0) && (this_c < nchannels));
-              value = kernel->values[index];
-              output[m][h][w] += image[w + x][h + y][this_c] * value;
-            }
-          } // m
-        }   // y
-      }     // x
-    }       // h
-  }         // w
+        c = kernel->channel_numbers16[index];
+      }
+      else if (kernel->channel_deltas[delta] != 0)
+      {
+        c = previous + kernel->channel_deltas[delta++];
+      }
+      else
+      {
+        c = kernel->channel_deltas[delta + 1] | (kernel->channel_deltas[delta + 2] << 8);
+        delta += 3;
+      }
+      if (c != kernel->channel_numbers[index])
+      {
+        return 0;
+      }
+      previous = c;
+    }
+    if (kernel->index_encoding == INDEX_DELTA8 && delta != kernel->delta_starts[m + 1])
+    {
+      return 0;
+    }
+  }
+  return 1;
+}
 
-  // Then handle the part 3 that leaves in bottom.
-  for (w = 0; w < width - width % 4 && (height % 4 != 0); w++)
+/* point a mapped plan at the optional steps stored in its file */
+void conv_plan_map_steps(const char *path, char *base, struct conv_plan *plan)
+{
+  const struct tensor_file_header *header = (const struct tensor_file_header *)base;
+  const struct conv_plan_record *record = &plan->record;
+  int npositions = plan->kernel_order * plan->kernel_order;
+  int p;
+
+  plan->order = NULL;
+  if (record->flags & (PLAN_INDEX_UINT16 | PLAN_INDEX_DELTA8))
   {
-    for (h = height - height % 4; h < height; h++)
+    const struct conv_plan_index_entry *entries =
+        (const struct conv_plan_index_entry *)(base + record->index_table_offset);
+
+    if (record->index_table_offset + sizeof(struct conv_plan_index_entry) * npositions >
+        header->file_bytes)
     {
-      for (x = 0; x < kernel_order; x++)
+      fprintf(stderr, "FATAL: %s is truncated\n", path);
+      exit(1);
+    }
+    for (p = 0; p < npositions; p++)
+    {
+      struct sparse_matrix *kernel = plan->kernels[p / plan->kernel_order][p % plan->kernel_order];
+      const struct conv_plan_index_entry *entry = &entries[p];
+
+      if (entry->indices_offset + entry->indices_bytes > header->file_bytes ||
+          ((record->flags & PLAN_INDEX_DELTA8) &&
+           entry->delta_starts_offset + sizeof(int) * (plan->nkernels + 1) > header->file_bytes))
       {
-        for (y = 0; y < kernel_order; y++)
+        fprintf(stderr, "FATAL: %s is truncated\n", path);
+        exit(1);
+      }
+      if (record->flags & PLAN_INDEX_UINT16)
+      {
+        kernel->channel_numbers16 = (uint16_t *)(base + entry->indices_offset);
+        kernel->index_encoding = INDEX_UINT16;
+        if (entry->indices_bytes != sizeof(uint16_t) * kernel->non_zeros)
         {
-          struct sparse_matrix *kernel = kernels[x][y];
-          for (m = 0; m < nkernels; m++)
-          {
-            for (index = kernel->kernel_starts[m]; index < kernel->kernel_starts[m + 1]; index++)
-            {
-              int this_c = kernel->channel_numbers[index];
-              assert((this_c >= 0) && (this_c < nchannels));
-              value = kernel->values[index];
-              output[m][h][w] += image[w + x][h + y][this_c] * value;
-            }
-          } // m
-        }   // y
-      }     // x
-    }       // h
-  }         // w
+          kernel->index_encoding = -1;
+        }
+      }
+      else
+      {
+        kernel->channel_deltas = (uint8_t *)(base + entry->indices_offset);
+        kernel->delta_starts = (int *)(base + entry->delta_starts_offset);
+        kernel->index_encoding = INDEX_DELTA8;
+        if (kernel->delta_starts[0] != 0 ||
+            (uint64_t)kernel->delta_starts[plan->nkernels] != entry->indices_bytes)
+        {
+          kernel->index_encoding = -1;
+        }
+      }
+      // the convolution trusts these as much as channel_numbers
+      if (kernel->index_encoding < 0 || !sparse_matrix_indices_agree(kernel))
+      {
+        fprintf(stderr, "FATAL: %s has inconsistent channel numbers\n", path);
+        exit(1);
+      }
+    }
+  }
+  if (record->flags & PLAN_CHANNEL_ORDER)
+  {
+    if (record->order_offset + sizeof(int) * plan->nchannels > header->file_bytes)
+    {
+      fprintf(stderr, "FATAL: %s is truncated\n", path);
+      exit(1);
+    }
+    plan->order = (int *)(base + record->order_offset);
+  }
 }
 
-int main(int argc, char **argv)
+/* map a cached plan; returns NULL if there is no usable cached plan */
+struct conv_plan *conv_plan_load(const char *dir, uint64_t weights_hash,
+                                 int kernel_order, int nkernels, int nchannels)
 {
-  //float image[W][H][C];
-  //float kernels[M][C][K][K];
-  //float output[M][W][H];
+  struct conv_plan *plan;
+  struct conv_plan_record *record;
+  char path[4096];
 
-  float ***image;
-  float ****kernels;
-  struct sparse_matrix ***sparse_kernels = NULL;
-  float ***control_output, ***output;
-  long long mul_time;
-  int width, height, kernel_order, nchannels, nkernels;
-  struct timeval start_time;
-  struct timeval stop_time;
-  int nz_ratio = 1; // by default we just have a dense matrix
+  conv_plan_path(path, sizeof(path), dir, weights_hash);
+  if (access(path, R_OK) != 0)
+  {
+    return NULL;
+  }
 
-  if (argc != 7)
+  plan = malloc(sizeof(struct conv_plan));
+  plan->kernels = map_sparse_kernels_file(path, TENSOR_FILE_KERNEL_PLAN, (void **)&record,
+                                          sizeof(struct conv_plan_record),
+                                          kernel_order, nkernels, nchannels);
+  if (record->version != CONV_PLAN_VERSION || record->weights_hash != weights_hash)
   {
-    fprintf(stderr, "Usage: conv-harness <image_width> <image_height> <kernel_order> <number of channels> <number of kernels> <non-zero ratio>\n");
-    exit(1);
+    // a stale plan; it will be rebuilt and overwritten
+    free(plan);
+    return NULL;
   }
-  else
+  plan->kernel_order = kernel_order;
+  plan->nkernels = nkernels;
+  plan->nchannels = nchannels;
+  plan->record = *record;
+  conv_plan_map_steps(path, (char *)record - tensor_file_align(sizeof(struct tensor_file_header)),
+                      plan);
+  return plan;
+}
+
+/* add the optional steps of a plan to the end of its plan file, which
+   is file_bytes long, and point the record in the file at them; returns
+   0 if the file cannot be updated */
+int conv_plan_append_steps(const char *path, struct conv_plan_record *record,
+                           uint64_t file_bytes, const struct conv_plan *plan)
+{
+  struct tensor_file_header header;
+  struct conv_plan_index_entry *entries;
+  int npositions = plan->kernel_order * plan->kernel_order;
+  uint64_t offset = file_bytes;
+  int p, failed;
+  FILE *file = fopen(path, "r+b");
+
+  if (file == NULL)
   {
-    width = atoi(argv[1]);
-    height = atoi(argv[2]);
-    kernel_order = atoi(argv[3]);
-    nchannels = atoi(argv[4]);
-    nkernels = atoi(argv[5]);
-    nz_ratio = atoi(argv[6]);
+    return 0;
   }
-  switch (kernel_order)
+  if (fread(&header, sizeof(header), 1, file) != 1)
   {
-  case 1:
-  case 3:
-  case 5:
-  case 7:
-    break;
-  default:
-    fprintf(stderr, "FATAL: kernel_order must be 1, 3, 5 or 7, not %d\n",
-            kernel_order);
-    exit(1);
+    fclose(file);
+    return 0;
   }
 
-  assert(width >= 1);
-  assert(height >= 1);
-  assert(nchannels >= 1);
-  assert(nkernels >= 1);
-  assert(nz_ratio >= 1);
+  // lay out the arrays; each keeps the spare element that
+  // sparse_matrix_encode_indices allocates
+  entries = calloc(npositions, sizeof(struct conv_plan_index_entry));
+  assert(entries != NULL);
+  if (record->flags & (PLAN_INDEX_UINT16 | PLAN_INDEX_DELTA8))
+  {
+    record->index_table_offset = offset;
+    offset = tensor_file_align(offset + sizeof(struct conv_plan_index_entry) * npositions);
+    for (p = 0; p < npositions; p++)
+    {
+      struct sparse_matrix *kernel = plan->kernels[p / plan->kernel_order][p % plan->kernel_order];
+      if (record->flags & PLAN_INDEX_UINT16)
+      {
+        entries[p].indices_bytes = sizeof(uint16_t) * kernel->non_zeros;
+      }
+      else
+      {
+        entries[p].delta_starts_offset = offset;
+        offset = tensor_file_align(offset + sizeof(int) * (plan->nkernels + 1));
+        entries[p].indices_bytes = kernel->delta_starts[plan->nkernels];
+      }
+      entries[p].indices_offset = offset;
+      offset = tensor_file_align(offset + entries[p].indices_bytes + sizeof(uint16_t));
+    }
+  }
+  if (record->flags & PLAN_CHANNEL_ORDER)
+  {
+    record->order_offset = offset;
+    offset = tensor_file_align(offset + sizeof(int) * plan->nchannels);
+  }
 
-  /* allocate the matrices */
-  image = gen_random_3d_matrix(width + kernel_order, height + kernel_order,
-                               nchannels, 1); // nz_ratio == 1, ie no sparsity
-  kernels = gen_random_4d_matrix(kernel_order, kernel_order, nkernels, nchannels, nz_ratio);
-  if (nz_ratio > 1)
-  { // we have sparsity
-    sparse_kernels = kernels_dense2sparse(kernels, kernel_order, nkernels, nchannels);
+  fseek(file, 0, SEEK_END);
+  if (record->flags & (PLAN_INDEX_UINT16 | PLAN_INDEX_DELTA8))
+  {
+    tensor_file_pad(file, record->index_table_offset);
+    fwrite(entries, sizeof(struct conv_plan_index_entry), npositions, file);
+    for (p = 0; p < npositions; p++)
+    {
+      struct sparse_matrix *kernel = plan->kernels[p / plan->kernel_order][p % plan->kernel_order];
+      if (record->flags & PLAN_INDEX_UINT16)
+      {
+        tensor_file_pad(file, entries[p].indices_offset);
+        fwrite(kernel->channel_numbers16, 1, entries[p].indices_bytes, file);
+      }
+      else
+      {
+        tensor_file_pad(file, entries[p].delta_starts_offset);
+        fwrite(kernel->delta_starts, sizeof(int), plan->nkernels + 1, file);
+        tensor_file_pad(file, entries[p].indices_offset);
+        fwrite(kernel->channel_deltas, 1, entries[p].indices_bytes, file);
+      }
+    }
   }
+  if (record->flags & PLAN_CHANNEL_ORDER)
+  {
+    tensor_file_pad(file, record->order_offset);
+    fwrite(plan->order, sizeof(int), plan->nchannels, file);
+  }
+  tensor_file_pad(file, offset);
 
-  output = new_empty_3d_matrix(nkernels, width, height);
+  // and then the lengths and offsets at the start
+  header.file_bytes = offset;
+  fseek(file, 0, SEEK_SET);
+  fwrite(&header, sizeof(header), 1, file);
+  fseek(file, tensor_file_align(sizeof(header)), SEEK_SET);
+  fwrite(record, sizeof(*record), 1, file);
+  failed = ferror(file);
+  failed |= fclose(file) != 0;
+  free(entries);
+  return !failed;
+}
 
-  control_output = new_empty_3d_matrix(nkernels, width, height);
+/* make the team convolution read the channel numbers of a plan in an
+   encoding; returns 1 if the plan had to be encoded, and so differs
+   from its cached copy */
+int conv_plan_use_encoding(struct conv_plan *plan, int encoding)
+{
+  int x, y;
 
-  /* use a simple multichannel convolution routine to produce control result */
-  multichannel_conv_dense(image, kernels, control_output, width,
-                          height, nchannels, nkernels, kernel_order);
+  if (encoding == INDEX_INT32)
+  {
+    // channel_numbers are always kept, whatever else is stored
+    for (x = 0; x < plan->kernel_order; x++)
+    {
+      for (y = 0; y < plan->kernel_order; y++)
+      {
+        plan->kernels[x][y]->index_encoding = INDEX_INT32;
+      }
+    }
+    return 0;
+  }
+  if (plan->kernels[0][0]->index_encoding == encoding)
+  {
+    return 0;
+  }
+  kernels_encode_indices(plan->kernels, plan->kernel_order, encoding);
+  return 1;
+}
 
-  /* record starting time of team's code*/
-  gettimeofday(&start_time, NULL);
+/* save a plan to the cache; the file is written under a temporary name
+   and renamed so that a concurrent run never maps a partial plan.
+   Returns 0, with a warning, if the plan cannot be saved; the run goes
+   on without the cache */
+int conv_plan_save(const char *dir, const struct conv_plan *plan)
+{
+  struct conv_plan_record record = plan->record;
+  int encoding = plan->kernels[0][0]->index_encoding;
+  uint64_t file_bytes;
+  char path[4096];
+  char temp_path[4200];
 
-  if (nz_ratio > 1)
-  { // we're working on a sparse matrix
-    /* perform student team's sparse multichannel convolution */
-    team_conv_sparse(image, sparse_kernels, output, width,
-                     height, nchannels, nkernels, kernel_order);
+  record.flags = 0;
+  record.index_table_offset = 0;
+  record.order_offset = 0;
+  if (encoding == INDEX_UINT16)
+  {
+    record.flags |= PLAN_INDEX_UINT16;
   }
-  else
-  { // we're working on a dense matrix
-    multichannel_conv_dense(image, kernels, output, width,
-                            height, nchannels, nkernels, kernel_order);
+  else if (encoding == INDEX_DELTA8)
+  {
+    record.flags |= PLAN_INDEX_DELTA8;
+  }
+  if (plan->order != NULL)
+  {
+    record.flags |= PLAN_CHANNEL_ORDER;
   }
-  /* record finishing time */
-  gettimeofday(&stop_time, NULL);
 
-  mul_time = (stop_time.tv_sec - start_time.tv_sec) * 1000000L +
-             (stop_time.tv_usec - start_time.tv_usec);
-  printf("Team conv time: %lld microseconds\n", mul_time);
+  conv_plan_path(path, sizeof(path), dir, plan->record.weights_hash);
+  snprintf(temp_path, sizeof(temp_path), "%s.%d.tmp", path, (int)getpid());
+  file_bytes = write_sparse_kernels_file(temp_path, TENSOR_FILE_KERNEL_PLAN, &record,
+                                         sizeof(record), plan->kernels,
+                                         plan->kernel_order, plan->nkernels, plan->nchannels);
+  if (file_bytes == 0 || (record.flags != 0 &&
+                          !conv_plan_append_steps(temp_path, &record, file_bytes, plan)) ||
+      rename(temp_path, path) != 0)
+  {
+    fprintf(stderr, "WARNING: cannot write plan cache file %s\n", path);
+    unlink(temp_path);
+    return 0;
+  }
+  return 1;
+}
+
+/* check the sum of absolute differences is within reasonable epsilon */
+void check_result(float ***result, float ***control,
+                  int dim0, int dim1, int dim2)
+{
+  int i, j, k;
+  double sum_abs_diff = 0.0;
+  const double EPSILON = 0.0625;
+
+  DEBUGGING(printf("SAD\n"));
+
+  for (i = 0; i < dim0; i++)
+  {
+    for (j = 0; j < dim1; j++)
+    {
+      for (k = 0; k < dim2; k++)
+      {
+        double diff = fabs(control[i][j][k] - result[i][j][k]);
+        assert(diff >= 0.0);
+        sum_abs_diff = sum_abs_diff + diff;
+      }
+    }
+  }
+
+  if (sum_abs_diff > EPSILON)
+  {
+    fprintf(stderr, "WARNING: sum of absolute differences (%f) > EPSILON (%f)\n",
+            sum_abs_diff, EPSILON);
+  }
+  else
+  {
+    printf("COMMENT: sum of absolute differences (%f)  within acceptable range (%f)\n", sum_abs_diff, EPSILON);
+  }
+}
+
+/* number of output values sampled into a golden cache entry */
+#define GOLDEN_SAMPLES 64
+
+/* version of the random generators and of the golden cache entries;
+   bump it whenever a change to the generators alters the inputs made
+   from a seed, so that older entries stop matching */
+#define GOLDEN_VERSION 2
+
+// the inputs that fully determine the control output when the random
+// generators are seeded with -seed
+struct golden_key
+{
+  int version;
+  long long seed;
+  int width;
+  int height;
+  int kernel_order;
+  int nchannels;
+  int nkernels;
+  int nz_ratio;
+};
+
+// a compact record of a control output: a hash of every value, which
+// detects bit-exact results, plus a sample of the values themselves,
+// which allows the usual epsilon check on results that are not bit-exact
+struct golden_entry
+{
+  uint64_t hash;
+  float samples[GOLDEN_SAMPLES];
+};
+
+/* FNV-1a hash of the bit patterns of a 3d matrix; the matrix must have
+   been allocated by new_empty_3d_matrix so that its data is contiguous */
+uint64_t hash_3d_matrix(float ***a, int dim0, int dim1, int dim2)
+{
+  return fnv1a_words(FNV1A_INIT, (const uint32_t *)&(a[0][0][0]),
+                     (long long)dim0 * dim1 * dim2);
+}
+
+/* position in a contiguous 3d matrix of the i'th golden sample; the
+   samples are spread evenly over the matrix with a small jitter */
+long long golden_sample_position(int i, long long total)
+{
+  long long stride = total / GOLDEN_SAMPLES;
+
+  if (stride < 1)
+  {
+    return i % total;
+  }
+  return i * stride + ((long long)i * 7919) % stride;
+}
+
+/* record the hash and the samples of a control output */
+void golden_record(float ***control, int dim0, int dim1, int dim2,
+                   struct golden_entry *entry)
+{
+  const float *data = &(control[0][0][0]);
+  long long total = (long long)dim0 * dim1 * dim2;
+  int i;
+
+  entry->hash = hash_3d_matrix(control, dim0, dim1, dim2);
+  for (i = 0; i < GOLDEN_SAMPLES; i++)
+  {
+    entry->samples[i] = data[golden_sample_position(i, total)];
+  }
+}
+
+/* look up a key in the golden cache file; returns 1 and fills in entry
+   on a hit, 0 if the file or the key does not exist */
+int golden_cache_lookup(const char *path, const struct golden_key *key,
+                        struct golden_entry *entry)
+{
+  FILE *file = fopen(path, "r");
+  char line[8192];
+  int found = 0;
+
+  if (file == NULL)
+  {
+    return 0;
+  }
+
+  while (!found && fgets(line, sizeof(line), file) != NULL)
+  {
+    struct golden_key k;
+    unsigned long long hash;
+    int consumed, i;
+    char *p;
+
+    if (line[0] == '#')
+    {
+      continue;
+    }
+    // entries written before the version field start with a digit and
+    // never match
+    if (sscanf(line, "v%d %lld %d %d %d %d %d %d %llx%n", &k.version, &k.seed,
+               &k.width, &k.height, &k.kernel_order, &k.nchannels,
+               &k.nkernels, &k.nz_ratio, &hash, &consumed) != 9)
+    {
+      continue;
+    }
+    if (k.version != key->version || k.seed != key->seed || k.width != key->width ||
+        k.height != key->height || k.kernel_order != key->kernel_order ||
+        k.nchannels != key->nchannels || k.nkernels != key->nkernels ||
+        k.nz_ratio != key->nz_ratio)
+    {
+      continue;
+    }
+
+    // the samples are written as hexadecimal floats so they are exact
+    p = line + consumed;
+    for (i = 0; i < GOLDEN_SAMPLES; i++)
+    {
+      char *end;
+      entry->samples[i] = strtof(p, &end);
+      if (end == p)
+      {
+        break;
+      }
+      p = end;
+    }
+    if (i == GOLDEN_SAMPLES)
+    {
+      entry->hash = hash;
+      found = 1;
+    }
+  }
+
+  fclose(file);
+  return found;
+}
+
+/* append a new entry to the golden cache file */
+void golden_cache_store(const char *path, const struct golden_key *key,
+                        const struct golden_entry *entry)
+{
+  FILE *file = fopen(path, "a");
+  int i;
+
+  if (file == NULL)
+  {
+    fprintf(stderr, "WARNING: cannot write golden cache file %s\n", path);
+    return;
+  }
+
+  // start a new file with a description of the format
+  if (ftell(file) == 0)
+  {
+    fprintf(file, "# conv-harness golden cache version %d: v<version> seed "
+                  "width height order channels kernels nz_ratio hash %d "
+                  "samples\n",
+            GOLDEN_VERSION, GOLDEN_SAMPLES);
+  }
+  fprintf(file, "v%d %lld %d %d %d %d %d %d %016llx", key->version,
+          key->seed, key->width, key->height, key->kernel_order,
+          key->nchannels, key->nkernels, key->nz_ratio,
+          (unsigned long long)entry->hash);
+  for (i = 0; i < GOLDEN_SAMPLES; i++)
+  {
+    fprintf(file, " %a", entry->samples[i]);
+  }
+  fprintf(file, "\n");
+  fclose(file);
+}
+
+/* check a result against a golden cache entry instead of a full control
+   output; a matching hash means the result is bit-exact, otherwise the
+   sampled values must be within the same epsilon as check_result */
+void check_result_golden(float ***result, const struct golden_entry *entry,
+                         int dim0, int dim1, int dim2)
+{
+  const float *data = &(result[0][0][0]);
+  long long total = (long long)dim0 * dim1 * dim2;
+  double sum_abs_diff = 0.0;
+  const double EPSILON = 0.0625;
+  int i;
+
+  if (hash_3d_matrix(result, dim0, dim1, dim2) == entry->hash)
+  {
+    printf("COMMENT: result is bit-exact with the golden cache entry\n");
+    return;
+  }
+
+  for (i = 0; i < GOLDEN_SAMPLES; i++)
+  {
+    sum_abs_diff += fabs(entry->samples[i] - data[golden_sample_position(i, total)]);
+  }
+
+  if (sum_abs_diff > EPSILON)
+  {
+    fprintf(stderr, "WARNING: sampled sum of absolute differences (%f) > EPSILON (%f)\n",
+            sum_abs_diff, EPSILON);
+  }
+  else
+  {
+    printf("COMMENT: sampled sum of absolute differences (%f) within acceptable range (%f)\n",
+           sum_abs_diff, EPSILON);
+  }
+}
+
+/* a slow but correct version of dense convolution written by David */
+void multichannel_conv_dense(float ***image, float ****kernels,
+                             float ***output, int width, int height,
+                             int nchannels, int nkernels, int kernel_order)
+{
+  int h, w, x, y, c, m;
+
+  // initialize the output matrix to zero
+  for (m = 0; m < nkernels; m++)
+  {
+    for (h = 0; h < height; h++)
+    {
+      for (w = 0; w < width; w++)
+      {
+        output[m][h][w] = 0.0;
+      }
+    }
+  }
+
+  for (m = 0; m < nkernels; m++)
+  {
+    for (w = 0; w < width; w++)
+    {
+      for (h = 0; h < height; h++)
+      {
+        for (x = 0; x < kernel_order; x++)
+        {
+          for (y = 0; y < kernel_order; y++)
+          {
+            for (c = 0; c < nchannels; c++)
+            {
+              output[m][h][w] += image[w + x][h + y][c] * kernels[x][y][m][c];
+            }
+          }
+        }
+      }
+    }
+  }
+}
+
+/* a slow but correct version of sparse convolution written by David */
+void multichannel_conv_sparse(float ***image, struct sparse_matrix ***kernels,
+                              float ***output, int width, int height,
+                              int nchannels, int nkernels, int kernel_order)
+{
+  int h, w, x, y, c, m, index;
+  float value;
+
+  // initialize the output matrix to zero
+  for (m = 0; m < nkernels; m++)
+  {
+    for (h = 0; h < height; h++)
+    {
+      for (w = 0; w < width; w++)
+      {
+        output[m][h][w] = 0.0;
+      }
+    }
+  }
+
+  DEBUGGING(fprintf(stderr, "w=%d, h=%d, c=%d\n", w, h, c));
+
+  // now compute multichannel, multikernel convolution
+  for (w = 0; w < width; w++)
+  {
+    for (h = 0; h < height; h++)
+    {
+      double sum = 0.0;
+      for (x = 0; x < kernel_order; x++)
+      {
+        for (y = 0; y < kernel_order; y++)
+        {
+          struct sparse_matrix *kernel = kernels[x][y];
+          for (m = 0; m < nkernels; m++)
+          {
+            for (index = kernel->kernel_starts[m]; index < kernel->kernel_starts[m + 1]; index++)
+            {
+              int this_c = kernel->channel_numbers[index];
+              assert((this_c >= 0) && (this_c < nchannels));
+              value = kernel->values[index];
+              output[m][h][w] += image[w + x][h + y][this_c] * value;
+            }
+          } // m
+        }   // y
+      }     // x
+    }       // h
+  }         // w
+}
+
+/* width or height of the image that a convolution with this stride and
+   dilation reads for an output of the given width or height; with unit
+   stride and dilation this is the width + kernel_order of the harness */
+int conv_input_extent(int size, int kernel_order, int stride, int dilation)
+{
+  return size * stride + (kernel_order - 1) * dilation + 1;
+}
+
+/* multichannel_conv_sparse with a stride and a dilation: output pixel
+   (w, h) applies kernel position (x, y) to image pixel
+   (w * stride + x * dilation, h * stride + y * dilation) */
+void multichannel_conv_sparse_strided(float ***image, struct sparse_matrix ***kernels,
+                                      float ***output, int width, int height,
+                                      int nchannels, int nkernels, int kernel_order,
+                                      int stride, int dilation)
+{
+  int h, w, x, y, m, index;
+
+  for (w = 0; w < width; w++)
+  {
+    for (h = 0; h < height; h++)
+    {
+      for (m = 0; m < nkernels; m++)
+      {
+        float sum = 0.0;
+        for (x = 0; x < kernel_order; x++)
+        {
+          for (y = 0; y < kernel_order; y++)
+          {
+            struct sparse_matrix *kernel = kernels[x][y];
+            float *pixel = image[w * stride + x * dilation][h * stride + y * dilation];
+            for (index = kernel->kernel_starts[m]; index < kernel->kernel_starts[m + 1]; index++)
+            {
+              int this_c = kernel->channel_numbers[index];
+              assert((this_c >= 0) && (this_c < nchannels));
+              sum += pixel[this_c] * kernel->values[index];
+            }
+          } // y
+        }   // x
+        output[m][h][w] = sum;
+      } // m
+    }   // h
+  }     // w
+}
+
+/* Hardware performance counters
+
+   With -perf, team_conv_sparse counts hardware events separately for
+   its zeroing, main and border phases and for every thread, using
+   perf_event_open on the calling thread. The events of a thread are
+   opened once as one group led by the cycle counter, so one read
+   returns all of them, and they are scaled up if the kernel had to
+   multiplex the group. Events that this CPU or kernel does not offer
+   are left out; the floating point event is only tried on Intel CPUs,
+   where it counts single precision arithmetic instructions. */
+
+enum conv_phase
+{
+  PHASE_ZERO = 0,
+  PHASE_MAIN = 1,
+  PHASE_BORDER = 2,
+  NPHASES = 3
+};
+
+#define PERF_NEVENTS 6
+#define PERF_MAX_THREADS 256
+
+static const char *perf_phase_names[NPHASES] = {"zeroing", "main", "border"};
+static const char *perf_event_names[PERF_NEVENTS] = {
+    "cycles", "instructions", "L1D-misses", "LLC-misses", "dTLB-misses", "FP-SP-instrs"};
+
+// set by -perf; when clear the phase hooks return at once
+static int perf_enabled = 0;
+// counts of every thread, phase and event since the last reset
+static uint64_t perf_totals[PERF_MAX_THREADS][NPHASES][PERF_NEVENTS];
+static int perf_thread_used[PERF_MAX_THREADS];
+
+// the counter group of the calling thread
+static __thread int perf_leader_fd = -2; // -2: not opened yet, -1: failed
+static __thread int perf_nopened;
+static __thread int perf_opened_events[PERF_NEVENTS];
+static __thread uint64_t perf_phase_start[PERF_NEVENTS];
+static __thread int perf_phase_active = -1; // the phase being counted
+
+/* fill in the perf_event_attr of one of the events */
+int perf_event_attr_for(int event, struct perf_event_attr *attr)
+{
+  memset(attr, 0, sizeof(*attr));
+  attr->size = sizeof(*attr);
+  attr->exclude_kernel = 1;
+  attr->exclude_hv = 1;
+  attr->read_format = PERF_FORMAT_GROUP | PERF_FORMAT_TOTAL_TIME_ENABLED |
+                      PERF_FORMAT_TOTAL_TIME_RUNNING;
+  switch (event)
+  {
+  case 0:
+    attr->type = PERF_TYPE_HARDWARE;
+    attr->config = PERF_COUNT_HW_CPU_CYCLES;
+    return 1;
+  case 1:
+    attr->type = PERF_TYPE_HARDWARE;
+    attr->config = PERF_COUNT_HW_INSTRUCTIONS;
+    return 1;
+  case 2:
+    attr->type = PERF_TYPE_HW_CACHE;
+    attr->config = PERF_COUNT_HW_CACHE_L1D | (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+                   (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+    return 1;
+  case 3:
+    attr->type = PERF_TYPE_HW_CACHE;
+    attr->config = PERF_COUNT_HW_CACHE_LL | (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+                   (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+    return 1;
+  case 4:
+    attr->type = PERF_TYPE_HW_CACHE;
+    attr->config = PERF_COUNT_HW_CACHE_DTLB | (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+                   (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+    return 1;
+  case 5:
+    // FP_ARITH_INST_RETIRED with the scalar, 128 and 256 bit single
+    // precision umasks; the encoding only means this on Intel cores
+    if (!__builtin_cpu_is("intel"))
+    {
+      return 0;
+    }
+    attr->type = PERF_TYPE_RAW;
+    attr->config = 0xc7 | (0x2a << 8);
+    return 1;
+  }
+  return 0;
+}
+
+/* open the counter group of the calling thread */
+void perf_open_thread(void)
+{
+  int event;
+
+  perf_nopened = 0;
+  perf_leader_fd = -1;
+  for (event = 0; event < PERF_NEVENTS; event++)
+  {
+    struct perf_event_attr attr;
+    int fd;
+
+    if (!perf_event_attr_for(event, &attr))
+    {
+      continue;
+    }
+    fd = syscall(SYS_perf_event_open, &attr, 0, -1, perf_leader_fd, 0);
+    if (fd < 0)
+    {
+      if (event == 0)
+      { // without the leader there is no group at all
+        return;
+      }
+      continue;
+    }
+    if (event == 0)
+    {
+      perf_leader_fd = fd;
+    }
+    perf_opened_events[perf_nopened++] = event;
+  }
+}
+
+/* read the counters of the calling thread, scaled for multiplexing */
+int perf_read_thread(uint64_t counts[PERF_NEVENTS])
+{
+  uint64_t buffer[3 + PERF_NEVENTS];
+  double scale;
+  int i;
+
+  if (read(perf_leader_fd, buffer, sizeof(buffer)) < (ssize_t)(3 * sizeof(uint64_t)))
+  {
+    return 0;
+  }
+  // buffer holds the number of events, time enabled, time running,
+  // then one value for each event in the order they were opened
+  scale = (buffer[2] > 0 && buffer[2] < buffer[1]) ? (double)buffer[1] / buffer[2] : 1.0;
+  memset(counts, 0, sizeof(uint64_t) * PERF_NEVENTS);
+  for (i = 0; i < (int)buffer[0] && i < perf_nopened; i++)
+  {
+    counts[perf_opened_events[i]] = (uint64_t)(buffer[3 + i] * scale);
+  }
+  return 1;
+}
+
+/* start counting a phase on the calling thread */
+void perf_phase_begin(int phase)
+{
+  if (!perf_enabled)
+  {
+    return;
+  }
+  if (perf_leader_fd == -2)
+  {
+    perf_open_thread();
+  }
+  perf_phase_active = phase;
+  if (perf_leader_fd >= 0)
+  {
+    perf_read_thread(perf_phase_start);
+  }
+}
+
+/* stop counting a phase on the calling thread and add up its counts */
+void perf_phase_end(int phase)
+{
+  uint64_t counts[PERF_NEVENTS];
+  int thread = omp_get_thread_num();
+  int event;
+
+  if (!perf_enabled)
+  {
+    return;
+  }
+  // phases do not nest, so each end matches the last begin
+  assert(phase == perf_phase_active);
+  perf_phase_active = -1;
+  if (perf_leader_fd < 0 || thread >= PERF_MAX_THREADS || !perf_read_thread(counts))
+  {
+    return;
+  }
+  for (event = 0; event < PERF_NEVENTS; event++)
+  {
+    perf_totals[thread][phase][event] += counts[event] - perf_phase_start[event];
+  }
+  perf_thread_used[thread] = 1;
+}
+
+/* forget the counts so far, for example those of warmup runs */
+void perf_reset(void)
+{
+  memset(perf_totals, 0, sizeof(perf_totals));
+  memset(perf_thread_used, 0, sizeof(perf_thread_used));
+}
+
+/* print the average counts of one run for every thread and phase */
+void perf_report(int runs)
+{
+  int thread, phase, event, any = 0;
+
+  for (thread = 0; thread < PERF_MAX_THREADS; thread++)
+  {
+    any |= perf_thread_used[thread];
+  }
+  if (!any)
+  {
+    printf("COMMENT: hardware counters unavailable (perf_event_open failed; see /proc/sys/kernel/perf_event_paranoid)\n");
+    return;
+  }
+
+  printf("Perf counters per run:\n%-8s %-8s", "thread", "phase");
+  for (event = 0; event < PERF_NEVENTS; event++)
+  {
+    printf(" %14s", perf_event_names[event]);
+  }
+  printf("\n");
+  for (thread = 0; thread < PERF_MAX_THREADS; thread++)
+  {
+    if (!perf_thread_used[thread])
+    {
+      continue;
+    }
+    for (phase = 0; phase < NPHASES; phase++)
+    {
+      if (perf_totals[thread][phase][0] == 0)
+      {
+        continue;
+      }
+      printf("%-8d %-8s", thread, perf_phase_names[phase]);
+      for (event = 0; event < PERF_NEVENTS; event++)
+      {
+        printf(" %14llu", (unsigned long long)(perf_totals[thread][phase][event] / runs));
+      }
+      printf("\n");
+    }
+  }
+}
+
+/* Timeline tracing
+
+   With -trace, team_conv_sparse records a span for each phase on each
+   thread and for each kernel m of the main loop, with the number of
+   4x4 tiles and kernel non-zeros it processed. Every thread appends to
+   its own ring buffer, so recording needs no locks, and when a buffer
+   is full the oldest spans are overwritten. The spans are written out
+   in the Chrome trace event format, which chrome://tracing and
+   Perfetto display as one timeline row per thread. */
+
+#define TRACE_RING_SIZE 65536
+
+// one recorded span
+struct trace_event
+{
+  const char *name;
+  uint64_t start_ns;
+  uint64_t end_ns;
+  int m_first; // kernels m_first up to but not including m_end, or -1
+  int m_end;   // for a phase
+  long long tiles;
+  long long non_zeros;
+};
+
+// the spans of one thread; count keeps growing, the ring wraps
+struct trace_ring
+{
+  unsigned long long count;
+  struct trace_event events[TRACE_RING_SIZE];
+};
+
+// set by -trace; when clear the trace hooks return at once
+static int trace_enabled = 0;
+static struct trace_ring *trace_rings[PERF_MAX_THREADS];
+
+/* time stamp for trace spans */
+static inline uint64_t trace_now(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* append a span to the ring buffer of the calling thread */
+void trace_record(const char *name, uint64_t start_ns, int m_first, int m_end,
+                  long long tiles, long long non_zeros)
+{
+  int thread = omp_get_thread_num();
+  struct trace_ring *ring;
+  struct trace_event *event;
+
+  if (thread >= PERF_MAX_THREADS)
+  {
+    return;
+  }
+  if (trace_rings[thread] == NULL)
+  {
+    // each thread only ever allocates its own ring
+    trace_rings[thread] = calloc(1, sizeof(struct trace_ring));
+  }
+  ring = trace_rings[thread];
+  event = &ring->events[ring->count % TRACE_RING_SIZE];
+  event->name = name;
+  event->start_ns = start_ns;
+  event->end_ns = trace_now();
+  event->m_first = m_first;
+  event->m_end = m_end;
+  event->tiles = tiles;
+  event->non_zeros = non_zeros;
+  ring->count++;
+}
+
+/* forget the spans so far, for example those of warmup runs */
+void trace_reset(void)
+{
+  int thread;
+
+  for (thread = 0; thread < PERF_MAX_THREADS; thread++)
+  {
+    if (trace_rings[thread] != NULL)
+    {
+      trace_rings[thread]->count = 0;
+    }
+  }
+}
+
+/* write the recorded spans as a Chrome trace event file */
+void trace_write(const char *path)
+{
+  FILE *file = fopen(path, "w");
+  uint64_t origin = UINT64_MAX;
+  unsigned long long i, first;
+  int thread, separator = 0;
+
+  if (file == NULL)
+  {
+    fprintf(stderr, "WARNING: cannot write trace file %s\n", path);
+    return;
+  }
+
+  // time stamps are written relative to the earliest span
+  for (thread = 0; thread < PERF_MAX_THREADS; thread++)
+  {
+    struct trace_ring *ring = trace_rings[thread];
+    if (ring == NULL)
+    {
+      continue;
+    }
+    first = (ring->count > TRACE_RING_SIZE) ? ring->count - TRACE_RING_SIZE : 0;
+    for (i = first; i < ring->count; i++)
+    {
+      if (ring->events[i % TRACE_RING_SIZE].start_ns < origin)
+      {
+        origin = ring->events[i % TRACE_RING_SIZE].start_ns;
+      }
+    }
+  }
+
+  fprintf(file, "{\"displayTimeUnit\": \"ns\", \"traceEvents\": [\n");
+  for (thread = 0; thread < PERF_MAX_THREADS; thread++)
+  {
+    struct trace_ring *ring = trace_rings[thread];
+    if (ring == NULL)
+    {
+      continue;
+    }
+    fprintf(file, "%s{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, \"tid\": %d, "
+                  "\"args\": {\"name\": \"thread %d\"}}",
+            separator ? ",\n" : "", thread, thread);
+    separator = 1;
+    first = (ring->count > TRACE_RING_SIZE) ? ring->count - TRACE_RING_SIZE : 0;
+    for (i = first; i < ring->count; i++)
+    {
+      struct trace_event *event = &ring->events[i % TRACE_RING_SIZE];
+      fprintf(file, ",\n{\"name\": \"%s\", \"cat\": \"conv\", \"ph\": \"X\", \"pid\": 1, \"tid\": %d, "
+                    "\"ts\": %.3f, \"dur\": %.3f",
+              event->name, thread, (event->start_ns - origin) / 1000.0,
+              (event->end_ns - event->start_ns) / 1000.0);
+      if (event->m_first >= 0)
+      {
+        fprintf(file, ", \"args\": {\"m_first\": %d, \"m_end\": %d, \"tiles\": %lld, \"non_zeros\": %lld}",
+                event->m_first, event->m_end, event->tiles, event->non_zeros);
+      }
+      fprintf(file, "}");
+    }
+  }
+  fprintf(file, "\n]}\n");
+  fclose(file);
+}
+
+// start time of the current phase of each thread
+static __thread uint64_t trace_phase_start;
+
+/* start a phase of team_conv_sparse: counters and trace */
+void conv_phase_begin(int phase)
+{
+  perf_phase_begin(phase);
+  if (trace_enabled)
+  {
+    trace_phase_start = trace_now();
+  }
+}
+
+/* end a phase of team_conv_sparse: counters and trace */
+void conv_phase_end(int phase)
+{
+  perf_phase_end(phase);
+  if (trace_enabled)
+  {
+    trace_record(perf_phase_names[phase], trace_phase_start, -1, -1, 0, 0);
+  }
+}
+
+/* record the span of one kernel m of the main loop of team_conv_sparse */
+void trace_kernel(uint64_t start_ns, struct sparse_matrix ***kernels, int kernel_order,
+                  int m, long long tiles)
+{
+  long long non_zeros = 0;
+  int x, y;
+
+  for (x = 0; x < kernel_order; x++)
+  {
+    for (y = 0; y < kernel_order; y++)
+    {
+      non_zeros += kernels[x][y]->kernel_starts[m + 1] - kernels[x][y]->kernel_starts[m];
+    }
+  }
+  // every non-zero is applied once to every tile
+  trace_record("kernel", start_ns, m, m + 1, tiles, non_zeros * tiles);
+}
+
+/* the threshold to use OpenMP,
+   if the inputs width * nchannels * nkernels * kernel_order
+   are greater than 270 * 32 * 64 * 3,
+   then the program will use OpenMp to speed up and return 1.
+   this threshold is gained from multiple different inputs tests, so this threshold may be not very accurate.
+   The product is computed in long long, as it overflows an int for the largest inputs. */
+int team_conv_use_openmp(int width, int nchannels, int nkernels, int kernel_order)
+{
+  long long check = (long long)width * nchannels * nkernels * kernel_order;
+  long long threshold = 270 * 32 * 64 * 3;
+
+  return check >= threshold;
+}
+
+/* add the products of one kernel non-zero, in all four lanes of value,
+   with a 4x4 tile of pixels to the four sums of the tile;
+   image[wx][hy] is the top left pixel */
+static inline void tile_4x4_accumulate_ps(float ***image, int wx, int hy, int this_c,
+                                          __m128 value, __m128 sums[4])
+{
+  // output[m][h][w] += image[w + x][h + y][this_c] * value;
+  // Load four elements in height and calculate four multiplication at same time.
+  // Becasue of the loop unrolling, four elements in width will be assigned in one iteration.
+  __m128 value1 = _mm_setr_ps(image[wx][hy][this_c], image[wx][hy + 1][this_c], image[wx][hy + 2][this_c], image[wx][hy + 3][this_c]);
+  value1 = _mm_mul_ps(value1, value);
+
+  __m128 value2 = _mm_setr_ps(image[wx + 1][hy][this_c], image[wx + 1][hy + 1][this_c], image[wx + 1][hy + 2][this_c], image[wx + 1][hy + 3][this_c]);
+  value2 = _mm_mul_ps(value2, value);
+
+  __m128 value3 = _mm_setr_ps(image[wx + 2][hy][this_c], image[wx + 2][hy + 1][this_c], image[wx + 2][hy + 2][this_c], image[wx + 2][hy + 3][this_c]);
+  value3 = _mm_mul_ps(value3, value);
+
+  __m128 value4 = _mm_setr_ps(image[wx + 3][hy][this_c], image[wx + 3][hy + 1][this_c], image[wx + 3][hy + 2][this_c], image[wx + 3][hy + 3][this_c]);
+  value4 = _mm_mul_ps(value4, value);
+
+  // Four additions each time and four loop unrolling in one iteration.
+  sums[0] = _mm_add_ps(sums[0], value1);
+  sums[1] = _mm_add_ps(sums[1], value2);
+  sums[2] = _mm_add_ps(sums[2], value3);
+  sums[3] = _mm_add_ps(sums[3], value4);
+}
+
+/* tile_4x4_accumulate_ps for a kernel value v */
+static inline void tile_4x4_accumulate(float ***image, int wx, int hy, int this_c,
+                                       float v, __m128 sums[4])
+{
+  // value = kernel->values[index];
+  // Load four copies of value.
+  tile_4x4_accumulate_ps(image, wx, hy, this_c, _mm_set1_ps(v), sums);
+}
+
+/* Epilogue
+
+   The work that follows a convolution in a network, a per-kernel bias
+   and an activation, is done on the sums while they are still in
+   registers, before the store, instead of in another pass over the
+   whole output. A batch norm that follows the convolution is folded
+   into the kernel values and the bias once, when the kernels are
+   planned, so it costs nothing per image. */
+
+enum conv_activation
+{
+  ACTIVATION_NONE,
+  ACTIVATION_RELU
+};
+
+enum conv_pool
+{
+  POOL_NONE,
+  POOL_MAX2, // 2x2 max pooling with stride 2
+  POOL_AVG2  // 2x2 average pooling with stride 2
+};
+
+struct conv_epilogue
+{
+  const float *bias; // one per kernel, or NULL for none
+  int activation;
+  int pool;          // pooling after the activation; the output is then
+                     // nkernels x width / 2 x height / 2
+};
+
+// where a convolution stores its outputs: the harness's output[m][h][w],
+// or a tensor in the image layout, tensor[w + offset][h + offset][m], so
+// that the next layer of a network reads them as its image
+struct conv_dest
+{
+  float ***output; // or NULL to store to the tensor
+  float ***tensor;
+  int offset;
+};
+
+/* the output of kernel m at (w, h) */
+static inline float *conv_dest_at(const struct conv_dest *dest, int m, int w, int h)
+{
+  if (dest->output != NULL)
+  {
+    return &dest->output[m][h][w];
+  }
+  return &dest->tensor[w + dest->offset][h + dest->offset][m];
+}
+
+/* store the sums of the 4x4 tile of kernel m at (w, h), column w + i
+   in sums[i] and row h + j in lane j */
+static inline void conv_dest_store_4x4(const struct conv_dest *dest, int m, int w, int h,
+                                       __m128 sums[4])
+{
+  float sum[4];
+  int i;
+
+  for (i = 0; i < 4; i++)
+  {
+    _mm_storeu_ps(sum, sums[i]);
+    *conv_dest_at(dest, m, w + i, h) = sum[0];
+    *conv_dest_at(dest, m, w + i, h + 1) = sum[1];
+    *conv_dest_at(dest, m, w + i, h + 2) = sum[2];
+    *conv_dest_at(dest, m, w + i, h + 3) = sum[3];
+  }
+}
+
+/* apply the epilogue of kernel m to the sums of a 4x4 tile */
+static inline void epilogue_apply_4x4(const struct conv_epilogue *epilogue, int m, __m128 sums[4])
+{
+  int i;
+
+  if (epilogue->bias != NULL)
+  {
+    __m128 bias = _mm_set1_ps(epilogue->bias[m]);
+    for (i = 0; i < 4; i++)
+    {
+      sums[i] = _mm_add_ps(sums[i], bias);
+    }
+  }
+  if (epilogue->activation == ACTIVATION_RELU)
+  {
+    for (i = 0; i < 4; i++)
+    {
+      sums[i] = _mm_max_ps(sums[i], _mm_setzero_ps());
+    }
+  }
+}
+
+/* apply the epilogue of kernel m to one sum */
+static inline float epilogue_apply(const struct conv_epilogue *epilogue, int m, float sum)
+{
+  if (epilogue->bias != NULL)
+  {
+    sum += epilogue->bias[m];
+  }
+  if (epilogue->activation == ACTIVATION_RELU && sum < 0.0f)
+  {
+    sum = 0.0f;
+  }
+  return sum;
+}
+
+/* pool four values of a 2x2 window */
+static inline float pool_2x2(int pool, float a, float b, float c, float d)
+{
+  if (pool == POOL_MAX2)
+  {
+    float ab = (a > b) ? a : b, cd = (c > d) ? c : d;
+    return (ab > cd) ? ab : cd;
+  }
+  return (a + b + c + d) * 0.25f;
+}
+
+/* pool the sums of the 4x4 tile of kernel m at (w, h), column w + i in
+   sums[i] and row h + j in lane j, to the 2x2 outputs at (w / 2, h / 2) */
+static inline void pool_store_4x4(int pool, __m128 sums[4], const struct conv_dest *dest, int m,
+                                  int w, int h)
+{
+  __m128 left, right;
+  float lanes[4];
+
+  // first the pairs of columns, then the pairs of rows: after adding
+  // each lane to its neighbour, lanes 0 and 2 hold the two output rows
+  if (pool == POOL_MAX2)
+  {
+    left = _mm_max_ps(sums[0], sums[1]);
+    right = _mm_max_ps(sums[2], sums[3]);
+    left = _mm_max_ps(left, _mm_shuffle_ps(left, left, _MM_SHUFFLE(2, 3, 0, 1)));
+    right = _mm_max_ps(right, _mm_shuffle_ps(right, right, _MM_SHUFFLE(2, 3, 0, 1)));
+  }
+  else
+  {
+    __m128 quarter = _mm_set1_ps(0.25f);
+    left = _mm_add_ps(sums[0], sums[1]);
+    right = _mm_add_ps(sums[2], sums[3]);
+    left = _mm_mul_ps(_mm_add_ps(left, _mm_shuffle_ps(left, left, _MM_SHUFFLE(2, 3, 0, 1))), quarter);
+    right = _mm_mul_ps(_mm_add_ps(right, _mm_shuffle_ps(right, right, _MM_SHUFFLE(2, 3, 0, 1))), quarter);
+  }
+  _mm_storeu_ps(lanes, left);
+  *conv_dest_at(dest, m, w / 2, h / 2) = lanes[0];
+  *conv_dest_at(dest, m, w / 2, h / 2 + 1) = lanes[2];
+  _mm_storeu_ps(lanes, right);
+  *conv_dest_at(dest, m, w / 2 + 1, h / 2) = lanes[0];
+  *conv_dest_at(dest, m, w / 2 + 1, h / 2 + 1) = lanes[2];
+}
+
+/* fold a batch norm, gamma * (x - mean) / sqrt(variance + epsilon) + beta,
+   that follows the convolution into its kernel values and its bias;
+   bias holds the bias of the convolution on entry (zeros for none) and
+   the folded bias on return. This must be done before any other form
+   of the values, such as the half precision copy, is made. */
+void fold_batch_norm(struct sparse_matrix ***kernels, int kernel_order, int nkernels,
+                     const float *gamma, const float *beta, const float *mean,
+                     const float *variance, float epsilon, float *bias)
+{
+  int m, x, y, index;
+
+  for (m = 0; m < nkernels; m++)
+  {
+    float scale = gamma[m] / sqrtf(variance[m] + epsilon);
+    for (x = 0; x < kernel_order; x++)
+    {
+      for (y = 0; y < kernel_order; y++)
+      {
+        struct sparse_matrix *kernel = kernels[x][y];
+        for (index = kernel->kernel_starts[m]; index < kernel->kernel_starts[m + 1]; index++)
+        {
+          kernel->values[index] *= scale;
+        }
+      }
+    }
+    bias[m] = (bias[m] - mean[m]) * scale + beta[m];
+  }
+}
+
+/* the separate pass that a pooling epilogue replaces: pool the 2x2
+   windows of output[m][h][w] into pooled[m][h / 2][w / 2] */
+void pool_pass(int pool, float ***output, float ***pooled, int width, int height, int nchannels,
+               int nkernels, int kernel_order)
+{
+  int m, h, w;
+
+#pragma omp parallel for private(h, w) if (team_conv_use_openmp(width, nchannels, nkernels, kernel_order))
+  for (m = 0; m < nkernels; m++)
+  {
+    for (h = 0; h < height / 2; h++)
+    {
+      for (w = 0; w < width / 2; w++)
+      {
+        pooled[m][h][w] = pool_2x2(pool, output[m][2 * h][2 * w], output[m][2 * h][2 * w + 1],
+                                   output[m][2 * h + 1][2 * w], output[m][2 * h + 1][2 * w + 1]);
+      }
+    }
+  }
+}
+
+/* the separate pass that a bias, batch norm and ReLU epilogue replaces,
+   applied to output[m][h][w] in place */
+void epilogue_pass(float ***output, const float *bias, const float *gamma, const float *beta,
+                   const float *mean, const float *variance, float epsilon, int width, int height,
+                   int nchannels, int nkernels, int kernel_order)
+{
+  int m, h, w;
+
+#pragma omp parallel for private(h, w) if (team_conv_use_openmp(width, nchannels, nkernels, kernel_order))
+  for (m = 0; m < nkernels; m++)
+  {
+    float scale = gamma[m] / sqrtf(variance[m] + epsilon);
+    for (h = 0; h < height; h++)
+    {
+      for (w = 0; w < width; w++)
+      {
+        float v = (output[m][h][w] + bias[m] - mean[m]) * scale + beta[m];
+        output[m][h][w] = (v > 0.0f) ? v : 0.0f;
+      }
+    }
+  }
+}
+
+/* one output pixel of kernel m, for the border */
+static inline float conv_pixel_sparse(float ***image, struct sparse_matrix ***kernels,
+                                      int kernel_order, int m, int w, int h)
+{
+  float sum = 0.0f;
+  int x, y, index;
+
+  for (x = 0; x < kernel_order; x++)
+  {
+    for (y = 0; y < kernel_order; y++)
+    {
+      struct sparse_matrix *kernel = kernels[x][y];
+      for (index = kernel->kernel_starts[m]; index < kernel->kernel_starts[m + 1]; index++)
+      {
+        sum += image[w + x][h + y][kernel->channel_numbers[index]] * kernel->values[index];
+      }
+    }
+  }
+  return sum;
+}
+
+/* the pooled outputs of a pooling epilogue that the 4x4 tiles do not
+   cover: the columns right of the tiles and the rows below them */
+void team_conv_pooled_border(float ***image, struct sparse_matrix ***kernels,
+                             const struct conv_dest *dest, int width, int height, int nkernels,
+                             int kernel_order, const struct conv_epilogue *epilogue)
+{
+  int m, pw, ph;
+
+  for (m = 0; m < nkernels; m++)
+  {
+    for (ph = 0; ph < height / 2; ph++)
+    {
+      int first = (ph >= (height - height % 4) / 2) ? 0 : (width - width % 4) / 2;
+      for (pw = first; pw < width / 2; pw++)
+      {
+        float window[4];
+        int i;
+        for (i = 0; i < 4; i++)
+        {
+          float sum = conv_pixel_sparse(image, kernels, kernel_order, m, 2 * pw + i % 2, 2 * ph + i / 2);
+          window[i] = epilogue_apply(epilogue, m, sum);
+        }
+        *conv_dest_at(dest, m, pw, ph) = pool_2x2(epilogue->pool, window[0], window[1], window[2],
+                                                  window[3]);
+      }
+    }
+  }
+}
+
+/* the 4x4 tiles of kernel m in team_conv_sparse, with an optional
+   epilogue (NULL for none), stored to dest; the outputs right of the
+   tiles and below them are left to the caller */
+static inline void conv_sparse_kernel_tiles(float ***image, struct sparse_matrix ***kernels,
+                                            const struct conv_dest *dest, int m, int width,
+                                            int height, int nchannels, int kernel_order,
+                                            const struct conv_epilogue *epilogue)
+{
+  int w, h, x, y, index;
+
+  // Using loop unrolling to speedup and calculate four colums in one iteration.
+  for (w = 0; w < width - width % 4; w += 4)
+  {
+    // Using SSE to speedup and calculate four rows each time.
+    for (h = 0; h < height - height % 4; h += 4)
+    {
+      // double sum = 0.0;
+      __m128 sums[4];
+      sums[0] = _mm_setzero_ps();
+      sums[1] = _mm_setzero_ps();
+      sums[2] = _mm_setzero_ps();
+      sums[3] = _mm_setzero_ps();
+      for (x = 0; x < kernel_order; x++)
+      {
+        for (y = 0; y < kernel_order; y++)
+        {
+          struct sparse_matrix *kernel = kernels[x][y];
+          int end = kernel->kernel_starts[m + 1];
+          index = kernel->kernel_starts[m];
+
+          // The channel numbers are decoded here in whatever form
+          // kernels_encode_indices stored them.
+          if (kernel->index_encoding == INDEX_DELTA8)
+          {
+            const uint8_t *delta = kernel->channel_deltas + kernel->delta_starts[m];
+            int this_c = -1;
+            for (; index < end; index++)
+            {
+              unsigned int d = *delta++;
+              if (d == 0)
+              { // escape: the absolute channel number follows
+                this_c = delta[0] | (delta[1] << 8);
+                delta += 2;
+              }
+              else
+              {
+                this_c += d;
+              }
+              tile_4x4_accumulate(image, w + x, h + y, this_c, kernel->values[index], sums);
+            }
+          }
+          else if (kernel->index_encoding == INDEX_UINT16)
+          {
+            for (; index < end; index++)
+            {
+              tile_4x4_accumulate(image, w + x, h + y, kernel->channel_numbers16[index],
+                                  kernel->values[index], sums);
+            }
+          }
+          else
+          {
+            for (; index < end; index++)
+            {
+              int this_c = kernel->channel_numbers[index];
+              assert((this_c >= 0) && (this_c < nchannels));
+              tile_4x4_accumulate(image, w + x, h + y, this_c, kernel->values[index], sums);
+            }
+          }
+        } // y
+      }   // x
+
+      if (epilogue != NULL)
+      {
+        epilogue_apply_4x4(epilogue, m, sums);
+      }
+      if (epilogue != NULL && epilogue->pool != POOL_NONE)
+      {
+        pool_store_4x4(epilogue->pool, sums, dest, m, w, h);
+        continue;
+      }
+
+      // Load to result sum to output
+      conv_dest_store_4x4(dest, m, w, h, sums);
+    } // h
+  }   // w
+}
+
+/* the fast version of sparse convolution written by the team, with an
+   optional epilogue (NULL for none) applied before the results are
+   stored to dest */
+void team_conv_sparse_dest(float ***image, struct sparse_matrix ***kernels,
+                           const struct conv_dest *dest, int width, int height,
+                           int nchannels, int nkernels, int kernel_order,
+                           const struct conv_epilogue *epilogue)
+{
+  float ***output = dest->output;
+  int h, w, x, y, c, m, index;
+  float value;
+  int OpenMP_flag = team_conv_use_openmp(width, nchannels, nkernels, kernel_order);
+  // with pooling every output is stored once, so nothing needs zeroing
+  int pooled = epilogue != NULL && epilogue->pool != POOL_NONE;
+
+  assert(!pooled || (width % 2 == 0 && height % 2 == 0));
+
+  /*
+    ______________
+    |          | |
+    |     1    | |
+    |          |2|
+    |__________| |
+    |_____3____|_|
+  
+    The output matrix in initialization and convolution parts is divided to 3 parts.
+    Part 1 size is (height - height%4) * (width - width%4), so both part 1's height and width can be exactly divided by 4.
+    Part 2 size is height * (width%4).
+    Part 3 size is (height%4) * (width - width%4).
+    If image's height and width can be exactly divided by 4, then part 2 and 3 won't exist.
+    The loop unrolling and SSE are used in part 1 to speed up.
+    Because of small values of height and width in part 2 and 3, I haven't use SSE to speed up these part.
+  */
+
+  // initialize the output matrix to zero
+  conv_phase_begin(PHASE_ZERO);
+  if (!pooled && output == NULL)
+  {
+    // a tensor: the tiles are stored whole, so only the outputs around
+    // them, which are summed in place, need zeroing
+    for (h = 0; h < height; h++)
+    {
+      for (w = (h >= height - height % 4) ? 0 : width - width % 4; w < width; w++)
+      {
+        memset(conv_dest_at(dest, 0, w, h), 0, sizeof(float) * nkernels);
+      }
+    }
+  }
+  else if (!pooled)
+  {
+    float init = 0.0;
+    __m128 initValue = _mm_set1_ps(init);
+    for (m = 0; m < nkernels; m++)
+    {
+      // Using loop unrolling to speedup and assign four rows in one iteration.
+      for (h = 0; h < height - height % 4; h += 4)
+      {
+        // Using SSE to speedup and assign four colums each time.
+        for (w = 0; w < width - width % 4; w += 4)
+        {
+          // output[i][j][k] = 0.0;
+          // Using SSE will assign four colums each time, so four elements in output will be initialized to 0.
+          // And because of loop unrolling, four rows will be operated in one interation. 
+          _mm_storeu_ps(&output[m][h][w], initValue);
+          _mm_storeu_ps(&output[m][h + 1][w], initValue);
+          _mm_storeu_ps(&output[m][h + 2][w], initValue);
+          _mm_storeu_ps(&output[m][h + 3][w], initValue);
+        }
+      }
+    }
+
+    // Handle the rest parts.
+    // I put m (nkernels) as the innermost loop to avoid unnecessary for loop when the width or height is exactly divided by 4.
+    // Handle part 2
+    for (h = height - height % 4; h < height; h++)
+    {
+      for (w = 0; w < width; w++)
+      {
+        for (m = 0; m < nkernels; m++)
+        {
+          output[m][h][w] = 0.0;
+        }
+      }
+    }
+    // Handle part 3
+    for (h = 0; h < height - height % 4 && (width % 4 != 0); h++)
+    {
+      for (w = width - width % 4; w < width; w++)
+      {
+        for (m = 0; m < nkernels; m++)
+        {
+          output[m][h][w] = 0.0;
+        }
+      }
+    }
+  }
+  conv_phase_end(PHASE_ZERO);
+
+// now compute multichannel, multikernel convolution
+
+// First handle the part 1 that both the length and width exactly divisible by 4.
+// If input dataset reached threshold then OpenMP_flag = 1 and program will use OpenMP to speedup.
+// index is private too, since every thread walks its own kernel non-zeros.
+#pragma omp parallel if (OpenMP_flag) private(w, h, m, x, y, index) shared(kernels, image, dest)
+  {
+    conv_phase_begin(PHASE_MAIN);
+#pragma omp for nowait
+    // I got some ideas when I read multichannel_conv_dense(), so I put m’s for loop as the outermost loop in convolution part. 
+    // In this order, I can implement the SSE on h (height).
+    for (m = 0; m < nkernels; m++)
+    {
+      uint64_t trace_start = trace_enabled ? trace_now() : 0;
+      conv_sparse_kernel_tiles(image, kernels, dest, m, width, height, nchannels, kernel_order,
+                               epilogue);
+      if (trace_enabled)
+      {
+        trace_kernel(trace_start, kernels, kernel_order, m,
+                     (long long)(width / 4) * (height / 4));
+      }
+    }     // m
+    conv_phase_end(PHASE_MAIN);
+  }
+
+  // Then handle the part 2 that leaves in right.
+  conv_phase_begin(PHASE_BORDER);
+  if (!pooled)
+  {
+    for (w = width - width % 4; w < width; w++)
+    {
+      for (h = 0; h < height; h++)
+      {
+        for (x = 0; x < kernel_order; x++)
+        {
+          for (y = 0; y < kernel_order; y++)
+          {
+            struct sparse_matrix *kernel = kernels[x][y];
+            for (m = 0; m < nkernels; m++)
+            {
+              for (index = kernel->kernel_starts[m]; index < kernel->kernel_starts[m + 1]; index++)
+              {
+                int this_c = kernel->channel_numbers[index];
+                assert((this_c >= 0) && (this_c < nchannels));
+                value = kernel->values[index];
+                *conv_dest_at(dest, m, w, h) += image[w + x][h + y][this_c] * value;
+              }
+            } // m
+          }   // y
+        }     // x
+      }       // h
+    }         // w
+
+    // Then handle the part 3 that leaves in bottom.
+    for (w = 0; w < width - width % 4 && (height % 4 != 0); w++)
+    {
+      for (h = height - height % 4; h < height; h++)
+      {
+        for (x = 0; x < kernel_order; x++)
+        {
+          for (y = 0; y < kernel_order; y++)
+          {
+            struct sparse_matrix *kernel = kernels[x][y];
+            for (m = 0; m < nkernels; m++)
+            {
+              for (index = kernel->kernel_starts[m]; index < kernel->kernel_starts[m + 1]; index++)
+              {
+                int this_c = kernel->channel_numbers[index];
+                assert((this_c >= 0) && (this_c < nchannels));
+                value = kernel->values[index];
+                *conv_dest_at(dest, m, w, h) += image[w + x][h + y][this_c] * value;
+              }
+            } // m
+          }   // y
+        }     // x
+      }       // h
+    }         // w
+
+    // The border sums are complete only now, so they get the epilogue here.
+    if (epilogue != NULL)
+    {
+      for (m = 0; m < nkernels; m++)
+      {
+        for (h = 0; h < height; h++)
+        {
+          // the whole row below the tiles, or the columns right of them
+          int first = (h >= height - height % 4) ? 0 : width - width % 4;
+          for (w = first; w < width; w++)
+          {
+            float *out = conv_dest_at(dest, m, w, h);
+            *out = epilogue_apply(epilogue, m, *out);
+          }
+        }
+      }
+    }
+  }
+  else
+  {
+    team_conv_pooled_border(image, kernels, dest, width, height, nkernels,
+                            kernel_order, epilogue);
+  }
+  conv_phase_end(PHASE_BORDER);
+}
+
+/* team_conv_sparse_dest storing to the harness's output[m][h][w] */
+void team_conv_sparse_epilogue(float ***image, struct sparse_matrix ***kernels,
+                               float ***output, int width, int height,
+                               int nchannels, int nkernels, int kernel_order,
+                               const struct conv_epilogue *epilogue)
+{
+  struct conv_dest dest = {output, NULL, 0};
+
+  team_conv_sparse_dest(image, kernels, &dest, width, height, nchannels, nkernels,
+                        kernel_order, epilogue);
+}
+
+/* the fast version of sparse convolution written by the team */
+void team_conv_sparse(float ***image, struct sparse_matrix ***kernels,
+                      float ***output, int width, int height,
+                      int nchannels, int nkernels, int kernel_order)
+{
+  team_conv_sparse_epilogue(image, kernels, output, width, height, nchannels, nkernels,
+                            kernel_order, NULL);
+}
+
+/* Stride and dilation
+
+   A strided convolution computes only the outputs it keeps, instead of
+   every output followed by subsampling. The tiles are those of
+   team_conv_sparse, 4x4 outputs per kernel in four SSE sums, but the
+   sixteen image pixels of a tile are stride apart, and the kernel
+   positions dilation apart. The body is always inlined with stride and
+   dilation as constants for the common stride 2 and dilation 2, so
+   their address arithmetic is folded; other values take the generic
+   copy. As in team_conv_sparse the channel is the innermost dimension
+   of the image, so the four rows of a tile are gathered one by one
+   either way, and there is nothing to deinterleave. */
+
+/* add the products of one non-zero with a strided 4x4 tile of pixels;
+   image[wx][hy] is the top left pixel */
+static inline __attribute__((always_inline)) void
+tile_4x4_accumulate_strided(float ***image, int wx, int hy, int this_c, float v,
+                            __m128 sums[4], const int stride)
+{
+  __m128 value = _mm_set1_ps(v);
+  int i;
+
+  for (i = 0; i < 4; i++)
+  {
+    float **column = image[wx + i * stride];
+    __m128 pixels = _mm_setr_ps(column[hy][this_c], column[hy + stride][this_c],
+                                column[hy + 2 * stride][this_c], column[hy + 3 * stride][this_c]);
+    sums[i] = _mm_add_ps(sums[i], _mm_mul_ps(pixels, value));
+  }
+}
+
+/* the strided convolution, inlined into one copy per stride and
+   dilation, with an optional epilogue that does not pool */
+static inline __attribute__((always_inline)) void
+conv_sparse_strided_body(float ***image, struct sparse_matrix ***kernels,
+                         const struct conv_dest *dest, int width, int height,
+                         int nchannels, int nkernels, int kernel_order,
+                         const int stride, const int dilation,
+                         const struct conv_epilogue *epilogue)
+{
+  int OpenMP_flag = team_conv_use_openmp(width, nchannels, nkernels, kernel_order);
+  int m;
+
+#pragma omp parallel for if (OpenMP_flag)
+  for (m = 0; m < nkernels; m++)
+  {
+    int w, h, x, y, index;
+
+    for (w = 0; w < width - width % 4; w += 4)
+    {
+      for (h = 0; h < height - height % 4; h += 4)
+      {
+        __m128 sums[4];
+        int i;
+
+        for (i = 0; i < 4; i++)
+        {
+          sums[i] = _mm_setzero_ps();
+        }
+        for (x = 0; x < kernel_order; x++)
+        {
+          for (y = 0; y < kernel_order; y++)
+          {
+            struct sparse_matrix *kernel = kernels[x][y];
+            for (index = kernel->kernel_starts[m]; index < kernel->kernel_starts[m + 1]; index++)
+            {
+              tile_4x4_accumulate_strided(image, w * stride + x * dilation, h * stride + y * dilation,
+                                          kernel->channel_numbers[index], kernel->values[index],
+                                          sums, stride);
+            }
+          }
+        }
+        if (epilogue != NULL)
+        {
+          epilogue_apply_4x4(epilogue, m, sums);
+        }
+        conv_dest_store_4x4(dest, m, w, h, sums);
+      } // h
+    }   // w
+
+    // the columns right of the tiles and the rows below them
+    for (h = 0; h < height; h++)
+    {
+      int first = (h >= height - height % 4) ? 0 : width - width % 4;
+      for (w = first; w < width; w++)
+      {
+        float sum = 0.0f;
+        for (x = 0; x < kernel_order; x++)
+        {
+          for (y = 0; y < kernel_order; y++)
+          {
+            struct sparse_matrix *kernel = kernels[x][y];
+            float *pixel = image[w * stride + x * dilation][h * stride + y * dilation];
+            for (index = kernel->kernel_starts[m]; index < kernel->kernel_starts[m + 1]; index++)
+            {
+              sum += pixel[kernel->channel_numbers[index]] * kernel->values[index];
+            }
+          }
+        }
+        *conv_dest_at(dest, m, w, h) = (epilogue != NULL) ? epilogue_apply(epilogue, m, sum) : sum;
+      }
+    }
+  } // m
+}
+
+/* the strided convolution for any stride and dilation */
+void team_conv_sparse_strided_generic(float ***image, struct sparse_matrix ***kernels,
+                                      float ***output, int width, int height,
+                                      int nchannels, int nkernels, int kernel_order,
+                                      int stride, int dilation)
+{
+  struct conv_dest dest = {output, NULL, 0};
+
+  conv_sparse_strided_body(image, kernels, &dest, width, height, nchannels, nkernels,
+                           kernel_order, stride, dilation, NULL);
+}
+
+/* the team's sparse convolution with a stride, a dilation and an
+   optional epilogue, storing to dest; a pooling epilogue needs stride
+   and dilation 1. The image is conv_input_extent(width, ...) x
+   conv_input_extent(height, ...) */
+void team_conv_sparse_strided_dest(float ***image, struct sparse_matrix ***kernels,
+                                   const struct conv_dest *dest, int width, int height,
+                                   int nchannels, int nkernels, int kernel_order,
+                                   int stride, int dilation, const struct conv_epilogue *epilogue)
+{
+  if (stride == 1 && dilation == 1)
+  {
+    team_conv_sparse_dest(image, kernels, dest, width, height, nchannels, nkernels, kernel_order,
+                          epilogue);
+    return;
+  }
+  assert(epilogue == NULL || epilogue->pool == POOL_NONE);
+  if (stride == 2 && dilation == 1)
+  {
+    conv_sparse_strided_body(image, kernels, dest, width, height, nchannels, nkernels,
+                             kernel_order, 2, 1, epilogue);
+  }
+  else if (stride == 1 && dilation == 2)
+  {
+    conv_sparse_strided_body(image, kernels, dest, width, height, nchannels, nkernels,
+                             kernel_order, 1, 2, epilogue);
+  }
+  else
+  {
+    conv_sparse_strided_body(image, kernels, dest, width, height, nchannels, nkernels,
+                             kernel_order, stride, dilation, epilogue);
+  }
+}
+
+/* the team's sparse convolution with a stride and a dilation */
+void team_conv_sparse_strided(float ***image, struct sparse_matrix ***kernels,
+                              float ***output, int width, int height,
+                              int nchannels, int nkernels, int kernel_order,
+                              int stride, int dilation)
+{
+  struct conv_dest dest = {output, NULL, 0};
+
+  team_conv_sparse_strided_dest(image, kernels, &dest, width, height, nchannels, nkernels,
+                                kernel_order, stride, dilation, NULL);
+}
+
+/* "Same" padding
+
+   team_conv_sparse_same reads an image of exactly width x height pixels
+   and gives an output of the same size, as if the image had a zero halo
+   of kernel_order / 2 pixels, without one being allocated or copied, so
+   the unpadded output of a previous layer can be used in place. The
+   outputs whose pixels are all inside the image are done in the 4x4
+   tiles of team_conv_sparse, with no bounds checks; the ring of outputs
+   around them leaves out the kernel positions that fall outside. */
+
+/* one output pixel of kernel m, leaving out the pixels outside the image */
+static inline float conv_pixel_sparse_same(float ***image, struct sparse_matrix ***kernels,
+                                           int kernel_order, int width, int height,
+                                           int m, int w, int h)
+{
+  int pad = kernel_order / 2;
+  float sum = 0.0f;
+  int x, y, index;
+
+  for (x = 0; x < kernel_order; x++)
+  {
+    int wx = w + x - pad;
+    if (wx < 0 || wx >= width)
+    {
+      continue;
+    }
+    for (y = 0; y < kernel_order; y++)
+    {
+      struct sparse_matrix *kernel = kernels[x][y];
+      int hy = h + y - pad;
+      if (hy < 0 || hy >= height)
+      {
+        continue;
+      }
+      for (index = kernel->kernel_starts[m]; index < kernel->kernel_starts[m + 1]; index++)
+      {
+        sum += image[wx][hy][kernel->channel_numbers[index]] * kernel->values[index];
+      }
+    }
+  }
+  return sum;
+}
+
+/* the team's sparse convolution of an unpadded width x height image,
+   with "same" zero padding, storing to dest */
+void team_conv_sparse_same_dest(float ***image, struct sparse_matrix ***kernels,
+                                const struct conv_dest *dest, int width, int height,
+                                int nchannels, int nkernels, int kernel_order)
+{
+  int OpenMP_flag = team_conv_use_openmp(width, nchannels, nkernels, kernel_order);
+  int pad = kernel_order / 2;
+  // the interior outputs that read no pixel outside the image start at
+  // pad and go on while w + kernel_order - 1 - pad < width; the tiles
+  // cover whole groups of four of them
+  int tiles_w = (width - kernel_order + 1 > 0) ? (width - kernel_order + 1) / 4 : 0;
+  int tiles_h = (height - kernel_order + 1 > 0) ? (height - kernel_order + 1) / 4 : 0;
+  int m;
+
+#pragma omp parallel for if (OpenMP_flag)
+  for (m = 0; m < nkernels; m++)
+  {
+    int w, h, x, y, index;
+
+    for (w = pad; w < pad + 4 * tiles_w; w += 4)
+    {
+      for (h = pad; h < pad + 4 * tiles_h; h += 4)
+      {
+        __m128 sums[4];
+        int i;
+
+        for (i = 0; i < 4; i++)
+        {
+          sums[i] = _mm_setzero_ps();
+        }
+        for (x = 0; x < kernel_order; x++)
+        {
+          for (y = 0; y < kernel_order; y++)
+          {
+            struct sparse_matrix *kernel = kernels[x][y];
+            for (index = kernel->kernel_starts[m]; index < kernel->kernel_starts[m + 1]; index++)
+            {
+              tile_4x4_accumulate(image, w + x - pad, h + y - pad, kernel->channel_numbers[index],
+                                  kernel->values[index], sums);
+            }
+          }
+        }
+        conv_dest_store_4x4(dest, m, w, h, sums);
+      } // h
+    }   // w
+
+    // the ring around the tiles, with bounds checks
+    for (h = 0; h < height; h++)
+    {
+      int in_tile_rows = h >= pad && h < pad + 4 * tiles_h;
+      for (w = 0; w < width; w++)
+      {
+        if (in_tile_rows && w >= pad && w < pad + 4 * tiles_w)
+        {
+          w = pad + 4 * tiles_w - 1; // skip to the right of the tiles
+          continue;
+        }
+        *conv_dest_at(dest, m, w, h) =
+            conv_pixel_sparse_same(image, kernels, kernel_order, width, height, m, w, h);
+      }
+    }
+  } // m
+}
+
+/* the team's sparse convolution of an unpadded width x height image,
+   with "same" zero padding */
+void team_conv_sparse_same(float ***image, struct sparse_matrix ***kernels,
+                           float ***output, int width, int height,
+                           int nchannels, int nkernels, int kernel_order)
+{
+  struct conv_dest dest = {output, NULL, 0};
+
+  team_conv_sparse_same_dest(image, kernels, &dest, width, height, nchannels, nkernels,
+                             kernel_order);
+}
+
+/* Grouped and depthwise convolution
+
+   With groups, the kernels and the channels are split into the same
+   number of groups, and each kernel reads only the channels of its own
+   group. Such kernels still work in team_conv_sparse, but the grouped
+   path keeps their channel numbers relative to the first channel of
+   the group, in 16 bits, and walks the kernels group by group, so each
+   thread reads a slice of nchannels / groups channels of every pixel.
+   When every channel is a group of its own with a single kernel
+   (depthwise), each kernel position is just one weight per channel:
+   the depthwise engine keeps these densely, as [x][y][c], and applies
+   them to four channels of four pixels at once, since the channels are
+   contiguous in the image, then transposes the 4x4 block to store four
+   pixels of each output. */
+
+// grouped kernels with channel numbers relative to their group
+struct grouped_kernels
+{
+  int groups;
+  struct sparse_matrix ***kernels; // kernel_starts and values
+  uint16_t **group_channels;       // [x * kernel_order + y]: channels within the group
+};
+
+// depthwise kernels as one dense weight per channel and position
+struct depthwise_kernels
+{
+  int kernel_order;
+  int nchannels;
+  float *weights; // [x][y][c]
+};
+
+/* copy sparse kernels, leaving out every non-zero that lies outside the
+   group of its kernel */
+struct sparse_matrix ***kernels_group_mask(struct sparse_matrix ***kernels, int kernel_order,
+                                           int nkernels, int nchannels, int groups)
+{
+  struct sparse_matrix ***result = malloc(sizeof(struct sparse_matrix **) * kernel_order);
+  struct sparse_matrix **temp = malloc(sizeof(struct sparse_matrix *) * kernel_order * kernel_order);
+  int kernels_per_group = nkernels / groups, channels_per_group = nchannels / groups;
+  int x, y, m, index;
+
+  assert(result != NULL && temp != NULL);
+  for (x = 0; x < kernel_order; x++)
+  {
+    result[x] = &(temp[x * kernel_order]);
+    for (y = 0; y < kernel_order; y++)
+    {
+      struct sparse_matrix *kernel = kernels[x][y];
+      struct sparse_matrix *masked = sparse_matrix_new(nkernels, nchannels, kernel->non_zeros);
+      int nvalues = 0;
+
+      for (m = 0; m < nkernels; m++)
+      {
+        int first = (m / kernels_per_group) * channels_per_group;
+        masked->kernel_starts[m] = nvalues;
+        for (index = kernel->kernel_starts[m]; index < kernel->kernel_starts[m + 1]; index++)
+        {
+          int c = kernel->channel_numbers[index];
+          if (c >= first && c < first + channels_per_group)
+          {
+            masked->values[nvalues] = kernel->values[index];
+            masked->channel_numbers[nvalues] = c;
+            nvalues++;
+          }
+        }
+      }
+      masked->kernel_starts[nkernels] = nvalues;
+      masked->non_zeros = nvalues;
+      result[x][y] = masked;
+    }
+  }
+  return result;
+}
+
+/* make the grouped form of kernels whose non-zeros all lie in their groups */
+struct grouped_kernels *kernels_to_grouped(struct sparse_matrix ***kernels, int kernel_order,
+                                           int nkernels, int nchannels, int groups)
+{
+  struct grouped_kernels *result = malloc(sizeof(struct grouped_kernels));
+  int kernels_per_group = nkernels / groups, channels_per_group = nchannels / groups;
+  int x, y, m, index;
+
+  assert(result != NULL && channels_per_group <= 65536);
+  result->groups = groups;
+  result->kernels = kernels;
+  result->group_channels = malloc(sizeof(uint16_t *) * kernel_order * kernel_order);
+  assert(result->group_channels != NULL);
+  for (x = 0; x < kernel_order; x++)
+  {
+    for (y = 0; y < kernel_order; y++)
+    {
+      struct sparse_matrix *kernel = kernels[x][y];
+      uint16_t *channels = malloc(sizeof(uint16_t) * (kernel->non_zeros + 1));
+
+      assert(channels != NULL);
+      for (m = 0; m < nkernels; m++)
+      {
+        int first = (m / kernels_per_group) * channels_per_group;
+        for (index = kernel->kernel_starts[m]; index < kernel->kernel_starts[m + 1]; index++)
+        {
+          assert(kernel->channel_numbers[index] - first < channels_per_group);
+          channels[index] = kernel->channel_numbers[index] - first;
+        }
+      }
+      result->group_channels[x * kernel_order + y] = channels;
+    }
+  }
+  return result;
+}
+
+/* the team's sparse convolution of grouped kernels */
+void team_conv_sparse_grouped(float ***image, struct grouped_kernels *grouped,
+                              float ***output, int width, int height,
+                              int nchannels, int nkernels, int kernel_order)
+{
+  int OpenMP_flag = team_conv_use_openmp(width, nchannels / grouped->groups, nkernels, kernel_order);
+  struct conv_dest dest = {output, NULL, 0};
+  int kernels_per_group = nkernels / grouped->groups, channels_per_group = nchannels / grouped->groups;
+  int m;
+
+  // static scheduling gives each thread whole runs of kernels, so most
+  // threads work within one or two groups
+#pragma omp parallel for schedule(static) if (OpenMP_flag)
+  for (m = 0; m < nkernels; m++)
+  {
+    int first = (m / kernels_per_group) * channels_per_group;
+    int w, h, x, y, index;
+
+    for (w = 0; w < width - width % 4; w += 4)
+    {
+      for (h = 0; h < height - height % 4; h += 4)
+      {
+        __m128 sums[4];
+        int i;
+
+        for (i = 0; i < 4; i++)
+        {
+          sums[i] = _mm_setzero_ps();
+        }
+        for (x = 0; x < kernel_order; x++)
+        {
+          for (y = 0; y < kernel_order; y++)
+          {
+            struct sparse_matrix *kernel = grouped->kernels[x][y];
+            const uint16_t *channels = grouped->group_channels[x * kernel_order + y];
+            for (index = kernel->kernel_starts[m]; index < kernel->kernel_starts[m + 1]; index++)
+            {
+              tile_4x4_accumulate(image, w + x, h + y, first + channels[index],
+                                  kernel->values[index], sums);
+            }
+          }
+        }
+        conv_dest_store_4x4(&dest, m, w, h, sums);
+      } // h
+    }   // w
+
+    // the columns right of the tiles and the rows below them
+    for (h = 0; h < height; h++)
+    {
+      int first_w = (h >= height - height % 4) ? 0 : width - width % 4;
+      for (w = first_w; w < width; w++)
+      {
+        float sum = 0.0f;
+        for (x = 0; x < kernel_order; x++)
+        {
+          for (y = 0; y < kernel_order; y++)
+          {
+            struct sparse_matrix *kernel = grouped->kernels[x][y];
+            const uint16_t *channels = grouped->group_channels[x * kernel_order + y];
+            const float *pixel = image[w + x][h + y] + first;
+            for (index = kernel->kernel_starts[m]; index < kernel->kernel_starts[m + 1]; index++)
+            {
+              sum += pixel[channels[index]] * kernel->values[index];
+            }
+          }
+        }
+        output[m][h][w] = sum;
+      }
+    }
+  } // m
+}
+
+/* make the depthwise form of kernels where kernel c reads only channel c */
+struct depthwise_kernels *kernels_to_depthwise(struct sparse_matrix ***kernels, int kernel_order,
+                                               int nchannels)
+{
+  struct depthwise_kernels *result = malloc(sizeof(struct depthwise_kernels));
+  int x, y, c, index;
+
+  assert(result != NULL);
+  result->kernel_order = kernel_order;
+  result->nchannels = nchannels;
+  result->weights = calloc((size_t)kernel_order * kernel_order * nchannels, sizeof(float));
+  assert(result->weights != NULL);
+  for (x = 0; x < kernel_order; x++)
+  {
+    for (y = 0; y < kernel_order; y++)
+    {
+      struct sparse_matrix *kernel = kernels[x][y];
+      float *weights = result->weights + (size_t)(x * kernel_order + y) * nchannels;
+      for (c = 0; c < nchannels; c++)
+      {
+        for (index = kernel->kernel_starts[c]; index < kernel->kernel_starts[c + 1]; index++)
+        {
+          assert(kernel->channel_numbers[index] == c);
+          weights[c] = kernel->values[index];
+        }
+      }
+    }
+  }
+  return result;
+}
+
+/* the depthwise convolution: output c is the kernel_order x kernel_order
+   stencil of channel c */
+void team_conv_depthwise(float ***image, struct depthwise_kernels *depthwise,
+                         float ***output, int width, int height)
+{
+  int kernel_order = depthwise->kernel_order, nchannels = depthwise->nchannels;
+  int OpenMP_flag = team_conv_use_openmp(width, 1, nchannels, kernel_order);
+  int h;
+
+#pragma omp parallel for if (OpenMP_flag)
+  for (h = 0; h < height; h++)
+  {
+    int w, c, x, y, i;
+
+    for (c = 0; c < nchannels - nchannels % 4; c += 4)
+    {
+      for (w = 0; w < width - width % 4; w += 4)
+      {
+        // sums[i] holds channels c to c + 3 of pixel w + i
+        __m128 sums[4];
+        for (i = 0; i < 4; i++)
+        {
+          sums[i] = _mm_setzero_ps();
+        }
+        for (x = 0; x < kernel_order; x++)
+        {
+          for (y = 0; y < kernel_order; y++)
+          {
+            __m128 weights = _mm_loadu_ps(depthwise->weights + (size_t)(x * kernel_order + y) * nchannels + c);
+            for (i = 0; i < 4; i++)
+            {
+              sums[i] = _mm_add_ps(sums[i], _mm_mul_ps(_mm_loadu_ps(&image[w + i + x][h + y][c]), weights));
+            }
+          }
+        }
+        // now sums[i] holds pixels w to w + 3 of channel c + i
+        _MM_TRANSPOSE4_PS(sums[0], sums[1], sums[2], sums[3]);
+        for (i = 0; i < 4; i++)
+        {
+          _mm_storeu_ps(&output[c + i][h][w], sums[i]);
+        }
+      }
+    }
+
+    // the channels after the last group of four, and the pixels right
+    // of the last group of four
+    for (c = 0; c < nchannels; c++)
+    {
+      int first_w = (c >= nchannels - nchannels % 4) ? 0 : width - width % 4;
+      for (w = first_w; w < width; w++)
+      {
+        float sum = 0.0f;
+        for (x = 0; x < kernel_order; x++)
+        {
+          for (y = 0; y < kernel_order; y++)
+          {
+            sum += image[w + x][h + y][c] * depthwise->weights[(size_t)(x * kernel_order + y) * nchannels + c];
+          }
+        }
+        output[c][h][w] = sum;
+      }
+    }
+  } // h
+}
+
+/* N:M structured sparsity
+
+   Pruning tools can leave exactly n non-zeros in every group of four
+   consecutive channels (2:4 or 1:4). Then the kernels need no channel
+   numbers and no starts: the values of every kernel are stored in order,
+   n per group, and the position of each within its group takes two
+   bits, four positions to a byte. The convolution knows how many
+   non-zeros there are and where each group starts, so its inner loop
+   takes a byte of positions at a time and is fully unrolled over the
+   four non-zeros it describes, with no branches and no loop counter
+   loaded from memory. */
+
+#define NM_GROUP 4 // channels per group
+
+struct nm_kernels
+{
+  int n;              // non-zeros per group of NM_GROUP channels: 1 or 2
+  int per_kernel;     // non-zeros of one kernel at one position
+  float *values;      // [x][y][m][per_kernel]
+  uint8_t *positions; // [x][y][m][per_kernel / 4]: 2 bits per non-zero
+};
+
+/* prune dense kernels to n non-zeros in every group of four channels,
+   keeping the largest, and return the N:M form; the pruned values are
+   set to zero in kernels too. nchannels must be a multiple of 16. */
+struct nm_kernels *kernels_prune_nm(float ****kernels, int kernel_order, int nkernels,
+                                    int nchannels, int n)
+{
+  struct nm_kernels *result = malloc(sizeof(struct nm_kernels));
+  long long total;
+  int x, y, m, g, j;
+
+  assert(result != NULL && (n == 1 || n == 2) && nchannels % 16 == 0);
+  result->n = n;
+  result->per_kernel = nchannels / NM_GROUP * n;
+  total = (long long)kernel_order * kernel_order * nkernels * result->per_kernel;
+  result->values = malloc(sizeof(float) * total);
+  result->positions = calloc(total / 4, 1);
+  assert(result->values != NULL && result->positions != NULL);
+
+  for (x = 0; x < kernel_order; x++)
+  {
+    for (y = 0; y < kernel_order; y++)
+    {
+      for (m = 0; m < nkernels; m++)
+      {
+        long long base = ((long long)(x * kernel_order + y) * nkernels + m) * result->per_kernel;
+        float *weights = kernels[x][y][m];
+        for (g = 0; g < nchannels / NM_GROUP; g++)
+        {
+          float *group = weights + g * NM_GROUP;
+          int keep[2] = {0, 1}, i;
+
+          // the n largest magnitudes of the group, in channel order
+          if (n == 1)
+          {
+            for (i = 1; i < NM_GROUP; i++)
+            {
+              keep[0] = (fabsf(group[i]) > fabsf(group[keep[0]])) ? i : keep[0];
+            }
+          }
+          else
+          {
+            for (i = 2; i < NM_GROUP; i++)
+            {
+              int smaller = (fabsf(group[keep[0]]) <= fabsf(group[keep[1]])) ? 0 : 1;
+              if (fabsf(group[i]) > fabsf(group[keep[smaller]]))
+              {
+                keep[smaller] = i;
+              }
+            }
+            if (keep[0] > keep[1])
+            {
+              int swap = keep[0];
+              keep[0] = keep[1];
+              keep[1] = swap;
+            }
+          }
+          for (j = 0; j < n; j++)
+          {
+            long long k = base + g * n + j;
+            result->values[k] = group[keep[j]];
+            result->positions[k / 4] |= keep[j] << (2 * (k % 4));
+          }
+          for (i = 0; i < NM_GROUP; i++)
+          {
+            if (i != keep[0] && (n == 1 || i != keep[1]))
+            {
+              group[i] = 0.0;
+            }
+          }
+        }
+      }
+    }
+  }
+  return result;
+}
+
+/* the N:M convolution, inlined into one copy for each n */
+static inline __attribute__((always_inline)) void
+conv_nm_body(float ***image, struct nm_kernels *nm, float ***output, int width, int height,
+             int nchannels, int nkernels, int kernel_order, const int n)
+{
+  int OpenMP_flag = team_conv_use_openmp(width, nchannels, nkernels, kernel_order);
+  struct conv_dest dest = {output, NULL, 0};
+  const int per_kernel = nchannels / NM_GROUP * n;
+  int m;
+
+#pragma omp parallel for if (OpenMP_flag)
+  for (m = 0; m < nkernels; m++)
+  {
+    int w, h, x, y, b, j;
+
+    for (w = 0; w < width - width % 4; w += 4)
+    {
+      for (h = 0; h < height - height % 4; h += 4)
+      {
+        __m128 sums[4];
+        int i;
+
+        for (i = 0; i < 4; i++)
+        {
+          sums[i] = _mm_setzero_ps();
+        }
+        for (x = 0; x < kernel_order; x++)
+        {
+          for (y = 0; y < kernel_order; y++)
+          {
+            long long base = ((long long)(x * kernel_order + y) * nkernels + m) * per_kernel;
+            const float *values = nm->values + base;
+            const uint8_t *positions = nm->positions + base / 4;
+            // a byte of positions covers 4 / n groups, 4 * 4 / n channels
+            for (b = 0; b < per_kernel / 4; b++)
+            {
+              unsigned int byte = positions[b];
+              for (j = 0; j < 4; j++)
+              {
+                int c = (b * 4 + j) / n * NM_GROUP + ((byte >> (2 * j)) & 3);
+                tile_4x4_accumulate(image, w + x, h + y, c, values[b * 4 + j], sums);
+              }
+            }
+          }
+        }
+        conv_dest_store_4x4(&dest, m, w, h, sums);
+      } // h
+    }   // w
+
+    // the columns right of the tiles and the rows below them
+    for (h = 0; h < height; h++)
+    {
+      int first = (h >= height - height % 4) ? 0 : width - width % 4;
+      for (w = first; w < width; w++)
+      {
+        float sum = 0.0f;
+        for (x = 0; x < kernel_order; x++)
+        {
+          for (y = 0; y < kernel_order; y++)
+          {
+            long long base = ((long long)(x * kernel_order + y) * nkernels + m) * per_kernel;
+            const float *pixel = image[w + x][h + y];
+            int k;
+            for (k = 0; k < per_kernel; k++)
+            {
+              int c = k / n * NM_GROUP + ((nm->positions[(base + k) / 4] >> (2 * (k % 4))) & 3);
+              sum += pixel[c] * nm->values[base + k];
+            }
+          }
+        }
+        output[m][h][w] = sum;
+      }
+    }
+  } // m
+}
+
+/* the team's convolution of N:M structured sparse kernels */
+void team_conv_nm(float ***image, struct nm_kernels *nm, float ***output, int width, int height,
+                  int nchannels, int nkernels, int kernel_order)
+{
+  if (nm->n == 1)
+  {
+    conv_nm_body(image, nm, output, width, height, nchannels, nkernels, kernel_order, 1);
+  }
+  else
+  {
+    conv_nm_body(image, nm, output, width, height, nchannels, nkernels, kernel_order, 2);
+  }
+}
+
+/* Sparse images
+
+   After a ReLU most of the activations are zero, but team_conv_sparse
+   multiplies every one. The sparse image engine compresses the image
+   into a list of the non-zero channels of every pixel and transposes
+   each kernel position into lists of the kernels that use every
+   channel, so it does only the products where both the activation and
+   the weight are non-zero. Each output pixel gathers these into an
+   accumulator of nkernels floats, which stays in the L1 cache, then
+   stores it. Compressing an image costs a pass over it, which is
+   counted as well, since every layer's input must be compressed. */
+
+// the non-zeros of every pixel of an image, pixel (w, h) being number
+// w * height + h
+struct sparse_image
+{
+  int width, height; // including any halo
+  int *pixel_starts; // [width * height + 1]
+  int *channels;
+  float *values;
+};
+
+// sparse kernels with the kernels that use each channel listed
+struct transposed_kernels
+{
+  int nchannels;
+  int **channel_starts; // [x * kernel_order + y][nchannels + 1]
+  int **kernel_numbers; // [x * kernel_order + y][non-zeros]
+  float **values;       // [x * kernel_order + y][non-zeros]
+};
+
+/* compress an image into the non-zeros of each pixel */
+void compress_image(float ***image, int width, int height, int nchannels, struct sparse_image *result)
+{
+  long long pixels = (long long)width * height;
+  long long p, total = 0;
+
+  result->width = width;
+  result->height = height;
+  result->pixel_starts = malloc(sizeof(int) * (pixels + 1));
+  assert(result->pixel_starts != NULL);
+
+  // count the non-zeros of every pixel, then place them
+#pragma omp parallel for
+  for (p = 0; p < pixels; p++)
+  {
+    const float *pixel = image[p / height][p % height];
+    int c, count = 0;
+    for (c = 0; c < nchannels; c++)
+    {
+      count += pixel[c] != 0.0f;
+    }
+    result->pixel_starts[p] = count;
+  }
+  for (p = 0; p < pixels; p++)
+  {
+    int count = result->pixel_starts[p];
+    result->pixel_starts[p] = total;
+    total += count;
+  }
+  assert(total <= INT_MAX);
+  result->pixel_starts[pixels] = total;
+  result->channels = malloc(sizeof(int) * (total + 1));
+  result->values = malloc(sizeof(float) * (total + 1));
+  assert(result->channels != NULL && result->values != NULL);
+
+#pragma omp parallel for
+  for (p = 0; p < pixels; p++)
+  {
+    const float *pixel = image[p / height][p % height];
+    int c, next = result->pixel_starts[p];
+    for (c = 0; c < nchannels; c++)
+    {
+      if (pixel[c] != 0.0f)
+      {
+        result->channels[next] = c;
+        result->values[next] = pixel[c];
+        next++;
+      }
+    }
+  }
+}
+
+/* free the arrays of a compressed image */
+void sparse_image_free(struct sparse_image *image)
+{
+  free(image->pixel_starts);
+  free(image->channels);
+  free(image->values);
+}
+
+/* list the kernels that use every channel at every kernel position */
+struct transposed_kernels *transpose_kernels(struct sparse_matrix ***kernels, int kernel_order,
+                                             int nkernels, int nchannels)
+{
+  struct transposed_kernels *result = malloc(sizeof(struct transposed_kernels));
+  int positions = kernel_order * kernel_order;
+  int i, c, m, index;
+
+  assert(result != NULL);
+  result->nchannels = nchannels;
+  result->channel_starts = malloc(sizeof(int *) * positions);
+  result->kernel_numbers = malloc(sizeof(int *) * positions);
+  result->values = malloc(sizeof(float *) * positions);
+  assert(result->channel_starts != NULL && result->kernel_numbers != NULL && result->values != NULL);
+  for (i = 0; i < positions; i++)
+  {
+    struct sparse_matrix *kernel = kernels[i / kernel_order][i % kernel_order];
+    int *starts = calloc(nchannels + 1, sizeof(int));
+    int *next = malloc(sizeof(int) * nchannels);
+
+    result->kernel_numbers[i] = malloc(sizeof(int) * (kernel->non_zeros + 1));
+    result->values[i] = malloc(sizeof(float) * (kernel->non_zeros + 1));
+    assert(starts != NULL && next != NULL && result->kernel_numbers[i] != NULL && result->values[i] != NULL);
+    // a counting sort of the non-zeros by channel keeps the kernels of
+    // each channel in increasing order
+    for (index = 0; index < kernel->non_zeros; index++)
+    {
+      starts[kernel->channel_numbers[index] + 1]++;
+    }
+    for (c = 0; c < nchannels; c++)
+    {
+      starts[c + 1] += starts[c];
+      next[c] = starts[c];
+    }
+    for (m = 0; m < nkernels; m++)
+    {
+      for (index = kernel->kernel_starts[m]; index < kernel->kernel_starts[m + 1]; index++)
+      {
+        int slot = next[kernel->channel_numbers[index]]++;
+        result->kernel_numbers[i][slot] = m;
+        result->values[i][slot] = kernel->values[index];
+      }
+    }
+    result->channel_starts[i] = starts;
+    free(next);
+  }
+  return result;
+}
+
+/* the sparse x sparse convolution of a compressed image */
+void team_conv_sparse_image(struct sparse_image *image, struct transposed_kernels *kernels,
+                            float ***output, int width, int height,
+                            int nchannels, int nkernels, int kernel_order)
+{
+  int OpenMP_flag = team_conv_use_openmp(width, nchannels, nkernels, kernel_order);
+
+#pragma omp parallel if (OpenMP_flag)
+  {
+    float *sums = malloc(sizeof(float) * nkernels);
+    int w, h, x, y, m, i, j;
+
+    assert(sums != NULL);
+#pragma omp for
+    for (w = 0; w < width; w++)
+    {
+      for (h = 0; h < height; h++)
+      {
+        memset(sums, 0, sizeof(float) * nkernels);
+        for (x = 0; x < kernel_order; x++)
+        {
+          for (y = 0; y < kernel_order; y++)
+          {
+            int position = x * kernel_order + y;
+            const int *starts = kernels->channel_starts[position];
+            const int *kernel_numbers = kernels->kernel_numbers[position];
+            const float *values = kernels->values[position];
+            int pixel = (w + x) * image->height + h + y;
+            for (i = image->pixel_starts[pixel]; i < image->pixel_starts[pixel + 1]; i++)
+            {
+              int c = image->channels[i];
+              float a = image->values[i];
+              for (j = starts[c]; j < starts[c + 1]; j++)
+              {
+                sums[kernel_numbers[j]] += a * values[j];
+              }
+            }
+          }
+        }
+        for (m = 0; m < nkernels; m++)
+        {
+          output[m][h][w] = sums[m];
+        }
+      }
+    }
+    free(sums);
+  }
+}
+
+/* Channel pruned kernels
+
+   Structured pruning leaves some input channels used by most kernels
+   at most positions and the others nearly empty. The channel planner
+   finds the channels whose weights are at least a given fraction
+   non-zero and packs their weights densely, as [x][y][s][m] for the
+   s-th surviving channel, with the kernels padded to a multiple of
+   eight. These go through a dense micro-GEMM: a block of four pixels
+   by eight kernels is held in eight SSE sums, and every surviving
+   channel adds a broadcast pixel value times two vectors of weights,
+   with no channel numbers at all. The non-zeros of the other channels
+   stay in CSR and go through team_conv_sparse, which also initialises
+   the output. The surviving channels of the image are packed next to
+   each other by every call. */
+
+#define CHANNEL_PLAN_BLOCK 8 // kernels in one micro-GEMM block
+
+struct channel_plan
+{
+  int nsurviving;
+  int *surviving;                    // the surviving channels
+  int padded_kernels;                // nkernels rounded up to the block
+  float *dense;                      // [x][y][s][padded_kernels]
+  struct sparse_matrix ***remainder; // the non-zeros of the other channels
+};
+
+/* find the channels whose weights are at least threshold non-zero and
+   split the kernels into a dense part over them and a CSR remainder */
+struct channel_plan *plan_channel_pruned(struct sparse_matrix ***kernels, int kernel_order,
+                                         int nkernels, int nchannels, double threshold)
+{
+  struct channel_plan *plan = malloc(sizeof(struct channel_plan));
+  int *counts = calloc(nchannels, sizeof(int));
+  int *slot = malloc(sizeof(int) * nchannels);
+  struct sparse_matrix **temp = malloc(sizeof(struct sparse_matrix *) * kernel_order * kernel_order);
+  int x, y, m, c, index;
+
+  assert(plan != NULL && counts != NULL && slot != NULL && temp != NULL);
+  for (x = 0; x < kernel_order; x++)
+  {
+    for (y = 0; y < kernel_order; y++)
+    {
+      struct sparse_matrix *kernel = kernels[x][y];
+      for (index = 0; index < kernel->non_zeros; index++)
+      {
+        counts[kernel->channel_numbers[index]]++;
+      }
+    }
+  }
+  plan->surviving = malloc(sizeof(int) * nchannels);
+  plan->nsurviving = 0;
+  for (c = 0; c < nchannels; c++)
+  {
+    slot[c] = -1;
+    if (counts[c] >= threshold * kernel_order * kernel_order * nkernels)
+    {
+      slot[c] = plan->nsurviving;
+      plan->surviving[plan->nsurviving++] = c;
+    }
+  }
+
+  plan->padded_kernels = (nkernels + CHANNEL_PLAN_BLOCK - 1) / CHANNEL_PLAN_BLOCK * CHANNEL_PLAN_BLOCK;
+  plan->dense = calloc((size_t)kernel_order * kernel_order * plan->nsurviving * plan->padded_kernels + 1,
+                       sizeof(float));
+  plan->remainder = malloc(sizeof(struct sparse_matrix **) * kernel_order);
+  assert(plan->dense != NULL && plan->remainder != NULL);
+  for (x = 0; x < kernel_order; x++)
+  {
+    plan->remainder[x] = &(temp[x * kernel_order]);
+    for (y = 0; y < kernel_order; y++)
+    {
+      struct sparse_matrix *kernel = kernels[x][y];
+      struct sparse_matrix *rest = sparse_matrix_new(nkernels, nchannels, kernel->non_zeros);
+      float *dense = plan->dense + (size_t)(x * kernel_order + y) * plan->nsurviving * plan->padded_kernels;
+      int nvalues = 0;
+
+      for (m = 0; m < nkernels; m++)
+      {
+        rest->kernel_starts[m] = nvalues;
+        for (index = kernel->kernel_starts[m]; index < kernel->kernel_starts[m + 1]; index++)
+        {
+          c = kernel->channel_numbers[index];
+          if (slot[c] >= 0)
+          {
+            dense[(size_t)slot[c] * plan->padded_kernels + m] = kernel->values[index];
+          }
+          else
+          {
+            rest->values[nvalues] = kernel->values[index];
+            rest->channel_numbers[nvalues] = c;
+            nvalues++;
+          }
+        }
+      }
+      rest->kernel_starts[nkernels] = nvalues;
+      rest->non_zeros = nvalues;
+      plan->remainder[x][y] = rest;
+    }
+  }
+  free(counts);
+  free(slot);
+  return plan;
+}
+
+/* the team's convolution of channel pruned kernels */
+void team_conv_channel_pruned(float ***image, struct channel_plan *plan,
+                              float ***output, int width, int height,
+                              int nchannels, int nkernels, int kernel_order)
+{
+  int OpenMP_flag = team_conv_use_openmp(width, nchannels, nkernels, kernel_order);
+  int image_height = height + kernel_order;
+  long long pixels = (long long)(width + kernel_order) * image_height, p;
+  int nsurviving = plan->nsurviving, padded = plan->padded_kernels;
+  float *packed;
+  int block, h;
+
+  // the scattered remainder, which also sets every output
+  team_conv_sparse(image, plan->remainder, output, width, height, nchannels, nkernels, kernel_order);
+  if (nsurviving == 0)
+  {
+    return;
+  }
+
+  packed = malloc(sizeof(float) * pixels * nsurviving);
+  assert(packed != NULL);
+#pragma omp parallel for if (OpenMP_flag)
+  for (p = 0; p < pixels; p++)
+  {
+    const float *pixel = image[p / image_height][p % image_height];
+    int s;
+    for (s = 0; s < nsurviving; s++)
+    {
+      packed[p * nsurviving + s] = pixel[plan->surviving[s]];
+    }
+  }
+
+#pragma omp parallel for collapse(2) if (OpenMP_flag)
+  for (block = 0; block < padded / CHANNEL_PLAN_BLOCK; block++)
+  {
+    for (h = 0; h < height; h++)
+    {
+      int m0 = block * CHANNEL_PLAN_BLOCK;
+      int w, x, y, s, i, b;
+
+      for (w = 0; w < width - width % 4; w += 4)
+      {
+        // sums[i][b]: pixel w + i, kernels m0 + 4 * b to m0 + 4 * b + 3
+        __m128 sums[4][2];
+        for (i = 0; i < 4; i++)
+        {
+          sums[i][0] = _mm_setzero_ps();
+          sums[i][1] = _mm_setzero_ps();
+        }
+        for (x = 0; x < kernel_order; x++)
+        {
+          for (y = 0; y < kernel_order; y++)
+          {
+            const float *weights = plan->dense + (size_t)(x * kernel_order + y) * nsurviving * padded + m0;
+            const float *pixels_row = packed + ((long long)(w + x) * image_height + h + y) * nsurviving;
+            for (s = 0; s < nsurviving; s++)
+            {
+              __m128 low = _mm_loadu_ps(weights + (size_t)s * padded);
+              __m128 high = _mm_loadu_ps(weights + (size_t)s * padded + 4);
+              for (i = 0; i < 4; i++)
+              {
+                // the pixels w + i are image_height * nsurviving apart
+                __m128 value = _mm_set1_ps(pixels_row[(long long)i * image_height * nsurviving + s]);
+                sums[i][0] = _mm_add_ps(sums[i][0], _mm_mul_ps(value, low));
+                sums[i][1] = _mm_add_ps(sums[i][1], _mm_mul_ps(value, high));
+              }
+            }
+          }
+        }
+        // transpose to four pixels of each kernel and add them to output
+        for (b = 0; b < 2; b++)
+        {
+          _MM_TRANSPOSE4_PS(sums[0][b], sums[1][b], sums[2][b], sums[3][b]);
+          for (i = 0; i < 4; i++)
+          {
+            int m = m0 + 4 * b + i;
+            if (m < nkernels)
+            {
+              _mm_storeu_ps(&output[m][h][w], _mm_add_ps(_mm_loadu_ps(&output[m][h][w]), sums[i][b]));
+            }
+          }
+        }
+      }
+
+      // the pixels right of the last group of four
+      for (; w < width; w++)
+      {
+        for (i = 0; i < CHANNEL_PLAN_BLOCK && m0 + i < nkernels; i++)
+        {
+          float sum = 0.0f;
+          for (x = 0; x < kernel_order; x++)
+          {
+            for (y = 0; y < kernel_order; y++)
+            {
+              const float *weights = plan->dense + (size_t)(x * kernel_order + y) * nsurviving * padded + m0 + i;
+              const float *pixel = packed + ((long long)(w + x) * image_height + h + y) * nsurviving;
+              for (s = 0; s < nsurviving; s++)
+              {
+                sum += pixel[s] * weights[(size_t)s * padded];
+              }
+            }
+          }
+          output[m0 + i][h][w] += sum;
+        }
+      }
+    } // h
+  }   // block
+  free(packed);
+}
+
+/* Hybrid dense and sparse kernels
+
+   The density of real kernels varies a lot from one output kernel to
+   the next. The hybrid planner looks at each kernel on its own and
+   keeps it sparse, or, when at least a threshold fraction of its
+   weights are non-zero, stores it densely as [x][y][c]; a dense kernel
+   is then a dot product over the contiguous channels of each pixel,
+   four channels at a time, for four pixels at once, without a channel
+   number per weight. One parallel loop over the kernels runs whichever
+   engine each kernel was given, with dynamic scheduling since the
+   kernels take different times. */
+
+struct hybrid_kernels
+{
+  int ndense;
+  int *dense_index;                // [m]: the dense kernel of m, or -1 if sparse
+  float *dense;                    // [dense kernel][x][y][c]
+  struct sparse_matrix ***kernels; // the sparse kernels
+};
+
+/* plan each kernel as dense when at least threshold of its weights are non-zero */
+struct hybrid_kernels *plan_hybrid(struct sparse_matrix ***kernels, int kernel_order,
+                                   int nkernels, int nchannels, double threshold)
+{
+  struct hybrid_kernels *plan = malloc(sizeof(struct hybrid_kernels));
+  long long per_kernel = (long long)kernel_order * kernel_order * nchannels;
+  int x, y, m, index;
+
+  assert(plan != NULL);
+  plan->kernels = kernels;
+  plan->ndense = 0;
+  plan->dense_index = malloc(sizeof(int) * nkernels);
+  assert(plan->dense_index != NULL);
+  for (m = 0; m < nkernels; m++)
+  {
+    long long non_zeros = 0;
+    for (x = 0; x < kernel_order; x++)
+    {
+      for (y = 0; y < kernel_order; y++)
+      {
+        non_zeros += kernels[x][y]->kernel_starts[m + 1] - kernels[x][y]->kernel_starts[m];
+      }
+    }
+    plan->dense_index[m] = (non_zeros >= threshold * per_kernel) ? plan->ndense++ : -1;
+  }
+
+  plan->dense = calloc(plan->ndense * per_kernel + 1, sizeof(float));
+  assert(plan->dense != NULL);
+  for (m = 0; m < nkernels; m++)
+  {
+    if (plan->dense_index[m] < 0)
+    {
+      continue;
+    }
+    for (x = 0; x < kernel_order; x++)
+    {
+      for (y = 0; y < kernel_order; y++)
+      {
+        struct sparse_matrix *kernel = kernels[x][y];
+        float *weights = plan->dense + plan->dense_index[m] * per_kernel + (long long)(x * kernel_order + y) * nchannels;
+        for (index = kernel->kernel_starts[m]; index < kernel->kernel_starts[m + 1]; index++)
+        {
+          weights[kernel->channel_numbers[index]] = kernel->values[index];
+        }
+      }
+    }
+  }
+  return plan;
+}
+
+/* all the outputs of sparse kernel m, in the 4x4 tiles of team_conv_sparse */
+static inline void conv_sparse_kernel(float ***image, struct sparse_matrix ***kernels, float ***output,
+                                      int m, int width, int height, int nchannels, int kernel_order)
+{
+  struct conv_dest dest = {output, NULL, 0};
+  int w, h;
+
+  conv_sparse_kernel_tiles(image, kernels, &dest, m, width, height, nchannels, kernel_order, NULL);
+  for (h = 0; h < height; h++)
+  {
+    int first = (h >= height - height % 4) ? 0 : width - width % 4;
+    for (w = first; w < width; w++)
+    {
+      output[m][h][w] = conv_pixel_sparse(image, kernels, kernel_order, m, w, h);
+    }
+  }
+}
+
+/* all the outputs of a dense kernel with weights [x][y][c] */
+static inline void conv_dense_kernel(float ***image, const float *weights, float **output,
+                                     int width, int height, int nchannels, int kernel_order)
+{
+  int w, h, x, y, c, i;
+
+  for (h = 0; h < height; h++)
+  {
+    for (w = 0; w < width - width % 4; w += 4)
+    {
+      // sums[i] holds partial sums of pixel w + i in its four lanes
+      __m128 sums[4];
+      float tails[4] = {0.0f, 0.0f, 0.0f, 0.0f};
+
+      for (i = 0; i < 4; i++)
+      {
+        sums[i] = _mm_setzero_ps();
+      }
+      for (x = 0; x < kernel_order; x++)
+      {
+        for (y = 0; y < kernel_order; y++)
+        {
+          const float *kernel = weights + (x * kernel_order + y) * nchannels;
+          const float *p0 = image[w + x][h + y], *p1 = image[w + 1 + x][h + y];
+          const float *p2 = image[w + 2 + x][h + y], *p3 = image[w + 3 + x][h + y];
+          // each vector of weights is loaded once for the four pixels
+          for (c = 0; c < nchannels - nchannels % 4; c += 4)
+          {
+            __m128 k = _mm_loadu_ps(kernel + c);
+            sums[0] = _mm_add_ps(sums[0], _mm_mul_ps(_mm_loadu_ps(p0 + c), k));
+            sums[1] = _mm_add_ps(sums[1], _mm_mul_ps(_mm_loadu_ps(p1 + c), k));
+            sums[2] = _mm_add_ps(sums[2], _mm_mul_ps(_mm_loadu_ps(p2 + c), k));
+            sums[3] = _mm_add_ps(sums[3], _mm_mul_ps(_mm_loadu_ps(p3 + c), k));
+          }
+          for (; c < nchannels; c++)
+          {
+            tails[0] += p0[c] * kernel[c];
+            tails[1] += p1[c] * kernel[c];
+            tails[2] += p2[c] * kernel[c];
+            tails[3] += p3[c] * kernel[c];
+          }
+        }
+      }
+      // add up the lanes of each pixel: after the transpose lane i of
+      // every vector belongs to pixel w + i
+      _MM_TRANSPOSE4_PS(sums[0], sums[1], sums[2], sums[3]);
+      sums[0] = _mm_add_ps(_mm_add_ps(sums[0], sums[1]), _mm_add_ps(sums[2], sums[3]));
+      _mm_storeu_ps(&output[h][w], _mm_add_ps(sums[0], _mm_loadu_ps(tails)));
+    }
+    for (; w < width; w++)
+    {
+      float sum = 0.0f;
+      for (x = 0; x < kernel_order; x++)
+      {
+        for (y = 0; y < kernel_order; y++)
+        {
+          const float *kernel = weights + (x * kernel_order + y) * nchannels;
+          const float *pixel = image[w + x][h + y];
+          for (c = 0; c < nchannels; c++)
+          {
+            sum += pixel[c] * kernel[c];
+          }
+        }
+      }
+      output[h][w] = sum;
+    }
+  }
+}
+
+/* the team's convolution of hybrid dense and sparse kernels */
+void team_conv_hybrid(float ***image, struct hybrid_kernels *plan, float ***output,
+                      int width, int height, int nchannels, int nkernels, int kernel_order)
+{
+  int OpenMP_flag = team_conv_use_openmp(width, nchannels, nkernels, kernel_order);
+  long long per_kernel = (long long)kernel_order * kernel_order * nchannels;
+  int m;
+
+#pragma omp parallel for schedule(dynamic) if (OpenMP_flag)
+  for (m = 0; m < nkernels; m++)
+  {
+    if (plan->dense_index[m] >= 0)
+    {
+      conv_dense_kernel(image, plan->dense + plan->dense_index[m] * per_kernel, output[m],
+                        width, height, nchannels, kernel_order);
+    }
+    else
+    {
+      conv_sparse_kernel(image, plan->kernels, output, m, width, height, nchannels, kernel_order);
+    }
+  }
+}
+
+/* dense random kernels with a different density for every output
+   kernel: kernel m keeps one weight in a ratio drawn between 1 and
+   2 * nz_ratio, so some kernels are dense and others very sparse */
+float ****gen_uneven_kernels(int kernel_order, int nkernels, int nchannels, int nz_ratio)
+{
+  float ****kernels = gen_random_4d_matrix(kernel_order, kernel_order, nkernels, nchannels, 1);
+  int x, y, m, c;
+
+  for (m = 0; m < nkernels; m++)
+  {
+    int ratio = 1 + random() % (2 * nz_ratio);
+    for (x = 0; x < kernel_order; x++)
+    {
+      for (y = 0; y < kernel_order; y++)
+      {
+        for (c = 0; c < nchannels; c++)
+        {
+          if (random() % ratio != 0)
+          {
+            kernels[x][y][m][c] = 0.0;
+          }
+        }
+      }
+    }
+  }
+  return kernels;
+}
+
+/* Channel reordering
+
+   The channel numbers of a kernel are wherever its non-zeros fell, so
+   the non-zeros of one kernel at one (x, y) read channels spread along
+   the whole row of the image and touch most of its cache lines. When
+   some channels tend to be used together, numbering them so they share
+   lines shrinks the lines each kernel reads. plan_channel_order counts
+   how often each channel is used and how often each pair of channels
+   is used by the same kernel, then fills one line of channels at a
+   time: it starts with the most used channel not yet placed and adds
+   the one used most often with those already in the line. The kernels
+   are renumbered once; every image must be renumbered to match, which
+   in a network the layer that makes the image could do for free. The
+   harness declares the plan repaid only when the median saving per
+   image, less the renumbering, is wider than the p5 to p95 spread of
+   the timings, so it needs -repeat. */
+
+#define REORDER_LINE 16 // floats in a 64 byte cache line
+
+/* the average number of image cache lines read by one kernel at one (x, y) */
+double kernel_lines_touched(struct sparse_matrix ***kernels, int kernel_order, int nkernels,
+                            int nchannels)
+{
+  int nlines = (nchannels + REORDER_LINE - 1) / REORDER_LINE;
+  int *last = malloc(sizeof(int) * nlines);
+  long long touched = 0;
+  int x, y, m, index, row = 0;
+
+  assert(last != NULL);
+  for (index = 0; index < nlines; index++)
+  {
+    last[index] = -1;
+  }
+  for (x = 0; x < kernel_order; x++)
+  {
+    for (y = 0; y < kernel_order; y++)
+    {
+      struct sparse_matrix *kernel = kernels[x][y];
+      for (m = 0; m < nkernels; m++, row++)
+      {
+        for (index = kernel->kernel_starts[m]; index < kernel->kernel_starts[m + 1]; index++)
+        {
+          int line = kernel->channel_numbers[index] / REORDER_LINE;
+          if (last[line] != row)
+          {
+            last[line] = row;
+            touched++;
+          }
+        }
+      }
+    }
+  }
+  free(last);
+  return (double)touched / row;
+}
+
+/* choose a new order of the channels; order[new] is the old channel number */
+int *plan_channel_order(struct sparse_matrix ***kernels, int kernel_order, int nkernels,
+                        int nchannels)
+{
+  int *order = malloc(sizeof(int) * nchannels);
+  int *uses = calloc(nchannels, sizeof(int));
+  int *together = calloc((long long)nchannels * nchannels, sizeof(int));
+  int *affinity = malloc(sizeof(int) * nchannels);
+  char *placed = calloc(nchannels, 1);
+  int x, y, m, i, j, c, nplaced = 0;
+
+  if (order == NULL || uses == NULL || together == NULL || affinity == NULL || placed == NULL)
+  {
+    fprintf(stderr, "FATAL: cannot allocate the channel co-occurrence counts\n");
+    exit(1);
+  }
+  for (x = 0; x < kernel_order; x++)
+  {
+    for (y = 0; y < kernel_order; y++)
+    {
+      struct sparse_matrix *kernel = kernels[x][y];
+      for (m = 0; m < nkernels; m++)
+      {
+        for (i = kernel->kernel_starts[m]; i < kernel->kernel_starts[m + 1]; i++)
+        {
+          int ci = kernel->channel_numbers[i];
+          uses[ci]++;
+          for (j = i + 1; j < kernel->kernel_starts[m + 1]; j++)
+          {
+            int cj = kernel->channel_numbers[j];
+            together[(long long)ci * nchannels + cj]++;
+            together[(long long)cj * nchannels + ci]++;
+          }
+        }
+      }
+    }
+  }
+
+  while (nplaced < nchannels)
+  {
+    int line_end = (nplaced + REORDER_LINE < nchannels) ? nplaced + REORDER_LINE : nchannels;
+    int best = -1;
+
+    // start the line with the most used channel left
+    for (c = 0; c < nchannels; c++)
+    {
+      affinity[c] = 0;
+      if (!placed[c] && (best < 0 || uses[c] > uses[best]))
+      {
+        best = c;
+      }
+    }
+    while (1)
+    {
+      const int *row = &together[(long long)best * nchannels];
+      order[nplaced++] = best;
+      placed[best] = 1;
+      if (nplaced == line_end)
+      {
+        break;
+      }
+      // then add the channel most often used with the line so far
+      best = -1;
+      for (c = 0; c < nchannels; c++)
+      {
+        affinity[c] += row[c];
+        if (!placed[c] && (best < 0 || affinity[c] > affinity[best] ||
+                           (affinity[c] == affinity[best] && uses[c] > uses[best])))
+        {
+          best = c;
+        }
+      }
+    }
+  }
+
+  free(uses);
+  free(together);
+  free(affinity);
+  free(placed);
+  return order;
+}
+
+/* copy sparse kernels with the channels renumbered to a new order,
+   keeping the channel numbers of each kernel ascending */
+struct sparse_matrix ***reorder_kernels(struct sparse_matrix ***kernels, int kernel_order,
+                                        int nkernels, int nchannels, const int *order)
+{
+  struct sparse_matrix ***result = malloc(sizeof(struct sparse_matrix **) * kernel_order);
+  struct sparse_matrix **temp = malloc(sizeof(struct sparse_matrix *) * kernel_order * kernel_order);
+  int *renumber = malloc(sizeof(int) * nchannels);
+  int x, y, m, c, index;
+
+  assert(result != NULL && temp != NULL && renumber != NULL);
+  for (c = 0; c < nchannels; c++)
+  {
+    renumber[order[c]] = c;
+  }
+  for (x = 0; x < kernel_order; x++)
+  {
+    result[x] = &(temp[x * kernel_order]);
+    for (y = 0; y < kernel_order; y++)
+    {
+      struct sparse_matrix *kernel = kernels[x][y];
+      struct sparse_matrix *reordered = sparse_matrix_new(nkernels, nchannels, kernel->non_zeros);
+
+      for (m = 0; m <= nkernels; m++)
+      {
+        reordered->kernel_starts[m] = kernel->kernel_starts[m];
+      }
+      for (m = 0; m < nkernels; m++)
+      {
+        int first = kernel->kernel_starts[m];
+        for (index = first; index < kernel->kernel_starts[m + 1]; index++)
+        {
+          // insertion sort; a kernel has few non-zeros
+          int channel = renumber[kernel->channel_numbers[index]];
+          float value = kernel->values[index];
+          int place = index;
+          while (place > first && reordered->channel_numbers[place - 1] > channel)
+          {
+            reordered->channel_numbers[place] = reordered->channel_numbers[place - 1];
+            reordered->values[place] = reordered->values[place - 1];
+            place--;
+          }
+          reordered->channel_numbers[place] = channel;
+          reordered->values[place] = value;
+        }
+      }
+      result[x][y] = reordered;
+    }
+  }
+  free(renumber);
+  return result;
+}
+
+/* copy an image with its channels in a new order into result, an image
+   of the same size, so that repeated timings reuse it */
+void reorder_image_into(float ***result, float ***image, int width, int height, int nchannels,
+                        int kernel_order, const int *order)
+{
+  int w, h, c;
+
+#pragma omp parallel for private(h, c) schedule(static)
+  for (w = 0; w < width + kernel_order; w++)
+  {
+    for (h = 0; h < height + kernel_order; h++)
+    {
+      const float *in = image[w][h];
+      float *out = result[w][h];
+      for (c = 0; c < nchannels; c++)
+      {
+        out[c] = in[order[c]];
+      }
+    }
+  }
+}
+
+/* make kernels whose non-zeros cluster in hidden groups of channels:
+   the channels are shuffled, and each kernel draws its non-zeros from
+   a run of the shuffled channels, about half of them non-zero, so the
+   density is the same as that of gen_random_4d_matrix */
+float ****gen_clustered_kernels(int kernel_order, int nkernels, int nchannels, int nz_ratio)
+{
+  float ****kernels = gen_random_4d_matrix(kernel_order, kernel_order, nkernels, nchannels, 1);
+  int *shuffled = malloc(sizeof(int) * nchannels);
+  int per_kernel = (nchannels + nz_ratio - 1) / nz_ratio;
+  int span = ((2 * per_kernel + REORDER_LINE - 1) / REORDER_LINE) * REORDER_LINE;
+  int x, y, m, c;
+
+  assert(shuffled != NULL);
+  if (span > nchannels)
+  {
+    span = nchannels;
+  }
+  for (c = 0; c < nchannels; c++)
+  {
+    shuffled[c] = c;
+  }
+  for (c = nchannels - 1; c > 0; c--)
+  {
+    int other = random() % (c + 1), swap = shuffled[c];
+    shuffled[c] = shuffled[other];
+    shuffled[other] = swap;
+  }
+  for (m = 0; m < nkernels; m++)
+  {
+    int home = ((m * span) % nchannels) / span * span;
+    for (x = 0; x < kernel_order; x++)
+    {
+      for (y = 0; y < kernel_order; y++)
+      {
+        for (c = 0; c < nchannels; c++)
+        {
+          kernels[x][y][m][c] = 0.0;
+        }
+        for (c = home; c < home + span && c < nchannels; c++)
+        {
+          if (random() % span < per_kernel)
+          {
+            kernels[x][y][m][shuffled[c]] = (random() % 1023) + 1;
+          }
+        }
+      }
+    }
+  }
+  free(shuffled);
+  return kernels;
+}
+
+/* Output kernel groups
+
+   Output kernels whose non-zeros fall on the same channels load the
+   same image values. plan_kernel_groups gathers the kernels into
+   groups of four, one to each lane of an SSE register, or of eight for
+   an AVX register, and stores each group at each (x, y) as the union
+   of the channels of its kernels, with a value for each kernel at each
+   channel and zeros where a kernel has no non-zero. The convolution
+   then broadcasts one image value for every non-zero of the union and
+   updates all the kernels of the group with one multiply and add. The
+   zeros in the unions are wasted work, so the planner starts each
+   group with the kernel that has most non-zeros left and adds the
+   kernel whose channels overlap the union so far the most; the harness
+   reports how much the unions grew. Wider groups save more loads but
+   grow more. */
+
+#define KERNEL_GROUP_MAX 8 // kernels in a group, the floats in an AVX register
+
+struct kernel_groups
+{
+  int group_size;            // 4 for SSE, 8 for AVX2
+  int ngroups;
+  int *members;              // [group][group_size] kernel numbers, -1 for padding
+  int *starts;               // [x][y][group + 1] first union non-zero of each group
+  int *channels;             // channel number of each union non-zero
+  float *values;             // [union non-zero][group_size], 0 for no non-zero
+  long long non_zeros;       // of the kernels
+  long long union_non_zeros; // of the unions
+};
+
+/* group the output kernels group_size at a time and build their union
+   patterns */
+struct kernel_groups *plan_kernel_groups(struct sparse_matrix ***kernels, int kernel_order,
+                                         int nkernels, int nchannels, int group_size)
+{
+  struct kernel_groups *groups = malloc(sizeof(struct kernel_groups));
+  int npositions = kernel_order * kernel_order;
+  int ngroups = (nkernels + group_size - 1) / group_size;
+  char *in_union = calloc((long long)npositions * nchannels, 1);
+  float *lanes = calloc((long long)nchannels * group_size, sizeof(float));
+  int *left = malloc(sizeof(int) * nkernels);
+  long long total = 0, nunion = 0;
+  int g, k, m, p, c, index;
+
+  assert(groups != NULL && in_union != NULL && lanes != NULL && left != NULL);
+  assert(group_size == 4 || group_size == KERNEL_GROUP_MAX);
+  groups->group_size = group_size;
+  groups->ngroups = ngroups;
+  groups->members = malloc(sizeof(int) * ngroups * group_size);
+  groups->starts = malloc(sizeof(int) * npositions * (ngroups + 1));
+  assert(groups->members != NULL && groups->starts != NULL);
+
+  // choose the members; left[m] is the non-zeros of kernel m, or -1
+  // once it is in a group
+  for (m = 0; m < nkernels; m++)
+  {
+    left[m] = 0;
+    for (p = 0; p < npositions; p++)
+    {
+      struct sparse_matrix *kernel = kernels[p / kernel_order][p % kernel_order];
+      left[m] += kernel->kernel_starts[m + 1] - kernel->kernel_starts[m];
+    }
+    total += left[m];
+  }
+  for (g = 0; g < ngroups; g++)
+  {
+    int *members = &groups->members[g * group_size];
+    for (k = 0; k < group_size; k++)
+    {
+      int best = -1;
+      long long best_overlap = -1;
+
+      for (m = 0; m < nkernels; m++)
+      {
+        long long overlap = 0;
+        if (left[m] < 0)
+        {
+          continue;
+        }
+        if (k > 0)
+        {
+          for (p = 0; p < npositions; p++)
+          {
+            struct sparse_matrix *kernel = kernels[p / kernel_order][p % kernel_order];
+            const char *mark = &in_union[(long long)p * nchannels];
+            for (index = kernel->kernel_starts[m]; index < kernel->kernel_starts[m + 1]; index++)
+            {
+              overlap += mark[kernel->channel_numbers[index]];
+            }
+          }
+        }
+        if (overlap > best_overlap || (overlap == best_overlap && left[m] > left[best]))
+        {
+          best = m;
+          best_overlap = overlap;
+        }
+      }
+      members[k] = best;
+      if (best < 0)
+      {
+        continue;
+      }
+      left[best] = -1;
+      for (p = 0; p < npositions; p++)
+      {
+        struct sparse_matrix *kernel = kernels[p / kernel_order][p % kernel_order];
+        for (index = kernel->kernel_starts[best]; index < kernel->kernel_starts[best + 1]; index++)
+        {
+          in_union[(long long)p * nchannels + kernel->channel_numbers[index]] = 1;
+        }
+      }
+    }
+    // clear the marks of this group; the union sizes are counted as they go
+    for (p = 0; p < npositions; p++)
+    {
+      char *mark = &in_union[(long long)p * nchannels];
+      for (c = 0; c < nchannels; c++)
+      {
+        nunion += mark[c];
+        mark[c] = 0;
+      }
+    }
+  }
+
+  // build the unions in channel order
+  groups->channels = malloc(sizeof(int) * (nunion + 1));
+  groups->values = malloc(sizeof(float) * group_size * (nunion + 1));
+  assert(groups->channels != NULL && groups->values != NULL);
+  nunion = 0;
+  for (p = 0; p < npositions; p++)
+  {
+    struct sparse_matrix *kernel = kernels[p / kernel_order][p % kernel_order];
+    int *starts = &groups->starts[p * (ngroups + 1)];
+    char *mark = in_union;
+
+    for (g = 0; g < ngroups; g++)
+    {
+      const int *members = &groups->members[g * group_size];
+      starts[g] = nunion;
+      for (k = 0; k < group_size; k++)
+      {
+        if (members[k] < 0)
+        {
+          continue;
+        }
+        for (index = kernel->kernel_starts[members[k]]; index < kernel->kernel_starts[members[k] + 1];
+             index++)
+        {
+          c = kernel->channel_numbers[index];
+          mark[c] = 1;
+          lanes[c * group_size + k] = kernel->values[index];
+        }
+      }
+      for (c = 0; c < nchannels; c++)
+      {
+        if (mark[c])
+        {
+          groups->channels[nunion] = c;
+          for (k = 0; k < group_size; k++)
+          {
+            groups->values[nunion * group_size + k] = lanes[c * group_size + k];
+            lanes[c * group_size + k] = 0.0;
+          }
+          mark[c] = 0;
+          nunion++;
+        }
+      }
+    }
+    starts[ngroups] = nunion;
+  }
+  groups->non_zeros = total;
+  groups->union_non_zeros = nunion;
+
+  free(in_union);
+  free(lanes);
+  free(left);
+  return groups;
+}
+
+void kernel_groups_free(struct kernel_groups *groups)
+{
+  free(groups->members);
+  free(groups->starts);
+  free(groups->channels);
+  free(groups->values);
+  free(groups);
+}
+
+/* store four pixels of the kernels of a group; sums[p] holds pixel
+   w + p of four kernels, the first of them members[0] */
+static inline void kernel_groups_store_4x4(const int *members, __m128 sums[4], float ***output,
+                                           int w, int h)
+{
+  int k;
+
+  // afterwards sums[k] holds the four pixels of kernel k
+  _MM_TRANSPOSE4_PS(sums[0], sums[1], sums[2], sums[3]);
+  for (k = 0; k < 4; k++)
+  {
+    if (members[k] >= 0)
+    {
+      _mm_storeu_ps(&output[members[k]][h][w], sums[k]);
+    }
+  }
+}
+
+/* store one pixel of the kernels of a group, lanes[k] from kernel k */
+static inline void kernel_groups_store_pixel(const struct kernel_groups *groups, const int *members,
+                                             const float *lanes, float ***output, int w, int h)
+{
+  int k;
+
+  for (k = 0; k < groups->group_size; k++)
+  {
+    if (members[k] >= 0)
+    {
+      output[members[k]][h][w] = lanes[k];
+    }
+  }
+}
+
+/* team_conv_kernel_groups for groups of eight, one AVX register of
+   kernels for each of four pixels along w; the halves of the registers
+   are transposed and stored as two groups of four */
+__attribute__((target("avx2"))) void team_conv_kernel_groups_avx2(float ***image,
+                                                                   struct kernel_groups *groups,
+                                                                   float ***output, int width,
+                                                                   int height, int nchannels,
+                                                                   int nkernels, int kernel_order)
+{
+  int OpenMP_flag = team_conv_use_openmp(width, nchannels, nkernels, kernel_order);
+  int g;
+
+#pragma omp parallel for schedule(dynamic) if (OpenMP_flag)
+  for (g = 0; g < groups->ngroups; g++)
+  {
+    const int *members = &groups->members[g * KERNEL_GROUP_MAX];
+    int h, w, x, y, i, p;
+
+    for (h = 0; h < height; h++)
+    {
+      for (w = 0; w + 4 <= width; w += 4)
+      {
+        __m256 sums[4] = {_mm256_setzero_ps(), _mm256_setzero_ps(), _mm256_setzero_ps(),
+                          _mm256_setzero_ps()};
+        __m128 half[4];
+
+        for (x = 0; x < kernel_order; x++)
+        {
+          for (y = 0; y < kernel_order; y++)
+          {
+            const int *starts = &groups->starts[(x * kernel_order + y) * (groups->ngroups + 1)];
+            const float *pixel0 = image[w + x][h + y], *pixel1 = image[w + x + 1][h + y];
+            const float *pixel2 = image[w + x + 2][h + y], *pixel3 = image[w + x + 3][h + y];
+
+            for (i = starts[g]; i < starts[g + 1]; i++)
+            {
+              int c = groups->channels[i];
+              __m256 weights = _mm256_loadu_ps(&groups->values[i * KERNEL_GROUP_MAX]);
+              sums[0] = _mm256_add_ps(sums[0], _mm256_mul_ps(weights, _mm256_set1_ps(pixel0[c])));
+              sums[1] = _mm256_add_ps(sums[1], _mm256_mul_ps(weights, _mm256_set1_ps(pixel1[c])));
+              sums[2] = _mm256_add_ps(sums[2], _mm256_mul_ps(weights, _mm256_set1_ps(pixel2[c])));
+              sums[3] = _mm256_add_ps(sums[3], _mm256_mul_ps(weights, _mm256_set1_ps(pixel3[c])));
+            }
+          }
+        }
+        for (p = 0; p < 4; p++)
+        {
+          half[p] = _mm256_castps256_ps128(sums[p]);
+        }
+        kernel_groups_store_4x4(members, half, output, w, h);
+        for (p = 0; p < 4; p++)
+        {
+          half[p] = _mm256_extractf128_ps(sums[p], 1);
+        }
+        kernel_groups_store_4x4(members + 4, half, output, w, h);
+      }
+      // the pixels left over at the end of the row, one at a time
+      for (; w < width; w++)
+      {
+        __m256 sum = _mm256_setzero_ps();
+        float lanes[KERNEL_GROUP_MAX];
+
+        for (x = 0; x < kernel_order; x++)
+        {
+          for (y = 0; y < kernel_order; y++)
+          {
+            const int *starts = &groups->starts[(x * kernel_order + y) * (groups->ngroups + 1)];
+            const float *pixel = image[w + x][h + y];
+            for (i = starts[g]; i < starts[g + 1]; i++)
+            {
+              __m256 weights = _mm256_loadu_ps(&groups->values[i * KERNEL_GROUP_MAX]);
+              __m256 value = _mm256_set1_ps(pixel[groups->channels[i]]);
+              sum = _mm256_add_ps(sum, _mm256_mul_ps(weights, value));
+            }
+          }
+        }
+        _mm256_storeu_ps(lanes, sum);
+        kernel_groups_store_pixel(groups, members, lanes, output, w, h);
+      }
+    }
+  }
+}
+
+/* the same as team_conv_sparse, using kernel groups: four pixels along
+   w at a time, each with a register holding the four kernels of the
+   group, transposed at the end to store four pixels of each kernel.
+   Groups of eight need a CPU with AVX2 */
+void team_conv_kernel_groups(float ***image, struct kernel_groups *groups, float ***output,
+                             int width, int height, int nchannels, int nkernels, int kernel_order)
+{
+  int OpenMP_flag = team_conv_use_openmp(width, nchannels, nkernels, kernel_order);
+  int g;
+
+  if (groups->group_size == KERNEL_GROUP_MAX)
+  {
+    team_conv_kernel_groups_avx2(image, groups, output, width, height, nchannels, nkernels,
+                                 kernel_order);
+    return;
+  }
+
+#pragma omp parallel for schedule(dynamic) if (OpenMP_flag)
+  for (g = 0; g < groups->ngroups; g++)
+  {
+    const int *members = &groups->members[g * 4];
+    int h, w, x, y, i;
+
+    for (h = 0; h < height; h++)
+    {
+      for (w = 0; w + 4 <= width; w += 4)
+      {
+        __m128 sums[4] = {_mm_setzero_ps(), _mm_setzero_ps(), _mm_setzero_ps(), _mm_setzero_ps()};
+
+        for (x = 0; x < kernel_order; x++)
+        {
+          for (y = 0; y < kernel_order; y++)
+          {
+            const int *starts = &groups->starts[(x * kernel_order + y) * (groups->ngroups + 1)];
+            const float *pixel0 = image[w + x][h + y], *pixel1 = image[w + x + 1][h + y];
+            const float *pixel2 = image[w + x + 2][h + y], *pixel3 = image[w + x + 3][h + y];
+
+            for (i = starts[g]; i < starts[g + 1]; i++)
+            {
+              int c = groups->channels[i];
+              __m128 weights = _mm_loadu_ps(&groups->values[i * 4]);
+              sums[0] = _mm_add_ps(sums[0], _mm_mul_ps(weights, _mm_set1_ps(pixel0[c])));
+              sums[1] = _mm_add_ps(sums[1], _mm_mul_ps(weights, _mm_set1_ps(pixel1[c])));
+              sums[2] = _mm_add_ps(sums[2], _mm_mul_ps(weights, _mm_set1_ps(pixel2[c])));
+              sums[3] = _mm_add_ps(sums[3], _mm_mul_ps(weights, _mm_set1_ps(pixel3[c])));
+            }
+          }
+        }
+        kernel_groups_store_4x4(members, sums, output, w, h);
+      }
+      // the pixels left over at the end of the row, one at a time
+      for (; w < width; w++)
+      {
+        __m128 sum = _mm_setzero_ps();
+        float lanes[4];
+
+        for (x = 0; x < kernel_order; x++)
+        {
+          for (y = 0; y < kernel_order; y++)
+          {
+            const int *starts = &groups->starts[(x * kernel_order + y) * (groups->ngroups + 1)];
+            const float *pixel = image[w + x][h + y];
+            for (i = starts[g]; i < starts[g + 1]; i++)
+            {
+              __m128 weights = _mm_loadu_ps(&groups->values[i * 4]);
+              sum = _mm_add_ps(sum, _mm_mul_ps(weights, _mm_set1_ps(pixel[groups->channels[i]])));
+            }
+          }
+        }
+        _mm_storeu_ps(lanes, sum);
+        kernel_groups_store_pixel(groups, members, lanes, output, w, h);
+      }
+    }
+  }
+}
+
+/* Half precision storage
+
+   At low sparsity the kernel values and the float image are most of the
+   bytes that the convolution loads. In this mode both are stored as
+   IEEE half precision, converted to single precision in registers with
+   the F16C instructions, and accumulated in single precision as in
+   team_conv_sparse. The F16C code is compiled with a target attribute,
+   so the harness itself still builds with just -msse4. */
+
+/* convert a float array to half precision; the conversion rounds to
+   nearest, which is exact for the integers the generator produces */
+__attribute__((target("f16c"))) void floats_to_f16(uint16_t *dest, const float *src, long long n)
+{
+  long long i;
+
+  for (i = 0; i + 4 <= n; i += 4)
+  {
+    __m128i half = _mm_cvtps_ph(_mm_loadu_ps(&src[i]), _MM_FROUND_TO_NEAREST_INT);
+    _mm_storel_epi64((__m128i *)&dest[i], half);
+  }
+  for (; i < n; i++)
+  {
+    dest[i] = _cvtss_sh(src[i], _MM_FROUND_TO_NEAREST_INT);
+  }
+}
+
+/* add half precision copies of the values to every sparse kernel */
+void kernels_make_f16(struct sparse_matrix ***kernels, int kernel_order)
+{
+  int x, y;
+
+  for (x = 0; x < kernel_order; x++)
+  {
+    for (y = 0; y < kernel_order; y++)
+    {
+      struct sparse_matrix *kernel = kernels[x][y];
+      if (kernel->values_f16 == NULL)
+      {
+        kernel->values_f16 = malloc(sizeof(uint16_t) * (kernel->non_zeros + 1));
+        floats_to_f16(kernel->values_f16, kernel->values, kernel->non_zeros);
+      }
+    }
+  }
+}
+
+/* return a half precision copy of a contiguous 3d image, in the same
+   [w][h][c] layout */
+uint16_t *image_to_f16(float ***image, int dim0, int dim1, int dim2)
+{
+  long long n = (long long)dim0 * dim1 * dim2;
+  uint16_t *result = malloc(sizeof(uint16_t) * n);
+
+  assert(result != NULL);
+  floats_to_f16(result, &(image[0][0][0]), n);
+  return result;
+}
+
+/* The generator makes small integers, which half precision holds
+   exactly, so -fp16 also runs on inputs scaled by FP16_ERROR_SCALE.
+   One third has no finite binary expansion, so the scaled values round
+   when they are stored in half precision, and the report shows the
+   real loss of the format */
+#define FP16_ERROR_SCALE (1.0f / 3.0f)
+
+/* copy a contiguous 3d matrix with every value multiplied by scale */
+float ***scaled_3d_matrix(float ***a, int dim0, int dim1, int dim2, float scale)
+{
+  float ***result = new_empty_3d_matrix(dim0, dim1, dim2);
+  const float *in = &(a[0][0][0]);
+  float *out = &(result[0][0][0]);
+  long long n = (long long)dim0 * dim1 * dim2;
+  long long i;
+
+  for (i = 0; i < n; i++)
+  {
+    out[i] = in[i] * scale;
+  }
+  return result;
+}
+
+/* copy sparse kernels with every value multiplied by scale */
+struct sparse_matrix ***scaled_sparse_kernels(struct sparse_matrix ***kernels, int kernel_order,
+                                              int nkernels, int nchannels, float scale)
+{
+  struct sparse_matrix ***result = malloc(sizeof(struct sparse_matrix **) * kernel_order);
+  struct sparse_matrix **temp = malloc(sizeof(struct sparse_matrix *) * kernel_order * kernel_order);
+  int x, y, m, index;
+
+  assert(result != NULL && temp != NULL);
+  for (x = 0; x < kernel_order; x++)
+  {
+    result[x] = &(temp[x * kernel_order]);
+    for (y = 0; y < kernel_order; y++)
+    {
+      struct sparse_matrix *kernel = kernels[x][y];
+      struct sparse_matrix *scaled = sparse_matrix_new(nkernels, nchannels, kernel->non_zeros);
+
+      for (m = 0; m <= nkernels; m++)
+      {
+        scaled->kernel_starts[m] = kernel->kernel_starts[m];
+      }
+      for (index = 0; index < kernel->non_zeros; index++)
+      {
+        scaled->channel_numbers[index] = kernel->channel_numbers[index];
+        scaled->values[index] = kernel->values[index] * scale;
+      }
+      result[x][y] = scaled;
+    }
+  }
+  return result;
+}
+
+/* sparse convolution on a half precision image and half precision
+   kernel values; the image is (width + kernel_order) x (height +
+   kernel_order) x nchannels, as in team_conv_sparse */
+__attribute__((target("f16c"))) void team_conv_sparse_f16(const uint16_t *image, struct sparse_matrix ***kernels,
+                                                          float ***output, int width, int height,
+                                                          int nchannels, int nkernels, int kernel_order)
+{
+  int h, w, x, y, m, index;
+  int OpenMP_flag = team_conv_use_openmp(width, nchannels, nkernels, kernel_order);
+  // distances in the image between neighbouring pixels along h and along w
+  const long long row = nchannels;
+  const long long column = (long long)(height + kernel_order) * nchannels;
+  const int main_width = width - width % 4;
+  const int main_height = height - height % 4;
+
+  // every output value is stored once, so no separate zeroing pass is needed
+#pragma omp parallel for if (OpenMP_flag) private(w, h, x, y, index)
+  for (m = 0; m < nkernels; m++)
+  {
+    // the 4x4 tiles, as in team_conv_sparse
+    for (w = 0; w < main_width; w += 4)
+    {
+      for (h = 0; h < main_height; h += 4)
+      {
+        __m128 sum1 = _mm_setzero_ps();
+        __m128 sum2 = _mm_setzero_ps();
+        __m128 sum3 = _mm_setzero_ps();
+        __m128 sum4 = _mm_setzero_ps();
+        float sum[4];
+        int i;
+
+        for (x = 0; x < kernel_order; x++)
+        {
+          for (y = 0; y < kernel_order; y++)
+          {
+            struct sparse_matrix *kernel = kernels[x][y];
+            const uint16_t *base = image + (w + x) * column + (h + y) * row;
+            for (index = kernel->kernel_starts[m]; index < kernel->kernel_starts[m + 1]; index++)
+            {
+              const uint16_t *p = base + kernel->channel_numbers[index];
+              __m128 value = _mm_set1_ps(_cvtsh_ss(kernel->values_f16[index]));
+
+              // four pixels along h for each of four columns along w,
+              // widened to single precision in registers
+              __m128 value1 = _mm_cvtph_ps(_mm_setr_epi16(p[0], p[row], p[2 * row], p[3 * row], 0, 0, 0, 0));
+              p += column;
+              __m128 value2 = _mm_cvtph_ps(_mm_setr_epi16(p[0], p[row], p[2 * row], p[3 * row], 0, 0, 0, 0));
+              p += column;
+              __m128 value3 = _mm_cvtph_ps(_mm_setr_epi16(p[0], p[row], p[2 * row], p[3 * row], 0, 0, 0, 0));
+              p += column;
+              __m128 value4 = _mm_cvtph_ps(_mm_setr_epi16(p[0], p[row], p[2 * row], p[3 * row], 0, 0, 0, 0));
+
+              sum1 = _mm_add_ps(sum1, _mm_mul_ps(value1, value));
+              sum2 = _mm_add_ps(sum2, _mm_mul_ps(value2, value));
+              sum3 = _mm_add_ps(sum3, _mm_mul_ps(value3, value));
+              sum4 = _mm_add_ps(sum4, _mm_mul_ps(value4, value));
+            }
+          } // y
+        }   // x
+
+        _mm_storeu_ps(sum, sum1);
+        for (i = 0; i < 4; i++)
+        {
+          output[m][h + i][w] = sum[i];
+        }
+        _mm_storeu_ps(sum, sum2);
+        for (i = 0; i < 4; i++)
+        {
+          output[m][h + i][w + 1] = sum[i];
+        }
+        _mm_storeu_ps(sum, sum3);
+        for (i = 0; i < 4; i++)
+        {
+          output[m][h + i][w + 2] = sum[i];
+        }
+        _mm_storeu_ps(sum, sum4);
+        for (i = 0; i < 4; i++)
+        {
+          output[m][h + i][w + 3] = sum[i];
+        }
+      } // h
+    }   // w
+
+    // the pixels on the right and bottom edges outside the tiles
+    for (w = 0; w < width; w++)
+    {
+      for (h = (w < main_width) ? main_height : 0; h < height; h++)
+      {
+        float sum = 0.0;
+        for (x = 0; x < kernel_order; x++)
+        {
+          for (y = 0; y < kernel_order; y++)
+          {
+            struct sparse_matrix *kernel = kernels[x][y];
+            const uint16_t *base = image + (w + x) * column + (h + y) * row;
+            for (index = kernel->kernel_starts[m]; index < kernel->kernel_starts[m + 1]; index++)
+            {
+              sum += _cvtsh_ss(base[kernel->channel_numbers[index]]) * _cvtsh_ss(kernel->values_f16[index]);
+            }
+          }
+        }
+        output[m][h][w] = sum;
+      }
+    }
+  } // m
+}
+
+/* Quantized int8 convolution
+
+   For inference the kernels and the image can be quantized. Each
+   output kernel m gets its own scale, so that its largest weight maps
+   to 127, and the image gets one scale that maps its largest value to
+   127. The activations are kept to 7 bits so that the AVX2 pmaddubsw
+   instruction (unsigned x signed bytes, adding pairs into 16 bits)
+   can never saturate: 2 * 127 * 127 < 32767. pmaddwd then adds the
+   pairs into 32 bit accumulators, so each step consumes four non-zeros
+   for eight output pixels. The epilogue requantizes the int32 sums to
+   float with the product of the image and kernel scales.
+
+   The non-zeros of each kernel are stored in groups of four (padded
+   with zero weights), with the four int8 weights packed in one int32
+   so they can be broadcast with a single instruction. The image is
+   stored as [h][c][w] bytes, so that eight neighbouring pixels along
+   w of one channel are eight contiguous bytes, and four channels are
+   interleaved into pixel-major order with two rounds of unpacks. */
+
+// the int8 form of the sparse matrix of one kernel position
+struct sparse_matrix_q8
+{
+  int *group_starts;  // first group of each kernel, nkernels + 1 entries
+  int32_t *weights;   // four int8 weights per group
+  uint16_t *channels; // four channel numbers per group
+};
+
+// int8 kernels of every kernel position with their scales
+struct quantized_kernels
+{
+  int kernel_order;
+  int nkernels;
+  int nchannels;
+  struct sparse_matrix_q8 *positions; // kernel_order * kernel_order, x major
+  float *scales;                      // scale of each output kernel
+};
+
+// an image quantized to 7 bit unsigned values in [h][c][w] layout
+struct quantized_image
+{
+  uint8_t *data;
+  int row_length; // bytes between channels, at least width + order + 8
+  int nchannels;
+  float scale;
+};
+
+/* quantize sparse kernels with a scale for each output kernel */
+struct quantized_kernels *quantize_kernels(struct sparse_matrix ***kernels, int kernel_order,
+                                           int nkernels, int nchannels)
+{
+  struct quantized_kernels *result = malloc(sizeof(struct quantized_kernels));
+  int x, y, m, index;
+
+  result->kernel_order = kernel_order;
+  result->nkernels = nkernels;
+  result->nchannels = nchannels;
+  result->positions = malloc(sizeof(struct sparse_matrix_q8) * kernel_order * kernel_order);
+  result->scales = malloc(sizeof(float) * nkernels);
+
+  // the scale of each kernel comes from its largest weight at any position
+  for (m = 0; m < nkernels; m++)
+  {
+    float max_abs = 0.0;
+    for (x = 0; x < kernel_order; x++)
+    {
+      for (y = 0; y < kernel_order; y++)
+      {
+        struct sparse_matrix *kernel = kernels[x][y];
+        for (index = kernel->kernel_starts[m]; index < kernel->kernel_starts[m + 1]; index++)
+        {
+          if (fabsf(kernel->values[index]) > max_abs)
+          {
+            max_abs = fabsf(kernel->values[index]);
+          }
+        }
+      }
+    }
+    result->scales[m] = (max_abs > 0.0) ? max_abs / 127.0 : 1.0;
+  }
+
+  for (x = 0; x < kernel_order; x++)
+  {
+    for (y = 0; y < kernel_order; y++)
+    {
+      struct sparse_matrix *kernel = kernels[x][y];
+      struct sparse_matrix_q8 *q = &result->positions[x * kernel_order + y];
+      int ngroups = 0;
+
+      q->group_starts = malloc(sizeof(int) * (nkernels + 1));
+      for (m = 0; m < nkernels; m++)
+      {
+        q->group_starts[m] = ngroups;
+        ngroups += (kernel->kernel_starts[m + 1] - kernel->kernel_starts[m] + 3) / 4;
+      }
+      q->group_starts[nkernels] = ngroups;
+      q->weights = malloc(sizeof(int32_t) * (ngroups + 1));
+      q->channels = malloc(sizeof(uint16_t) * 4 * (ngroups + 1));
+
+      for (m = 0; m < nkernels; m++)
+      {
+        int g = q->group_starts[m] * 4;
+        int end = q->group_starts[m + 1] * 4;
+        int8_t *bytes = (int8_t *)q->weights;
+
+        for (index = kernel->kernel_starts[m]; index < kernel->kernel_starts[m + 1]; index++, g++)
+        {
+          long quantized = lrintf(kernel->values[index] / result->scales[m]);
+          bytes[g] = (int8_t)((quantized > 127) ? 127 : (quantized < -127) ? -127 : quantized);
+          q->channels[g] = kernel->channel_numbers[index];
+        }
+        // pad the last group with zero weights on channel 0
+        for (; g < end; g++)
+        {
+          bytes[g] = 0;
+          q->channels[g] = 0;
+        }
+      }
+    }
+  }
+  return result;
+}
+
+/* quantize a (width + order) x (height + order) x nchannels image;
+   this is done once for each image, so its time is reported apart */
+void quantize_image(float ***image, int dim0, int dim1, int nchannels,
+                    struct quantized_image *result)
+{
+  float max_value = 0.0;
+  int i, j, c;
+
+  for (i = 0; i < dim0; i++)
+  {
+    for (j = 0; j < dim1; j++)
+    {
+      for (c = 0; c < nchannels; c++)
+      {
+        if (image[i][j][c] > max_value)
+        {
+          max_value = image[i][j][c];
+        }
+      }
+    }
+  }
+
+  // 8 extra bytes so that an 8 byte load at the last pixel stays in the row
+  result->row_length = ((dim0 + 7) & ~7) + 8;
+  result->nchannels = nchannels;
+  result->scale = (max_value > 0.0) ? max_value / 127.0 : 1.0;
+  result->data = calloc((size_t)dim1 * nchannels * result->row_length, 1);
+  assert(result->data != NULL);
+
+  for (j = 0; j < dim1; j++)
+  {
+    for (c = 0; c < nchannels; c++)
+    {
+      uint8_t *row = result->data + ((size_t)j * nchannels + c) * result->row_length;
+      for (i = 0; i < dim0; i++)
+      {
+        // activations are non-negative here; negative values clamp to zero
+        long quantized = lrintf(image[i][j][c] / result->scale);
+        row[i] = (uint8_t)((quantized > 127) ? 127 : (quantized < 0) ? 0 : quantized);
+      }
+    }
+  }
+}
+
+/* int32 sum of one output pixel of the quantized convolution */
+int32_t conv_pixel_q8(const struct quantized_image *image, const struct quantized_kernels *kernels,
+                      int m, int w, int h)
+{
+  int kernel_order = kernels->kernel_order;
+  int32_t sum = 0;
+  int x, y, g, i;
+
+  for (x = 0; x < kernel_order; x++)
+  {
+    for (y = 0; y < kernel_order; y++)
+    {
+      const struct sparse_matrix_q8 *q = &kernels->positions[x * kernel_order + y];
+      const uint8_t *rows = image->data + (size_t)(h + y) * image->nchannels * image->row_length + w + x;
+      const int8_t *bytes = (const int8_t *)q->weights;
+      for (g = q->group_starts[m] * 4; g < q->group_starts[m + 1] * 4; g += 4)
+      {
+        for (i = 0; i < 4; i++)
+        {
+          sum += rows[(size_t)q->channels[g + i] * image->row_length] * bytes[g + i];
+        }
+      }
+    }
+  }
+  return sum;
+}
+
+/* quantized convolution of eight output pixels along w */
+__attribute__((target("avx2"))) static inline __m256i conv_tile_q8_avx2(const struct quantized_image *image,
+                                                                         const struct quantized_kernels *kernels,
+                                                                         int m, int w, int h)
+{
+  const __m256i ones = _mm256_set1_epi16(1);
+  const size_t row_length = image->row_length;
+  int kernel_order = kernels->kernel_order;
+  __m256i acc = _mm256_setzero_si256();
+  int x, y, g;
+
+  for (x = 0; x < kernel_order; x++)
+  {
+    for (y = 0; y < kernel_order; y++)
+    {
+      const struct sparse_matrix_q8 *q = &kernels->positions[x * kernel_order + y];
+      const uint8_t *rows = image->data + (size_t)(h + y) * image->nchannels * row_length + w + x;
+      for (g = q->group_starts[m]; g < q->group_starts[m + 1]; g++)
+      {
+        const uint16_t *c = &q->channels[4 * g];
+        __m128i a0 = _mm_loadl_epi64((const __m128i *)(rows + c[0] * row_length));
+        __m128i a1 = _mm_loadl_epi64((const __m128i *)(rows + c[1] * row_length));
+        __m128i a2 = _mm_loadl_epi64((const __m128i *)(rows + c[2] * row_length));
+        __m128i a3 = _mm_loadl_epi64((const __m128i *)(rows + c[3] * row_length));
+        // interleave to four channel bytes for each of the eight pixels
+        __m128i a01 = _mm_unpacklo_epi8(a0, a1);
+        __m128i a23 = _mm_unpacklo_epi8(a2, a3);
+        __m256i activations = _mm256_set_m128i(_mm_unpackhi_epi16(a01, a23),
+                                               _mm_unpacklo_epi16(a01, a23));
+        __m256i weights = _mm256_set1_epi32(q->weights[g]);
+        __m256i pairs = _mm256_maddubs_epi16(activations, weights);
+        acc = _mm256_add_epi32(acc, _mm256_madd_epi16(pairs, ones));
+      }
+    }
+  }
+  return acc;
+}
+
+/* quantized sparse convolution with AVX2 for whole tiles of eight pixels */
+__attribute__((target("avx2"))) void team_conv_sparse_q8_avx2(const struct quantized_image *image,
+                                                               const struct quantized_kernels *kernels,
+                                                               float ***output, int width, int height)
+{
+  int nkernels = kernels->nkernels;
+  int OpenMP_flag = team_conv_use_openmp(width, kernels->nchannels, nkernels, kernels->kernel_order);
+  const int main_width = width - width % 8;
+  int m, h, w;
+
+#pragma omp parallel for if (OpenMP_flag) private(h, w)
+  for (m = 0; m < nkernels; m++)
+  {
+    // requantization scale of this kernel
+    float scale = image->scale * kernels->scales[m];
+    __m256 scales = _mm256_set1_ps(scale);
+    for (h = 0; h < height; h++)
+    {
+      for (w = 0; w < main_width; w += 8)
+      {
+        __m256i acc = conv_tile_q8_avx2(image, kernels, m, w, h);
+        _mm256_storeu_ps(&output[m][h][w], _mm256_mul_ps(_mm256_cvtepi32_ps(acc), scales));
+      }
+      for (; w < width; w++)
+      {
+        output[m][h][w] = conv_pixel_q8(image, kernels, m, w, h) * scale;
+      }
+    }
+  }
+}
+
+/* quantized sparse convolution; uses AVX2 when the CPU has it */
+void team_conv_sparse_q8(const struct quantized_image *image, const struct quantized_kernels *kernels,
+                         float ***output, int width, int height)
+{
+  int m, h, w;
+
+  if (__builtin_cpu_supports("avx2"))
+  {
+    team_conv_sparse_q8_avx2(image, kernels, output, width, height);
+    return;
+  }
+
+#pragma omp parallel for private(h, w)
+  for (m = 0; m < kernels->nkernels; m++)
+  {
+    float scale = image->scale * kernels->scales[m];
+    for (h = 0; h < height; h++)
+    {
+      for (w = 0; w < width; w++)
+      {
+        output[m][h][w] = conv_pixel_q8(image, kernels, m, w, h) * scale;
+      }
+    }
+  }
+}
+
+/* Codebook (weight clustered) kernels
+
+   Pruned models are often also clustered so that only 16 or 256
+   distinct weights remain. In this form all kernel positions share one
+   codebook, and each non-zero keeps only a 4 or 8 bit code in place of
+   its float value. The codebook form has its own copy of the kernel
+   starts and channel numbers and no float values, so the sparse
+   kernels it was made from are not needed to run it. With 4 bit codes,
+   eight codes at a time are expanded into 32 bit lanes with variable
+   shifts and looked up in the 16 entry codebook held in two AVX2
+   registers with vpermps; each lane of the result is then broadcast
+   with another vpermps straight into the tile products, so the values
+   never leave the registers. 256 entries do not fit in registers, so 8
+   bit codes are looked up in the (L1 resident) codebook table. */
+
+#define CODEBOOK_MAX 256
+
+// clustered values of the sparse kernels of every kernel position
+struct codebook_kernels
+{
+  int kernel_order;
+  int nkernels;
+  int bits;                    // 4 or 8
+  float codebook[CODEBOOK_MAX];
+  int **kernel_starts;         // for each position (x major), as in struct sparse_matrix
+  int **channel_numbers;       // for each position, as in struct sparse_matrix
+  uint8_t **codes;             // for each position, packed codes in place of the values
+};
+
+/* compare floats for qsort */
+int compare_floats(const void *a, const void *b)
+{
+  float fa = *(const float *)a, fb = *(const float *)b;
+
+  return (fa > fb) - (fa < fb);
+}
+
+/* index of the codebook entry nearest to a value; the codebook is sorted */
+int codebook_nearest(const float *codebook, int ncodes, float value)
+{
+  int low = 0, high = ncodes - 1;
+
+  while (high - low > 1)
+  {
+    int middle = (low + high) / 2;
+    if (codebook[middle] <= value)
+    {
+      low = middle;
+    }
+    else
+    {
+      high = middle;
+    }
+  }
+  return (fabsf(value - codebook[low]) <= fabsf(value - codebook[high])) ? low : high;
+}
+
+/* cluster the values of the sparse kernels into 2^bits codes with one
+   dimensional k-means, started from evenly spaced quantiles, and build
+   the codebook form of the kernels */
+struct codebook_kernels *cluster_kernels(struct sparse_matrix ***kernels, int kernel_order,
+                                         int nkernels, int bits)
+{
+  struct codebook_kernels *result = malloc(sizeof(struct codebook_kernels));
+  int ncodes = 1 << bits;
+  long long non_zeros = 0, n, i;
+  float *sorted;
+  double sums[CODEBOOK_MAX];
+  long long counts[CODEBOOK_MAX];
+  int x, y, iteration, k;
+
+  result->kernel_order = kernel_order;
+  result->nkernels = nkernels;
+  result->bits = bits;
+  result->kernel_starts = malloc(sizeof(int *) * kernel_order * kernel_order);
+  result->channel_numbers = malloc(sizeof(int *) * kernel_order * kernel_order);
+  result->codes = malloc(sizeof(uint8_t *) * kernel_order * kernel_order);
+
+  for (x = 0; x < kernel_order; x++)
+  {
+    for (y = 0; y < kernel_order; y++)
+    {
+      non_zeros += kernels[x][y]->non_zeros;
+    }
+  }
+  sorted = malloc(sizeof(float) * (non_zeros + 1));
+  n = 0;
+  for (x = 0; x < kernel_order; x++)
+  {
+    for (y = 0; y < kernel_order; y++)
+    {
+      memcpy(&sorted[n], kernels[x][y]->values, sizeof(float) * kernels[x][y]->non_zeros);
+      n += kernels[x][y]->non_zeros;
+    }
+  }
+  qsort(sorted, non_zeros, sizeof(float), compare_floats);
+
+  for (k = 0; k < ncodes; k++)
+  {
+    result->codebook[k] = (non_zeros > 0) ? sorted[(non_zeros * (2 * k + 1)) / (2 * ncodes)] : 0.0;
+  }
+
+  // Lloyd iterations; with sorted values and a sorted codebook every
+  // cluster is a contiguous run, so nearest stays a binary search
+  for (iteration = 0; iteration < 20 && non_zeros > 0; iteration++)
+  {
+    for (k = 0; k < ncodes; k++)
+    {
+      sums[k] = 0.0;
+      counts[k] = 0;
+    }
+    for (i = 0; i < non_zeros; i++)
+    {
+      k = codebook_nearest(result->codebook, ncodes, sorted[i]);
+      sums[k] += sorted[i];
+      counts[k]++;
+    }
+    for (k = 0; k < ncodes; k++)
+    {
+      if (counts[k] > 0)
+      {
+        result->codebook[k] = sums[k] / counts[k];
+      }
+    }
+    qsort(result->codebook, ncodes, sizeof(float), compare_floats);
+  }
+  free(sorted);
+
+  // now replace every value by its code
+  for (x = 0; x < kernel_order; x++)
+  {
+    for (y = 0; y < kernel_order; y++)
+    {
+      struct sparse_matrix *kernel = kernels[x][y];
+      int p = x * kernel_order + y;
+      // 8 spare bytes so that the decoder can always load 64 bits
+      uint8_t *codes = calloc(((long long)kernel->non_zeros * bits + 7) / 8 + 8, 1);
+
+      result->kernel_starts[p] = malloc(sizeof(int) * (nkernels + 1));
+      result->channel_numbers[p] = malloc(sizeof(int) * (kernel->non_zeros + 1));
+      memcpy(result->kernel_starts[p], kernel->kernel_starts, sizeof(int) * (nkernels + 1));
+      memcpy(result->channel_numbers[p], kernel->channel_numbers, sizeof(int) * kernel->non_zeros);
+      for (i = 0; i < kernel->non_zeros; i++)
+      {
+        int code = codebook_nearest(result->codebook, ncodes, kernel->values[i]);
+        if (bits == 4)
+        {
+          codes[i >> 1] |= code << ((i & 1) * 4);
+        }
+        else
+        {
+          codes[i] = code;
+        }
+      }
+      result->codes[p] = codes;
+    }
+  }
+  return result;
+}
+
+void codebook_kernels_free(struct codebook_kernels *codebook)
+{
+  int p;
+
+  for (p = 0; p < codebook->kernel_order * codebook->kernel_order; p++)
+  {
+    free(codebook->kernel_starts[p]);
+    free(codebook->channel_numbers[p]);
+    free(codebook->codes[p]);
+  }
+  free(codebook->kernel_starts);
+  free(codebook->channel_numbers);
+  free(codebook->codes);
+  free(codebook);
+}
+
+/* print the bytes per non-zero of the kernels with float values and
+   in the codebook form, counting the values or codes, the channel
+   numbers, the starts and the codebook */
+void report_codebook_bytes(const struct codebook_kernels *codebook)
+{
+  long long non_zeros = 0;
+  long long starts_bytes = (long long)codebook->kernel_order * codebook->kernel_order *
+                           (codebook->nkernels + 1) * sizeof(int);
+  long long codes_bytes = 0;
+  int p;
+
+  for (p = 0; p < codebook->kernel_order * codebook->kernel_order; p++)
+  {
+    long long n = codebook->kernel_starts[p][codebook->nkernels];
+    non_zeros += n;
+    codes_bytes += (n * codebook->bits + 7) / 8;
+  }
+  if (non_zeros == 0)
+  {
+    return;
+  }
+
+  printf("Kernel bytes per non-zero: float %.2f, codebook %.2f\n",
+         (non_zeros * (sizeof(float) + sizeof(int)) + starts_bytes) / (double)non_zeros,
+         (non_zeros * sizeof(int) + codes_bytes + starts_bytes +
+          (1 << codebook->bits) * sizeof(float)) / (double)non_zeros);
+}
+
+/* dequantize eight 4 bit codes starting at code number index */
+__attribute__((target("avx2"))) static inline __m256 codebook_decode8_avx2(const uint8_t *codes, int index,
+                                                                            __m256 low_entries, __m256 high_entries)
+{
+  uint64_t packed;
+  __m256i lanes;
+
+  memcpy(&packed, &codes[index >> 1], sizeof(packed));
+  packed >>= (index & 1) * 4;
+  // one code in the low four bits of each 32 bit lane
+  lanes = _mm256_srlv_epi32(_mm256_set1_epi32((uint32_t)packed),
+                            _mm256_setr_epi32(0, 4, 8, 12, 16, 20, 24, 28));
+  lanes = _mm256_and_si256(lanes, _mm256_set1_epi32(15));
+  // vpermps uses the low three bits; bit 3 picks the high half
+  return _mm256_blendv_ps(_mm256_permutevar8x32_ps(low_entries, lanes),
+                          _mm256_permutevar8x32_ps(high_entries, lanes),
+                          _mm256_castsi256_ps(_mm256_slli_epi32(lanes, 28)));
+}
+
+/* sparse convolution of the codebook form of the kernels; the
+   structure follows team_conv_sparse */
+__attribute__((target("avx2"))) void team_conv_sparse_codebook(float ***image,
+                                                                const struct codebook_kernels *codebook,
+                                                                float ***output, int width, int height,
+                                                                int nchannels, int nkernels, int kernel_order)
+{
+  int h, w, x, y, m, index;
+  int OpenMP_flag = team_conv_use_openmp(width, nchannels, nkernels, kernel_order);
+  const int main_width = width - width % 4;
+  const int main_height = height - height % 4;
+  const __m256 low_entries = _mm256_loadu_ps(&codebook->codebook[0]);
+  const __m256 high_entries = _mm256_loadu_ps(&codebook->codebook[8]);
+  struct conv_dest dest = {output, NULL, 0};
+
+#pragma omp parallel for if (OpenMP_flag) private(w, h, x, y, index)
+  for (m = 0; m < nkernels; m++)
+  {
+    for (w = 0; w < main_width; w += 4)
+    {
+      for (h = 0; h < main_height; h += 4)
+      {
+        __m128 sums[4];
+
+        sums[0] = _mm_setzero_ps();
+        sums[1] = _mm_setzero_ps();
+        sums[2] = _mm_setzero_ps();
+        sums[3] = _mm_setzero_ps();
+        for (x = 0; x < kernel_order; x++)
+        {
+          for (y = 0; y < kernel_order; y++)
+          {
+            int p = x * kernel_order + y;
+            const int *channels = codebook->channel_numbers[p];
+            const uint8_t *codes = codebook->codes[p];
+            int end = codebook->kernel_starts[p][m + 1];
+
+            index = codebook->kernel_starts[p][m];
+            if (codebook->bits == 4)
+            {
+              // eight values at a time are dequantized in registers, and
+              // each is broadcast from its lane into the products
+              for (; index + 8 <= end; index += 8)
+              {
+                __m256 values = codebook_decode8_avx2(codes, index, low_entries, high_entries);
+                int i;
+                for (i = 0; i < 8; i++)
+                {
+                  __m256 value = _mm256_permutevar8x32_ps(values, _mm256_set1_epi32(i));
+                  tile_4x4_accumulate_ps(image, w + x, h + y, channels[index + i],
+                                         _mm256_castps256_ps128(value), sums);
+                }
+              }
+              for (; index < end; index++)
+              {
+                int code = (codes[index >> 1] >> ((index & 1) * 4)) & 15;
+                tile_4x4_accumulate(image, w + x, h + y, channels[index],
+                                    codebook->codebook[code], sums);
+              }
+            }
+            else
+            {
+              for (; index < end; index++)
+              {
+                tile_4x4_accumulate(image, w + x, h + y, channels[index],
+                                    codebook->codebook[codes[index]], sums);
+              }
+            }
+          } // y
+        }   // x
+        conv_dest_store_4x4(&dest, m, w, h, sums);
+      } // h
+    }   // w
+
+    // the pixels on the right and bottom edges outside the tiles
+    for (w = 0; w < width; w++)
+    {
+      for (h = (w < main_width) ? main_height : 0; h < height; h++)
+      {
+        float sum = 0.0;
+        for (x = 0; x < kernel_order; x++)
+        {
+          for (y = 0; y < kernel_order; y++)
+          {
+            int p = x * kernel_order + y;
+            const uint8_t *codes = codebook->codes[p];
+            for (index = codebook->kernel_starts[p][m]; index < codebook->kernel_starts[p][m + 1]; index++)
+            {
+              int code = (codebook->bits == 4) ? (codes[index >> 1] >> ((index & 1) * 4)) & 15 : codes[index];
+              sum += image[w + x][h + y][codebook->channel_numbers[p][index]] * codebook->codebook[code];
+            }
+          }
+        }
+        *conv_dest_at(&dest, m, w, h) = sum;
+      }
+    }
+  } // m
+}
+
+/* report how far a result is from a reference result */
+void report_difference(const char *name, float ***result, float ***reference,
+                       int dim0, int dim1, int dim2)
+{
+  const float *a = &(result[0][0][0]);
+  const float *b = &(reference[0][0][0]);
+  long long n = (long long)dim0 * dim1 * dim2;
+  double sum_abs_diff = 0.0, sum_abs_reference = 0.0;
+  double max_abs_diff = 0.0;
+  long long i;
+
+  for (i = 0; i < n; i++)
+  {
+    double diff = fabs((double)a[i] - b[i]);
+    sum_abs_diff += diff;
+    sum_abs_reference += fabs(b[i]);
+    if (diff > max_abs_diff)
+    {
+      max_abs_diff = diff;
+    }
+  }
+  printf("COMMENT: %s error: sum of absolute differences %f, max absolute difference %f, relative error %g\n",
+         name, sum_abs_diff, max_abs_diff,
+         sum_abs_reference > 0.0 ? sum_abs_diff / sum_abs_reference : 0.0);
+}
+
+/* Timing statistics */
+
+// summary of repeated timings, in seconds
+struct timing_stats
+{
+  int count;
+  double min;
+  double max;
+  double mean;
+  double stddev;
+  double median;
+  double p5;
+  double p95;
+};
+
+/* monotonic time in seconds */
+double now_seconds(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/* compare doubles for qsort */
+int compare_doubles(const void *a, const void *b)
+{
+  double da = *(const double *)a, db = *(const double *)b;
+
+  return (da > db) - (da < db);
+}
+
+/* value at fraction q of sorted samples, interpolating between neighbours */
+double sorted_quantile(const double *sorted, int n, double q)
+{
+  double position = q * (n - 1);
+  int below = (int)position;
+
+  if (below + 1 >= n)
+  {
+    return sorted[n - 1];
+  }
+  return sorted[below] + (position - below) * (sorted[below + 1] - sorted[below]);
+}
+
+/* summarise n timings; the samples are sorted in place */
+void compute_timing_stats(double *samples, int n, struct timing_stats *stats)
+{
+  double sum = 0.0, sum_squares = 0.0;
+  int i;
+
+  assert(n > 0);
+  qsort(samples, n, sizeof(double), compare_doubles);
+  for (i = 0; i < n; i++)
+  {
+    sum += samples[i];
+  }
+  stats->count = n;
+  stats->mean = sum / n;
+  for (i = 0; i < n; i++)
+  {
+    sum_squares += (samples[i] - stats->mean) * (samples[i] - stats->mean);
+  }
+  stats->stddev = (n > 1) ? sqrt(sum_squares / (n - 1)) : 0.0;
+  stats->min = samples[0];
+  stats->max = samples[n - 1];
+  stats->median = sorted_quantile(samples, n, 0.5);
+  stats->p5 = sorted_quantile(samples, n, 0.05);
+  stats->p95 = sorted_quantile(samples, n, 0.95);
+}
+
+/* Repeated timing in the harness
+
+   With -repeat the team convolution, and every variant that a mode
+   also times, is run -warmup untimed times and then -repeat timed
+   times, and the whole distribution is printed. The
+   timer is clock_gettime by default, or the time stamp counter with
+   -timer tsc, whose rate is calibrated against clock_gettime. -flush
+   writes and reads a buffer larger than the caches before every run,
+   to measure cold cache rather than warm cache performance. */
+
+enum harness_timer
+{
+  TIMER_CLOCK = 0,
+  TIMER_TSC = 1
+};
+
+/* time stamp counter ticks per second, measured over about 50 ms */
+double tsc_ticks_per_second(void)
+{
+  double start = now_seconds(), stop;
+  uint64_t ticks = __rdtsc();
+
+  do
+  {
+    stop = now_seconds();
+  } while (stop - start < 0.05);
+  return (__rdtsc() - ticks) / (stop - start);
+}
+
+/* read the chosen timer, in its own units */
+static inline uint64_t read_timer(int timer)
+{
+  unsigned int aux;
+
+  if (timer == TIMER_TSC)
+  {
+    // rdtscp waits for the earlier instructions to finish
+    return __rdtscp(&aux);
+  }
+  return (uint64_t)(now_seconds() * 1e9);
+}
+
+/* evict the caches by writing and then reading a large buffer */
+void flush_caches(volatile char *buffer, size_t bytes)
+{
+  size_t i;
+
+  // the buffer is volatile, so neither loop can be optimised away
+  for (i = 0; i < bytes; i += 64)
+  {
+    buffer[i] = (char)i;
+  }
+  for (i = 0; i < bytes; i += 64)
+  {
+    (void)buffer[i];
+  }
+}
+
+/* print the distribution of repeated timings in microseconds */
+void print_timing_stats(const char *name, const struct timing_stats *stats)
+{
+  printf("%s stats over %d runs (microseconds): min %.1f, p5 %.1f, median %.1f, mean %.1f, p95 %.1f, max %.1f, stddev %.1f\n",
+         name, stats->count, stats->min * 1e6, stats->p5 * 1e6, stats->median * 1e6,
+         stats->mean * 1e6, stats->p95 * 1e6, stats->max * 1e6, stats->stddev * 1e6);
+}
+
+// the -repeat, -warmup, -timer and -flush settings, shared by the team
+// convolution and every other call the harness times
+struct harness_timing
+{
+  int repeats;
+  int warmups;
+  int timer;
+  double ticks_per_second;
+  char *flush_buffer; // NULL for no flush
+  size_t flush_bytes;
+  double *samples;    // one for each timed run
+};
+
+/* set up the timing of repeated runs; exits if the flush buffer cannot
+   be allocated, so a run never times without the flush it asked for */
+void harness_timing_init(struct harness_timing *timing, int repeats, int warmups, int timer,
+                         size_t flush_bytes)
+{
+  timing->repeats = repeats;
+  timing->warmups = warmups;
+  timing->timer = timer;
+  timing->ticks_per_second = (timer == TIMER_TSC) ? tsc_ticks_per_second() : 1e9;
+  timing->flush_bytes = flush_bytes;
+  timing->flush_buffer = (flush_bytes > 0) ? malloc(flush_bytes) : NULL;
+  timing->samples = malloc(sizeof(double) * repeats);
+  assert(timing->samples != NULL);
+  if (flush_bytes > 0 && timing->flush_buffer == NULL)
+  {
+    fprintf(stderr, "FATAL: cannot allocate a %zu MB cache flush buffer\n", flush_bytes >> 20);
+    exit(1);
+  }
+}
+
+/* flush the caches before a run, if -flush asked for it */
+static inline void harness_timing_flush(const struct harness_timing *timing)
+{
+  if (timing->flush_buffer != NULL)
+  {
+    flush_caches(timing->flush_buffer, timing->flush_bytes);
+  }
+}
+
+/* keep the time of run number run, started at start, unless it was a
+   warmup run */
+static inline void harness_timing_record(struct harness_timing *timing, int run, uint64_t start)
+{
+  uint64_t stop = read_timer(timing->timer);
+
+  if (run >= timing->warmups)
+  {
+    timing->samples[run - timing->warmups] = (stop - start) / timing->ticks_per_second;
+  }
+}
+
+/* run the statements given after stats -warmup untimed and -repeat timed
+   times, each after a cache flush with -flush, and summarise the timed
+   runs in stats. The statements are macro arguments so that any call
+   can be timed; each run must leave things as the next run expects */
+#define HARNESS_TIME(timing, stats, ...)                                 \
+  do                                                                     \
+  {                                                                      \
+    int run_;                                                            \
+    for (run_ = 0; run_ < (timing)->warmups + (timing)->repeats; run_++) \
+    {                                                                    \
+      uint64_t start_;                                                   \
+      harness_timing_flush(timing);                                      \
+      start_ = read_timer((timing)->timer);                              \
+      __VA_ARGS__;                                                       \
+      harness_timing_record((timing), run_, start_);                     \
+    }                                                                    \
+    compute_timing_stats((timing)->samples, (timing)->repeats, (stats)); \
+  } while (0)
+
+/* the median of repeated timings in whole microseconds */
+long long median_microseconds(const struct timing_stats *stats)
+{
+  return (long long)(stats->median * 1e6 + 0.5);
+}
+
+/* print "<name>: <median> microseconds" as a single run was always
+   reported, and the whole distribution when the runs were repeated */
+void report_timing(const char *name, const struct timing_stats *stats)
+{
+  printf("%s: %lld microseconds\n", name, median_microseconds(stats));
+  if (stats->count > 1)
+  {
+    print_timing_stats(name, stats);
+  }
+}
+
+/* microseconds since a time from now_seconds, for work that is done
+   once, such as planning, and so timed once */
+long long microseconds_since(double start)
+{
+  return (long long)((now_seconds() - start) * 1e6 + 0.5);
+}
+
+/* Roofline model
+
+   With -roofline the harness measures the sustainable memory bandwidth
+   of the machine with a STREAM style triad and the peak floating point
+   rate with a register-only loop of AVX fused multiply-adds, or of SSE
+   multiplies and adds on a CPU without FMA, both on all OpenMP
+   threads. The same loop with the SSE multiplies and adds that
+   team_conv_sparse uses is reported as the ceiling of that code, which
+   is well below the machine's peak on an FMA machine. It then
+   places the run on the roofline: the arithmetic intensity is the
+   flops the non-zeros actually need over the bytes the chosen layout
+   and index format must move at least once, and the attainable rate is
+   the lower of the peak and intensity times bandwidth. */
+
+#define STREAM_ELEMENTS (1 << 23) // 64 MB per array, well beyond the caches
+
+// the two roofs of this machine
+struct machine_roofs
+{
+  double bytes_per_second;
+  double flops_per_second;      // the machine's peak
+  double code_flops_per_second; // SSE multiplies and adds, as in team_conv_sparse
+};
+
+/* best bandwidth of the STREAM triad a = b + s * c over a few runs */
+double measure_stream_bandwidth(void)
+{
+  double *a = malloc(sizeof(double) * STREAM_ELEMENTS);
+  double *b = malloc(sizeof(double) * STREAM_ELEMENTS);
+  double *c = malloc(sizeof(double) * STREAM_ELEMENTS);
+  double best = 0.0;
+  const double scalar = 3.0;
+  long i;
+  int run;
+
+  assert(a != NULL && b != NULL && c != NULL);
+  // first touch in parallel so pages are spread like the triad uses them
+#pragma omp parallel for
+  for (i = 0; i < STREAM_ELEMENTS; i++)
+  {
+    a[i] = 0.0;
+    b[i] = 1.0;
+    c[i] = 2.0;
+  }
+
+  for (run = 0; run < 5; run++)
+  {
+    double start = now_seconds(), seconds;
+#pragma omp parallel for
+    for (i = 0; i < STREAM_ELEMENTS; i++)
+    {
+      a[i] = b[i] + scalar * c[i];
+    }
+    seconds = now_seconds() - start;
+    // STREAM counts two reads and one write per element
+    if (3.0 * sizeof(double) * STREAM_ELEMENTS / seconds > best)
+    {
+      best = 3.0 * sizeof(double) * STREAM_ELEMENTS / seconds;
+    }
+  }
+  if (a[STREAM_ELEMENTS / 2] != 7.0)
+  {
+    fprintf(stderr, "WARNING: STREAM triad gave a wrong result\n");
+  }
+  free(a);
+  free(b);
+  free(c);
+  return best;
+}
+
+/* peak rate of SSE multiplies and adds; eight independent chains per
+   thread cover the latency of the floating point units */
+double measure_sse_flops(void)
+{
+  const long iterations = 1 << 22;
+  double start = now_seconds(), seconds;
+  int nthreads = 1;
+  float check = 0.0;
+
+#pragma omp parallel reduction(+ : check)
+  {
+    __m128 acc[8];
+    __m128 multiplier = _mm_set1_ps(0.999999f);
+    __m128 addend = _mm_set1_ps(1e-7f);
+    float lanes[4];
+    long i;
+    int j;
+
+#pragma omp single
+    nthreads = omp_get_num_threads();
+
+    for (j = 0; j < 8; j++)
+    {
+      acc[j] = _mm_set1_ps(1.0f + j);
+    }
+    for (i = 0; i < iterations; i++)
+    {
+      for (j = 0; j < 8; j++)
+      {
+        acc[j] = _mm_add_ps(_mm_mul_ps(acc[j], multiplier), addend);
+      }
+    }
+    for (j = 1; j < 8; j++)
+    {
+      acc[0] = _mm_add_ps(acc[0], acc[j]);
+    }
+    _mm_storeu_ps(lanes, acc[0]);
+    check += lanes[0];
+  }
+  seconds = now_seconds() - start;
+  if (!(check > 0.0))
+  {
+    fprintf(stderr, "WARNING: peak flops loop gave a wrong result\n");
+  }
+  // a multiply and an add on four lanes for each chain and iteration
+  return 8.0 * 8.0 * iterations * nthreads / seconds;
+}
+
+/* peak rate of AVX fused multiply-adds; two FMA units with a latency of
+   four cycles need at least eight independent chains per thread, and
+   ten leave some slack */
+__attribute__((target("avx2,fma"))) double measure_fma_flops(void)
+{
+  const long iterations = 1 << 22;
+  double start = now_seconds(), seconds;
+  int nthreads = 1;
+  float check = 0.0;
+
+#pragma omp parallel reduction(+ : check)
+  {
+    __m256 acc[10];
+    __m256 multiplier = _mm256_set1_ps(0.999999f);
+    __m256 addend = _mm256_set1_ps(1e-7f);
+    float lanes[8];
+    long i;
+    int j;
+
+#pragma omp single
+    nthreads = omp_get_num_threads();
+
+    for (j = 0; j < 10; j++)
+    {
+      acc[j] = _mm256_set1_ps(1.0f + j);
+    }
+    for (i = 0; i < iterations; i++)
+    {
+      for (j = 0; j < 10; j++)
+      {
+        acc[j] = _mm256_fmadd_ps(acc[j], multiplier, addend);
+      }
+    }
+    for (j = 1; j < 10; j++)
+    {
+      acc[0] = _mm256_add_ps(acc[0], acc[j]);
+    }
+    _mm256_storeu_ps(lanes, acc[0]);
+    check += lanes[0];
+  }
+  seconds = now_seconds() - start;
+  if (!(check > 0.0))
+  {
+    fprintf(stderr, "WARNING: peak flops loop gave a wrong result\n");
+  }
+  // a multiply and an add on eight lanes for each chain and iteration
+  return 2.0 * 8.0 * 10.0 * iterations * nthreads / seconds;
+}
+
+/* measure both roofs of the machine, and the ceiling of the SSE code */
+void measure_machine_roofs(struct machine_roofs *roofs)
+{
+  roofs->bytes_per_second = measure_stream_bandwidth();
+  roofs->code_flops_per_second = measure_sse_flops();
+  if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma"))
+  {
+    roofs->flops_per_second = measure_fma_flops();
+  }
+  else
+  {
+    roofs->flops_per_second = roofs->code_flops_per_second;
+  }
+}
+
+/* flops of a sparse convolution: a multiply and an add for every
+   non-zero at every output pixel */
+double conv_flops(struct sparse_matrix ***kernels, int kernel_order, int width, int height)
+{
+  long long non_zeros = 0;
+  int x, y;
+
+  for (x = 0; x < kernel_order; x++)
+  {
+    for (y = 0; y < kernel_order; y++)
+    {
+      non_zeros += kernels[x][y]->non_zeros;
+    }
+  }
+  return 2.0 * non_zeros * width * height;
+}
+
+/* bytes that a sparse convolution moves at least once: the image, the
+   kernel values and the channel numbers in the form team_conv_sparse
+   reads them, the kernel starts, and the output, which team_conv_sparse
+   writes twice (zeroing, then the results) */
+double conv_traffic_bytes(struct sparse_matrix ***kernels, int kernel_order, int width,
+                          int height, int nchannels, int nkernels)
+{
+  double bytes = (double)(width + kernel_order) * (height + kernel_order) * nchannels * sizeof(float);
+  int x, y;
+
+  for (x = 0; x < kernel_order; x++)
+  {
+    for (y = 0; y < kernel_order; y++)
+    {
+      struct sparse_matrix *kernel = kernels[x][y];
+      bytes += (double)kernel->non_zeros * sizeof(float) + (nkernels + 1) * sizeof(int);
+      if (kernel->index_encoding == INDEX_UINT16)
+      {
+        bytes += (double)kernel->non_zeros * sizeof(uint16_t);
+      }
+      else if (kernel->index_encoding == INDEX_DELTA8)
+      {
+        bytes += kernel->delta_starts[nkernels] + (nkernels + 1) * sizeof(int);
+      }
+      else
+      {
+        bytes += (double)kernel->non_zeros * sizeof(int);
+      }
+    }
+  }
+  return bytes + 2.0 * nkernels * width * height * sizeof(float);
+}
+
+/* rate the roofline allows at a given arithmetic intensity */
+double roofline_attainable(const struct machine_roofs *roofs, double intensity)
+{
+  double memory_roof = intensity * roofs->bytes_per_second;
+
+  return (memory_roof < roofs->flops_per_second) ? memory_roof : roofs->flops_per_second;
+}
+
+/* print where a run of seconds sits on the roofline */
+void report_roofline(const struct machine_roofs *roofs, double flops, double bytes, double seconds)
+{
+  double intensity = flops / bytes;
+  double ridge = roofs->flops_per_second / roofs->bytes_per_second;
+  double attainable = roofline_attainable(roofs, intensity);
+  double achieved = flops / seconds;
+
+  printf("Roofline: machine %.2f GB/s, %.2f GFLOP/s, ridge point %.2f flop/byte\n",
+         roofs->bytes_per_second * 1e-9, roofs->flops_per_second * 1e-9, ridge);
+  printf("Roofline: team_conv_sparse code ceiling %.2f GFLOP/s\n",
+         roofs->code_flops_per_second * 1e-9);
+  printf("Roofline: run intensity %.2f flop/byte, achieved %.2f GFLOP/s (%.2f GB/s), "
+         "attainable %.2f GFLOP/s, %.1f%% of attainable, %s bound\n",
+         intensity, achieved * 1e-9, bytes / seconds * 1e-9, attainable * 1e-9,
+         100.0 * achieved / attainable, (intensity < ridge) ? "memory" : "compute");
+}
+
+/* Benchmark sweep
+
+   conv-harness -sweep <results.csv | results.json> runs team_conv_sparse
+   over every combination of the lists of widths, kernel orders, channel
+   and kernel counts and nz ratios in one process. The defaults are the
+   whole spec'd range, which takes a long time and a lot of memory, so
+   the lists can be narrowed on the command line. The image, the output
+   and the arrays of the sparse kernels are allocated once for the
+   largest configuration and reused, and the sparse kernels are
+   generated directly rather than through a dense 4d matrix. */
+
+#define SWEEP_MAX_VALUES 32
+
+// the lists of parameter values to sweep over
+struct sweep_options
+{
+  const char *out_path;
+  int widths[SWEEP_MAX_VALUES], nwidths;
+  int orders[SWEEP_MAX_VALUES], norders;
+  int channels[SWEEP_MAX_VALUES], nchannels;
+  int kernels[SWEEP_MAX_VALUES], nkernels;
+  int nz_ratios[SWEEP_MAX_VALUES], nnz_ratios;
+  int repeats;
+  int warmups;
+  int roofline;
+};
+
+/* parse a comma separated list of positive integers */
+int parse_int_list(const char *text, int *values, int max_values)
+{
+  int n = 0;
+  char *end;
+
+  while (*text != '\0')
+  {
+    long value = strtol(text, &end, 10);
+    if (end == text || value < 1 || n == max_values)
+    {
+      fprintf(stderr, "FATAL: bad list of values %s\n", text);
+      exit(1);
+    }
+    values[n++] = value;
+    text = (*end == ',') ? end + 1 : end;
+  }
+  return n;
+}
+
+/* largest value of a list */
+int max_of_list(const int *values, int n)
+{
+  int i, result = values[0];
+
+  for (i = 1; i < n; i++)
+  {
+    if (values[i] > result)
+    {
+      result = values[i];
+    }
+  }
+  return result;
+}
+
+/* fill sparse kernels with random values drawn like gen_random_4d_matrix,
+   growing their arrays when needed; capacity holds the current size of
+   the arrays of each kernel position */
+void fill_random_sparse_kernels(struct sparse_matrix ***kernels, long long *capacity,
+                                int kernel_order, int nkernels, int nchannels, int nz_ratio)
+{
+  const int range = 1 << 10;
+  int x, y, m, c;
+
+  for (x = 0; x < kernel_order; x++)
+  {
+    for (y = 0; y < kernel_order; y++)
+    {
+      struct sparse_matrix *kernel = kernels[x][y];
+      long long *size = &capacity[x * kernel_order + y];
+      int nvalues = 0;
+
+      kernel->nkernels = nkernels;
+      kernel->nchannels = nchannels;
+      for (m = 0; m < nkernels; m++)
+      {
+        kernel->kernel_starts[m] = nvalues;
+        for (c = 0; c < nchannels; c++)
+        {
+          long long rand = random();
+          if ((rand % nz_ratio) == 0)
+          {
+            int reduced_range = (rand % range);
+            while (reduced_range == 0)
+            {
+              reduced_range = random() % range;
+            }
+            if (nvalues == *size)
+            {
+              *size = 2 * *size + 1024;
+              kernel->values = realloc(kernel->values, sizeof(float) * *size);
+              kernel->channel_numbers = realloc(kernel->channel_numbers, sizeof(int) * *size);
+              assert(kernel->values != NULL && kernel->channel_numbers != NULL);
+            }
+            kernel->values[nvalues] = reduced_range;
+            kernel->channel_numbers[nvalues] = c;
+            nvalues++;
+          }
+        }
+      }
+      kernel->kernel_starts[nkernels] = nvalues;
+      kernel->non_zeros = nvalues;
+    }
+  }
+}
+
+/* print the usage of the sweep mode and exit */
+void sweep_usage_exit(void)
+{
+  fprintf(stderr, "Usage: conv-harness -sweep <results.csv|results.json> [sweep options]\n");
+  fprintf(stderr, "  -widths <list>    image widths (= heights), default 16,32,64,128,256,512\n");
+  fprintf(stderr, "  -orders <list>    kernel orders, default 1,3,5,7\n");
+  fprintf(stderr, "  -channels <list>  channel counts, default 32,64,...,2048\n");
+  fprintf(stderr, "  -kernels <list>   kernel counts, default 32,64,...,2048\n");
+  fprintf(stderr, "  -nz <list>        nz ratios, default 20,50,100,400,800,1000\n");
+  fprintf(stderr, "  -repeat <n>       timed runs of each configuration, default 5\n");
+  fprintf(stderr, "  -warmup <n>       untimed runs before them, default 1\n");
+  fprintf(stderr, "  -seed <n>         seed for the random inputs\n");
+  fprintf(stderr, "  -roofline         add the intensity and the roofline bound to every record\n");
+  fprintf(stderr, "Lists are comma separated, for example -widths 64,128.\n");
+  exit(1);
+}
+
+/* parse the arguments of the sweep mode */
+void parse_sweep_options(int argc, char **argv, struct sweep_options *opts)
+{
+  const int default_widths[] = {16, 32, 64, 128, 256, 512};
+  const int default_orders[] = {1, 3, 5, 7};
+  const int default_counts[] = {32, 64, 128, 256, 512, 1024, 2048};
+  const int default_nz_ratios[] = {20, 50, 100, 400, 800, 1000};
+  int i;
+
+  if (argc < 3)
+  {
+    sweep_usage_exit();
+  }
+  opts->out_path = argv[2];
+  opts->nwidths = 6;
+  memcpy(opts->widths, default_widths, sizeof(default_widths));
+  opts->norders = 4;
+  memcpy(opts->orders, default_orders, sizeof(default_orders));
+  opts->nchannels = 7;
+  memcpy(opts->channels, default_counts, sizeof(default_counts));
+  opts->nkernels = 7;
+  memcpy(opts->kernels, default_counts, sizeof(default_counts));
+  opts->nnz_ratios = 6;
+  memcpy(opts->nz_ratios, default_nz_ratios, sizeof(default_nz_ratios));
+  opts->repeats = 5;
+  opts->warmups = 1;
+  opts->roofline = 0;
+
+  for (i = 3; i < argc; i++)
+  {
+    if (strcmp(argv[i], "-roofline") == 0)
+    {
+      opts->roofline = 1;
+      continue;
+    }
+    if (i + 1 >= argc)
+    {
+      sweep_usage_exit();
+    }
+    if (strcmp(argv[i], "-widths") == 0)
+    {
+      opts->nwidths = parse_int_list(argv[++i], opts->widths, SWEEP_MAX_VALUES);
+    }
+    else if (strcmp(argv[i], "-orders") == 0)
+    {
+      opts->norders = parse_int_list(argv[++i], opts->orders, SWEEP_MAX_VALUES);
+    }
+    else if (strcmp(argv[i], "-channels") == 0)
+    {
+      opts->nchannels = parse_int_list(argv[++i], opts->channels, SWEEP_MAX_VALUES);
+    }
+    else if (strcmp(argv[i], "-kernels") == 0)
+    {
+      opts->nkernels = parse_int_list(argv[++i], opts->kernels, SWEEP_MAX_VALUES);
+    }
+    else if (strcmp(argv[i], "-nz") == 0)
+    {
+      opts->nnz_ratios = parse_int_list(argv[++i], opts->nz_ratios, SWEEP_MAX_VALUES);
+    }
+    else if (strcmp(argv[i], "-repeat") == 0)
+    {
+      opts->repeats = atoi(argv[++i]);
+    }
+    else if (strcmp(argv[i], "-warmup") == 0)
+    {
+      opts->warmups = atoi(argv[++i]);
+    }
+    else if (strcmp(argv[i], "-seed") == 0)
+    {
+      random_seed = atoll(argv[++i]);
+    }
+    else
+    {
+      fprintf(stderr, "FATAL: unknown sweep option %s\n", argv[i]);
+      sweep_usage_exit();
+    }
+  }
+
+  for (i = 0; i < opts->norders; i++)
+  {
+    if (opts->orders[i] != 1 && opts->orders[i] != 3 && opts->orders[i] != 5 && opts->orders[i] != 7)
+    {
+      fprintf(stderr, "FATAL: kernel_order must be 1, 3, 5 or 7, not %d\n", opts->orders[i]);
+      exit(1);
+    }
+  }
+  for (i = 0; i < opts->nnz_ratios; i++)
+  {
+    if (opts->nz_ratios[i] < 2)
+    {
+      fprintf(stderr, "FATAL: the sweep times sparse kernels, so nz ratios must be at least 2\n");
+      exit(1);
+    }
+  }
+  if (opts->repeats < 1 || opts->warmups < 0)
+  {
+    fprintf(stderr, "FATAL: need at least one timed run and no negative warmups\n");
+    exit(1);
+  }
+}
+
+/* run the benchmark sweep and write one record per configuration */
+int run_sweep(int argc, char **argv)
+{
+  struct sweep_options opts;
+  int max_width, max_order, max_channels, max_kernels;
+  float *image_data, *output_data;
+  struct sparse_matrix ***kernels;
+  struct sparse_matrix **temp;
+  long long *capacity;
+  double *samples;
+  int json, first = 1;
+  int iw, io, ic, ik, inz, i, x, y;
+  struct machine_roofs roofs = {0.0, 0.0, 0.0};
+  FILE *out;
+
+  parse_sweep_options(argc, argv, &opts);
+  if (opts.roofline)
+  {
+    measure_machine_roofs(&roofs);
+    printf("Machine roofs: %.2f GB/s, %.2f GFLOP/s; team_conv_sparse code ceiling %.2f GFLOP/s\n",
+           roofs.bytes_per_second * 1e-9, roofs.flops_per_second * 1e-9,
+           roofs.code_flops_per_second * 1e-9);
+  }
+  if (random_seed >= 0)
+  {
+    srandom_seed(random_seed);
+  }
+  else
+  {
+    srandom(time(NULL));
+  }
+
+  max_width = max_of_list(opts.widths, opts.nwidths);
+  max_order = max_of_list(opts.orders, opts.norders);
+  max_channels = max_of_list(opts.channels, opts.nchannels);
+  max_kernels = max_of_list(opts.kernels, opts.nkernels);
+
+  // buffers for the largest configuration, reused by all of them
+  image_data = malloc(sizeof(float) * (size_t)(max_width + max_order) * (max_width + max_order) * max_channels);
+  output_data = malloc(sizeof(float) * (size_t)max_kernels * max_width * max_width);
+  if (image_data == NULL || output_data == NULL)
+  {
+    fprintf(stderr, "FATAL: cannot allocate the buffers for the largest configuration\n");
+    exit(1);
+  }
+  kernels = malloc(sizeof(struct sparse_matrix **) * max_order);
+  temp = malloc(sizeof(struct sparse_matrix *) * max_order * max_order);
+  capacity = calloc(max_order * max_order, sizeof(long long));
+  for (x = 0; x < max_order * max_order; x++)
+  {
+    temp[x] = sparse_matrix_new(max_kernels, max_channels, 0);
+    temp[x]->kernel_starts = realloc(temp[x]->kernel_starts, sizeof(int) * (max_kernels + 1));
+  }
+  samples = malloc(sizeof(double) * opts.repeats);
+
+  out = fopen(opts.out_path, "w");
+  if (out == NULL)
+  {
+    fprintf(stderr, "FATAL: cannot create %s\n", opts.out_path);
+    exit(1);
+  }
+  json = strlen(opts.out_path) >= 5 && strcmp(opts.out_path + strlen(opts.out_path) - 5, ".json") == 0;
+  if (json)
+  {
+    fprintf(out, "[\n");
+  }
+  else
+  {
+    fprintf(out, "width,height,kernel_order,nchannels,nkernels,nz_ratio,non_zeros,repeats,"
+                 "median_us,p5_us,p95_us,min_us,mean_us,gflops,gbytes_per_s%s\n",
+            opts.roofline ? ",flop_per_byte,attainable_gflops,fraction_of_attainable" : "");
+  }
+
+  for (io = 0; io < opts.norders; io++)
+  {
+    int kernel_order = opts.orders[io];
+    for (x = 0; x < kernel_order; x++)
+    {
+      kernels[x] = &(temp[x * kernel_order]);
+    }
+    for (ic = 0; ic < opts.nchannels; ic++)
+    {
+      int nchannels = opts.channels[ic];
+      for (ik = 0; ik < opts.nkernels; ik++)
+      {
+        int nkernels = opts.kernels[ik];
+        for (inz = 0; inz < opts.nnz_ratios; inz++)
+        {
+          int nz_ratio = opts.nz_ratios[inz];
+          long long non_zeros = 0;
+
+          fill_random_sparse_kernels(kernels, capacity, kernel_order, nkernels, nchannels, nz_ratio);
+          for (x = 0; x < kernel_order; x++)
+          {
+            for (y = 0; y < kernel_order; y++)
+            {
+              non_zeros += kernels[x][y]->non_zeros;
+            }
+          }
+
+          for (iw = 0; iw < opts.nwidths; iw++)
+          {
+            int width = opts.widths[iw], height = width;
+            long long image_floats = (long long)(width + kernel_order) * (height + kernel_order) * nchannels;
+            float ***image, ***output;
+            struct timing_stats stats;
+            double flops, bytes;
+            long long j;
+
+            for (j = 0; j < image_floats; j++)
+            {
+              image_data[j] = (random() % 1023) + 1;
+            }
+            image = view_3d_matrix(image_data, width + kernel_order, height + kernel_order, nchannels);
+            output = view_3d_matrix(output_data, nkernels, width, height);
+
+            for (i = 0; i < opts.warmups; i++)
+            {
+              team_conv_sparse(image, kernels, output, width, height, nchannels, nkernels, kernel_order);
+            }
+            for (i = 0; i < opts.repeats; i++)
+            {
+              double start = now_seconds();
+              team_conv_sparse(image, kernels, output, width, height, nchannels, nkernels, kernel_order);
+              samples[i] = now_seconds() - start;
+            }
+            compute_timing_stats(samples, opts.repeats, &stats);
+
+            flops = conv_flops(kernels, kernel_order, width, height);
+            bytes = conv_traffic_bytes(kernels, kernel_order, width, height, nchannels, nkernels);
+
+            if (json)
+            {
+              fprintf(out, "%s  {\"width\": %d, \"height\": %d, \"kernel_order\": %d, \"nchannels\": %d, "
+                           "\"nkernels\": %d, \"nz_ratio\": %d, \"non_zeros\": %lld, \"repeats\": %d, "
+                           "\"median_us\": %.3f, \"p5_us\": %.3f, \"p95_us\": %.3f, \"min_us\": %.3f, "
+                           "\"mean_us\": %.3f, \"gflops\": %.4f, \"gbytes_per_s\": %.4f",
+                      first ? "" : ",\n", width, height, kernel_order, nchannels, nkernels, nz_ratio,
+                      non_zeros, opts.repeats, stats.median * 1e6, stats.p5 * 1e6, stats.p95 * 1e6,
+                      stats.min * 1e6, stats.mean * 1e6, flops / stats.median * 1e-9,
+                      bytes / stats.median * 1e-9);
+              if (opts.roofline)
+              {
+                fprintf(out, ", \"flop_per_byte\": %.4f, \"attainable_gflops\": %.4f, "
+                             "\"fraction_of_attainable\": %.4f",
+                        flops / bytes, roofline_attainable(&roofs, flops / bytes) * 1e-9,
+                        flops / stats.median / roofline_attainable(&roofs, flops / bytes));
+              }
+              fprintf(out, "}");
+            }
+            else
+            {
+              fprintf(out, "%d,%d,%d,%d,%d,%d,%lld,%d,%.3f,%.3f,%.3f,%.3f,%.3f,%.4f,%.4f",
+                      width, height, kernel_order, nchannels, nkernels, nz_ratio, non_zeros,
+                      opts.repeats, stats.median * 1e6, stats.p5 * 1e6, stats.p95 * 1e6,
+                      stats.min * 1e6, stats.mean * 1e6, flops / stats.median * 1e-9,
+                      bytes / stats.median * 1e-9);
+              if (opts.roofline)
+              {
+                fprintf(out, ",%.4f,%.4f,%.4f", flops / bytes,
+                        roofline_attainable(&roofs, flops / bytes) * 1e-9,
+                        flops / stats.median / roofline_attainable(&roofs, flops / bytes));
+              }
+              fprintf(out, "\n");
+            }
+            fflush(out);
+            first = 0;
+            printf("%d %d %d %d %d %d: median %.1f us\n", width, height, kernel_order,
+                   nchannels, nkernels, nz_ratio, stats.median * 1e6);
+
+            free(image[0]);
+            free(image);
+            free(output[0]);
+            free(output);
+          } // width
+        }   // nz_ratio
+      }     // kernels
+    }       // channels
+  }         // order
+
+  if (json)
+  {
+    fprintf(out, "\n]\n");
+  }
+  fclose(out);
+  return 0;
+}
+
+/* Network mode
+
+   conv-harness -network <file> runs a small sparse CNN described one
+   layer per line:
+
+     input <width> <height> <channels>
+     conv <kernel_order> <kernels> <nz_ratio> [stride]
+     relu
+     maxpool <size>
+     avgpool <size>
+     fc <outputs> <nz_ratio>
+
+   Blank lines and lines starting with # are ignored. Every tensor
+   between two layers is held in the image layout that team_conv_sparse
+   reads, [width + halo][height + halo][channels] with a zero halo of
+   the kernel order of the convolution that consumes it, and every
+   layer writes its result straight into the inside of the next tensor
+   (a convolution through a conv_dest), so convolutions keep the size
+   of their input. The weights are random
+   like the harness's, but centred and scaled per kernel so that values
+   stay in range from layer to layer and ReLU has negative values to
+   clear. The network is checked once against the same layers built on
+   multichannel_conv_sparse, then timed layer by layer. A relu and a
+   2x2 pooling that follow a convolution are fused into it as its
+   epilogue; a 2x2 pooling only when the convolution has stride 1. */
+
+#define NETWORK_MAX_LAYERS 64
+
+enum network_layer_kind
+{
+  LAYER_CONV,
+  LAYER_RELU,
+  LAYER_MAXPOOL,
+  LAYER_AVGPOOL,
+  LAYER_FC
+};
+
+// an activation tensor in the layout of the harness's image
+struct network_tensor
+{
+  float ***data; // [width + halo][height + halo][channels]
+  int width, height, channels;
+  int halo;      // kernel order of the convolution that reads it, else 0
+};
+
+struct network_layer
+{
+  int kind;
+  int kernel_order, nkernels, nz_ratio; // conv; nkernels is the outputs of fc
+  int stride;                           // conv
+  int pool;                             // maxpool and avgpool
+  int activation;                       // conv: a fused relu
+  int fused_pool;                       // conv: a fused 2x2 pooling
+  struct sparse_matrix ***kernels;      // conv, and [0][0] of fc
+  double *samples;                      // timed runs, in seconds
+};
+
+struct network
+{
+  int nlayers;
+  struct network_layer layers[NETWORK_MAX_LAYERS];
+  struct network_tensor tensors[NETWORK_MAX_LAYERS + 1]; // tensors[i] is the input of layers[i]
+};
+
+static const char *network_layer_names[] = {"conv", "relu", "maxpool", "avgpool", "fc"};
+
+/* offset of the inside of a tensor from the start of its halo */
+static inline int network_tensor_offset(const struct network_tensor *tensor)
+{
+  return tensor->halo / 2;
+}
+
+/* read a layer description file and work out the shape of every tensor */
+void network_read(const char *path, struct network *net)
+{
+  FILE *file = fopen(path, "r");
+  char line[256];
+  int line_number = 0, have_input = 0;
+
+  if (file == NULL)
+  {
+    fprintf(stderr, "FATAL: cannot open network file %s\n", path);
+    exit(1);
+  }
+  net->nlayers = 0;
+  while (fgets(line, sizeof(line), file) != NULL)
+  {
+    struct network_tensor *in = &net->tensors[net->nlayers];
+    struct network_layer *layer = &net->layers[net->nlayers];
+    char word[32];
+    int a = 0, b = 0, c = 0, d = 1, n;
+
+    line_number++;
+    n = sscanf(line, "%31s %d %d %d %d", word, &a, &b, &c, &d);
+    if (n <= 0 || word[0] == '#')
+    {
+      continue;
+    }
+    if (!have_input)
+    {
+      if (strcmp(word, "input") != 0 || n != 4 || a <= 0 || a != b || c <= 0)
+      {
+        fprintf(stderr, "FATAL: %s:%d: the first layer must be input <width> <height> <channels>, "
+                        "with width equal to height\n", path, line_number);
+        exit(1);
+      }
+      in->width = a;
+      in->height = b;
+      in->channels = c;
+      have_input = 1;
+      continue;
+    }
+    if (net->nlayers == NETWORK_MAX_LAYERS)
+    {
+      fprintf(stderr, "FATAL: %s:%d: more than %d layers\n", path, line_number, NETWORK_MAX_LAYERS);
+      exit(1);
+    }
+
+    if (strcmp(word, "relu") == 0 && n == 1 && net->nlayers > 0 &&
+        layer[-1].kind == LAYER_CONV && layer[-1].activation == ACTIVATION_NONE &&
+        layer[-1].fused_pool == POOL_NONE)
+    {
+      layer[-1].activation = ACTIVATION_RELU;
+      continue;
+    }
+    if ((strcmp(word, "maxpool") == 0 || strcmp(word, "avgpool") == 0) && n == 2 && a == 2 &&
+        net->nlayers > 0 && layer[-1].kind == LAYER_CONV && layer[-1].fused_pool == POOL_NONE &&
+        layer[-1].stride == 1 && in->width % 2 == 0)
+    {
+      layer[-1].fused_pool = (word[0] == 'm') ? POOL_MAX2 : POOL_AVG2;
+      in->width /= 2;
+      in->height /= 2;
+      continue;
+    }
+    memset(layer, 0, sizeof(*layer));
+    in[1] = *in;
+    in[1].halo = 0;
+    if (strcmp(word, "conv") == 0 && (n == 4 || n == 5) && a >= 1 && b >= 1 && c >= 1 &&
+        d >= 1 && d <= in->width)
+    {
+      layer->kind = LAYER_CONV;
+      layer->kernel_order = a;
+      layer->nkernels = b;
+      layer->nz_ratio = c;
+      layer->stride = d;
+      // conv_input_extent(width / stride, ...) is at most width + halo
+      in->halo = a;
+      in[1].width = in->width / d;
+      in[1].height = in->height / d;
+      in[1].channels = b;
+    }
+    else if (strcmp(word, "relu") == 0 && n == 1)
+    {
+      layer->kind = LAYER_RELU;
+    }
+    else if ((strcmp(word, "maxpool") == 0 || strcmp(word, "avgpool") == 0) &&
+             n == 2 && a >= 1 && a <= in->width)
+    {
+      layer->kind = (word[0] == 'm') ? LAYER_MAXPOOL : LAYER_AVGPOOL;
+      layer->pool = a;
+      in[1].width = in->width / a;
+      in[1].height = in->height / a;
+    }
+    else if (strcmp(word, "fc") == 0 && n == 3 && a >= 1 && b >= 1)
+    {
+      layer->kind = LAYER_FC;
+      layer->nkernels = a;
+      layer->nz_ratio = b;
+      in[1].width = 1;
+      in[1].height = 1;
+      in[1].channels = a;
+    }
+    else
+    {
+      fprintf(stderr, "FATAL: %s:%d: cannot parse layer '%s'\n", path, line_number, word);
+      exit(1);
+    }
+    net->nlayers++;
+  }
+  fclose(file);
+  if (net->nlayers == 0)
+  {
+    fprintf(stderr, "FATAL: %s has no layers\n", path);
+    exit(1);
+  }
+}
+
+/* centre the random weights of each kernel on zero and scale them so
+   that the absolute values of each output's weights add up to one */
+void network_scale_weights(struct sparse_matrix ***kernels, int kernel_order, int nkernels)
+{
+  int m, x, y, index;
+
+  for (m = 0; m < nkernels; m++)
+  {
+    double total = 0.0;
+    for (x = 0; x < kernel_order; x++)
+    {
+      for (y = 0; y < kernel_order; y++)
+      {
+        struct sparse_matrix *kernel = kernels[x][y];
+        for (index = kernel->kernel_starts[m]; index < kernel->kernel_starts[m + 1]; index++)
+        {
+          kernel->values[index] -= 512.0f;
+          total += fabs(kernel->values[index]);
+        }
+      }
+    }
+    for (x = 0; x < kernel_order && total > 0.0; x++)
+    {
+      for (y = 0; y < kernel_order; y++)
+      {
+        struct sparse_matrix *kernel = kernels[x][y];
+        for (index = kernel->kernel_starts[m]; index < kernel->kernel_starts[m + 1]; index++)
+        {
+          kernel->values[index] /= total;
+        }
+      }
+    }
+  }
+}
+
+/* allocate the tensors and the weights of a network */
+void network_build(struct network *net, int repeats)
+{
+  int i, x, y;
+
+  for (i = 0; i <= net->nlayers; i++)
+  {
+    struct network_tensor *tensor = &net->tensors[i];
+    tensor->data = new_empty_3d_matrix(tensor->width + tensor->halo, tensor->height + tensor->halo,
+                                       tensor->channels);
+    // the halo stays zero for good
+    memset(&(tensor->data[0][0][0]), 0,
+           sizeof(float) * (size_t)(tensor->width + tensor->halo) * (tensor->height + tensor->halo) *
+               tensor->channels);
+  }
+
+  for (i = 0; i < net->nlayers; i++)
+  {
+    struct network_layer *layer = &net->layers[i];
+    struct network_tensor *in = &net->tensors[i];
+    int order = 0, ninputs = 0;
+
+    if (layer->kind == LAYER_CONV)
+    {
+      order = layer->kernel_order;
+      ninputs = in->channels;
+    }
+    else if (layer->kind == LAYER_FC)
+    {
+      // a fully connected layer is a 1x1 sparse kernel over the
+      // flattened input
+      order = 1;
+      ninputs = in->width * in->height * in->channels;
+    }
+    if (order > 0)
+    {
+      long long *capacity = calloc(order * order, sizeof(long long));
+      struct sparse_matrix **temp = malloc(sizeof(struct sparse_matrix *) * order * order);
+      layer->kernels = malloc(sizeof(struct sparse_matrix **) * order);
+      assert(capacity != NULL && temp != NULL && layer->kernels != NULL);
+      for (x = 0; x < order; x++)
+      {
+        layer->kernels[x] = &(temp[x * order]);
+        for (y = 0; y < order; y++)
+        {
+          temp[x * order + y] = sparse_matrix_new(layer->nkernels, ninputs, 0);
+        }
+      }
+      fill_random_sparse_kernels(layer->kernels, capacity, order, layer->nkernels, ninputs,
+                                 layer->nz_ratio);
+      network_scale_weights(layer->kernels, order, layer->nkernels);
+      free(capacity);
+    }
+    layer->samples = malloc(sizeof(double) * repeats);
+    assert(layer->samples != NULL);
+  }
+}
+
+/* the reference for a conv layer: each output on its own, then its
+   epilogue, and with a fused pooling the four outputs of its window */
+void network_conv_reference(struct network_layer *layer, struct network_tensor *in,
+                            struct network_tensor *out)
+{
+  struct conv_epilogue epilogue = {NULL, layer->activation, layer->fused_pool};
+  int scale = (layer->fused_pool != POOL_NONE) ? 2 : 1;
+  int off = network_tensor_offset(out);
+  int w, h, m, i, x, y, index;
+
+  for (w = 0; w < out->width; w++)
+  {
+    for (h = 0; h < out->height; h++)
+    {
+      for (m = 0; m < out->channels; m++)
+      {
+        float window[4];
+        for (i = 0; i < scale * scale; i++)
+        {
+          int iw = (w * scale + i % scale) * layer->stride, ih = (h * scale + i / scale) * layer->stride;
+          float sum = 0.0f;
+          for (x = 0; x < layer->kernel_order; x++)
+          {
+            for (y = 0; y < layer->kernel_order; y++)
+            {
+              struct sparse_matrix *kernel = layer->kernels[x][y];
+              for (index = kernel->kernel_starts[m]; index < kernel->kernel_starts[m + 1]; index++)
+              {
+                sum += in->data[iw + x][ih + y][kernel->channel_numbers[index]] * kernel->values[index];
+              }
+            }
+          }
+          window[i] = epilogue_apply(&epilogue, m, sum);
+        }
+        out->data[w + off][h + off][m] =
+            (scale == 1) ? window[0] : pool_2x2(epilogue.pool, window[0], window[1], window[2], window[3]);
+      }
+    }
+  }
+}
+
+/* run one layer from tensor in to tensor out, with the team's
+   convolution or with the reference one */
+void network_run_layer(struct network_layer *layer, struct network_tensor *in,
+                       struct network_tensor *out, int reference)
+{
+  int in_off = network_tensor_offset(in), out_off = network_tensor_offset(out);
+  struct conv_epilogue epilogue = {NULL, layer->activation, layer->fused_pool};
+  int w, h, c, x, y;
+
+  switch (layer->kind)
+  {
+  case LAYER_CONV:
+    if (reference)
+    {
+      network_conv_reference(layer, in, out);
+    }
+    else
+    {
+      struct conv_dest dest = {NULL, out->data, out_off};
+      team_conv_sparse_strided_dest(in->data, layer->kernels, &dest, in->width / layer->stride,
+                                    in->height / layer->stride, in->channels, layer->nkernels,
+                                    layer->kernel_order, layer->stride, 1, &epilogue);
+    }
+    break;
+
+  case LAYER_RELU:
+#pragma omp parallel for private(h, c) if (out->width * out->height * out->channels >= 65536)
+    for (w = 0; w < out->width; w++)
+    {
+      for (h = 0; h < out->height; h++)
+      {
+        const float *src = in->data[w + in_off][h + in_off];
+        float *dst = out->data[w + out_off][h + out_off];
+        for (c = 0; c < out->channels; c++)
+        {
+          dst[c] = (src[c] > 0.0f) ? src[c] : 0.0f;
+        }
+      }
+    }
+    break;
+
+  case LAYER_MAXPOOL:
+  case LAYER_AVGPOOL:
+#pragma omp parallel for private(h, c, x, y) if (in->width * in->height * in->channels >= 65536)
+    for (w = 0; w < out->width; w++)
+    {
+      for (h = 0; h < out->height; h++)
+      {
+        float *dst = out->data[w + out_off][h + out_off];
+        for (c = 0; c < out->channels; c++)
+        {
+          float result = (layer->kind == LAYER_MAXPOOL) ? -INFINITY : 0.0f;
+          for (x = 0; x < layer->pool; x++)
+          {
+            for (y = 0; y < layer->pool; y++)
+            {
+              float v = in->data[w * layer->pool + x + in_off][h * layer->pool + y + in_off][c];
+              if (layer->kind == LAYER_MAXPOOL)
+              {
+                result = (v > result) ? v : result;
+              }
+              else
+              {
+                result += v;
+              }
+            }
+          }
+          dst[c] = (layer->kind == LAYER_MAXPOOL) ? result : result / (layer->pool * layer->pool);
+        }
+      }
+    }
+    break;
+
+  case LAYER_FC:
+  {
+    struct sparse_matrix *kernel = layer->kernels[0][0];
+    float *dst = out->data[out_off][out_off];
+    int m;
+
+    // input number (w * height + h) * channels + c, as the inside of
+    // the input tensor is laid out when it has no halo
+#pragma omp parallel for if (kernel->non_zeros >= 65536)
+    for (m = 0; m < layer->nkernels; m++)
+    {
+      double sum = 0.0;
+      int index;
+      for (index = kernel->kernel_starts[m]; index < kernel->kernel_starts[m + 1]; index++)
+      {
+        int input = kernel->channel_numbers[index];
+        int iw = input / (in->height * in->channels);
+        int ih = (input / in->channels) % in->height;
+        sum += in->data[iw + in_off][ih + in_off][input % in->channels] * kernel->values[index];
+      }
+      dst[m] = sum;
+    }
+    break;
+  }
+  }
+}
+
+/* print the usage of the network mode and exit */
+void network_usage_exit(void)
+{
+  fprintf(stderr, "Usage: conv-harness -network <layers file> [network options]\n");
+  fprintf(stderr, "  -repeat <n>   timed runs of the network, default 10\n");
+  fprintf(stderr, "  -warmup <n>   untimed runs before them, default 1\n");
+  fprintf(stderr, "  -seed <n>     seed for the random inputs and weights\n");
+  exit(1);
+}
+
+/* build, check and time a network from a layer description file */
+int run_network(int argc, char **argv)
+{
+  struct network *net;
+  struct network_tensor *last;
+  struct timing_stats stats;
+  float ***reference;
+  double *totals;
+  long long pixels, i;
+  int repeats = 10, warmups = 1;
+  int run, l;
+
+  if (argc < 3)
+  {
+    network_usage_exit();
+  }
+  for (l = 3; l < argc; l++)
+  {
+    if (l + 1 >= argc)
+    {
+      network_usage_exit();
+    }
+    if (strcmp(argv[l], "-repeat") == 0)
+    {
+      repeats = atoi(argv[++l]);
+    }
+    else if (strcmp(argv[l], "-warmup") == 0)
+    {
+      warmups = atoi(argv[++l]);
+    }
+    else if (strcmp(argv[l], "-seed") == 0)
+    {
+      random_seed = atoll(argv[++l]);
+    }
+    else
+    {
+      network_usage_exit();
+    }
+  }
+  if (repeats < 1 || warmups < 0)
+  {
+    network_usage_exit();
+  }
+  srandom_seed((random_seed >= 0) ? random_seed : time(NULL));
+
+  net = malloc(sizeof(struct network));
+  assert(net != NULL);
+  network_read(argv[2], net);
+  network_build(net, repeats);
+
+  // the input image, drawn like the harness's
+  pixels = (long long)net->tensors[0].width * net->tensors[0].height;
+  for (i = 0; i < pixels; i++)
+  {
+    int off = network_tensor_offset(&net->tensors[0]);
+    float *pixel = net->tensors[0].data[i / net->tensors[0].height + off][i % net->tensors[0].height + off];
+    int c;
+    for (c = 0; c < net->tensors[0].channels; c++)
+    {
+      pixel[c] = (random() % 1023) + 1;
+    }
+  }
+
+  // check the team's network against the reference one
+  last = &net->tensors[net->nlayers];
+  for (l = 0; l < net->nlayers; l++)
+  {
+    network_run_layer(&net->layers[l], &net->tensors[l], &net->tensors[l + 1], 1);
+  }
+  reference = new_empty_3d_matrix(last->width + last->halo, last->height + last->halo, last->channels);
+  memcpy(&(reference[0][0][0]), &(last->data[0][0][0]),
+         sizeof(float) * (size_t)(last->width + last->halo) * (last->height + last->halo) * last->channels);
+
+  totals = malloc(sizeof(double) * repeats);
+  assert(totals != NULL);
+  for (run = 0; run < warmups + repeats; run++)
+  {
+    double network_start = now_seconds();
+    for (l = 0; l < net->nlayers; l++)
+    {
+      double start = now_seconds();
+      network_run_layer(&net->layers[l], &net->tensors[l], &net->tensors[l + 1], 0);
+      if (run >= warmups)
+      {
+        net->layers[l].samples[run - warmups] = now_seconds() - start;
+      }
+    }
+    if (run >= warmups)
+    {
+      totals[run - warmups] = now_seconds() - network_start;
+    }
+  }
+
+  printf("Layer                            output            median us     p5 us    p95 us\n");
+  for (l = 0; l < net->nlayers; l++)
+  {
+    struct network_layer *layer = &net->layers[l];
+    struct network_tensor *out = &net->tensors[l + 1];
+    char description[40];
+
+    if (layer->kind == LAYER_CONV)
+    {
+      snprintf(description, sizeof(description), "conv %dx%d/%d, 1/%d%s%s", layer->kernel_order,
+               layer->kernel_order, layer->stride, layer->nz_ratio,
+               (layer->activation == ACTIVATION_RELU) ? " +relu" : "",
+               (layer->fused_pool == POOL_MAX2) ? " +max" : (layer->fused_pool == POOL_AVG2) ? " +avg" : "");
+    }
+    else if (layer->kind == LAYER_FC)
+    {
+      snprintf(description, sizeof(description), "fc 1/%d", layer->nz_ratio);
+    }
+    else if (layer->kind == LAYER_RELU)
+    {
+      snprintf(description, sizeof(description), "relu");
+    }
+    else
+    {
+      snprintf(description, sizeof(description), "%s %d", network_layer_names[layer->kind], layer->pool);
+    }
+    compute_timing_stats(layer->samples, repeats, &stats);
+    printf("%2d %-28s %4dx%-4dx%-6d %10.1f %9.1f %9.1f\n", l, description, out->width, out->height,
+           out->channels, stats.median * 1e6, stats.p5 * 1e6, stats.p95 * 1e6);
+  }
+  compute_timing_stats(totals, repeats, &stats);
+  printf("Network time: %lld microseconds\n", (long long)(stats.median * 1e6 + 0.5));
+  if (repeats > 1)
+  {
+    print_timing_stats("Network time", &stats);
+  }
+  report_difference("network against reference", last->data, reference,
+                    last->width + last->halo, last->height + last->halo, last->channels);
+  return 0;
+}
+
+/* Streaming pipeline
+
+   With -stream, frames arrive one after another as they would in
+   deployment: a loader thread makes each image (a copy of the image
+   loaded with -load-image, as if decoded, or new random pixels), the
+   main thread runs team_conv_sparse on it with all the OpenMP threads,
+   and a writer thread writes out the result, to the -stream-out file
+   or just reads it back. Each stage works on its own one of two or
+   three buffer slots, so loading the next frame and writing the
+   previous one overlap the convolution of the current one. A slot
+   moves from free to loaded to computed and back to free, and each
+   thread waits on a condition variable for the slot it needs. The
+   same frames are also run one stage after another on one thread, to
+   show what the overlap gains. */
+
+enum stream_slot_state
+{
+  SLOT_FREE,
+  SLOT_LOADED,
+  SLOT_COMPUTED
+};
+
+struct stream_slot
+{
+  float ***image;
+  float ***output;
+  int state;
+  double start; // when the frame started loading
+};
+
+struct stream_pipeline
+{
+  pthread_mutex_t lock;
+  pthread_cond_t changed;
+  struct stream_slot slots[3];
+  int nslots;
+  int frames;
+  int width, height, nchannels, nkernels, kernel_order;
+  struct sparse_matrix ***kernels;
+  float ***source; // image to copy in, or NULL for random pixels
+  FILE *out;       // where results go, or NULL
+  double *latencies;
+  double checksum; // of the results read back when there is no file
+};
+
+/* wait until a slot is in a state */
+void stream_wait(struct stream_pipeline *pipe, struct stream_slot *slot, int state)
+{
+  pthread_mutex_lock(&pipe->lock);
+  while (slot->state != state)
+  {
+    pthread_cond_wait(&pipe->changed, &pipe->lock);
+  }
+  pthread_mutex_unlock(&pipe->lock);
+}
+
+/* move a slot to a new state and wake the other threads */
+void stream_set(struct stream_pipeline *pipe, struct stream_slot *slot, int state)
+{
+  pthread_mutex_lock(&pipe->lock);
+  slot->state = state;
+  pthread_cond_broadcast(&pipe->changed);
+  pthread_mutex_unlock(&pipe->lock);
+}
+
+/* load frame number frame into the image of a slot */
+void stream_load(struct stream_pipeline *pipe, struct stream_slot *slot, int frame)
+{
+  long long n = (long long)(pipe->width + pipe->kernel_order) * (pipe->height + pipe->kernel_order) *
+                pipe->nchannels;
+  float *image = &(slot->image[0][0][0]);
+  uint32_t state = 2654435761u * (frame + 1);
+  long long i;
+
+  if (pipe->source != NULL)
+  {
+    memcpy(image, &(pipe->source[0][0][0]), sizeof(float) * n);
+    return;
+  }
+  // the values of gen_random_3d_matrix, from a generator of our own as
+  // random() is shared with the other threads
+  for (i = 0; i < n; i++)
+  {
+    state ^= state << 13;
+    state ^= state >> 17;
+    state ^= state << 5;
+    image[i] = (state % 1023) + 1;
+  }
+}
+
+/* write out the output of a slot */
+void stream_write(struct stream_pipeline *pipe, struct stream_slot *slot)
+{
+  long long n = (long long)pipe->nkernels * pipe->width * pipe->height;
+  const float *output = &(slot->output[0][0][0]);
+  long long i;
+
+  if (pipe->out != NULL)
+  {
+    if (fwrite(output, sizeof(float), n, pipe->out) != (size_t)n)
+    {
+      fprintf(stderr, "FATAL: cannot write the stream output\n");
+      exit(1);
+    }
+    return;
+  }
+  for (i = 0; i < n; i++)
+  {
+    pipe->checksum += output[i];
+  }
+}
+
+/* the loader thread */
+void *stream_loader(void *arg)
+{
+  struct stream_pipeline *pipe = arg;
+  int frame;
+
+  for (frame = 0; frame < pipe->frames; frame++)
+  {
+    struct stream_slot *slot = &pipe->slots[frame % pipe->nslots];
+    stream_wait(pipe, slot, SLOT_FREE);
+    slot->start = now_seconds();
+    stream_load(pipe, slot, frame);
+    stream_set(pipe, slot, SLOT_LOADED);
+  }
+  return NULL;
+}
+
+/* the writer thread */
+void *stream_writer(void *arg)
+{
+  struct stream_pipeline *pipe = arg;
+  int frame;
+
+  for (frame = 0; frame < pipe->frames; frame++)
+  {
+    struct stream_slot *slot = &pipe->slots[frame % pipe->nslots];
+    stream_wait(pipe, slot, SLOT_COMPUTED);
+    stream_write(pipe, slot);
+    pipe->latencies[frame] = now_seconds() - slot->start;
+    stream_set(pipe, slot, SLOT_FREE);
+  }
+  return NULL;
+}
+
+/* run frames through the pipeline, overlapped or one stage at a time,
+   and report the frame rate and the latency of each frame */
+void stream_run(struct stream_pipeline *pipe, int overlapped)
+{
+  struct timing_stats stats;
+  double start = now_seconds(), seconds;
+  int frame, i;
+
+  for (i = 0; i < pipe->nslots; i++)
+  {
+    pipe->slots[i].state = SLOT_FREE;
+  }
+  pipe->checksum = 0.0;
+  if (overlapped)
+  {
+    pthread_t loader, writer;
+
+    pthread_create(&loader, NULL, stream_loader, pipe);
+    pthread_create(&writer, NULL, stream_writer, pipe);
+    for (frame = 0; frame < pipe->frames; frame++)
+    {
+      struct stream_slot *slot = &pipe->slots[frame % pipe->nslots];
+      stream_wait(pipe, slot, SLOT_LOADED);
+      team_conv_sparse(slot->image, pipe->kernels, slot->output, pipe->width, pipe->height,
+                       pipe->nchannels, pipe->nkernels, pipe->kernel_order);
+      stream_set(pipe, slot, SLOT_COMPUTED);
+    }
+    pthread_join(loader, NULL);
+    pthread_join(writer, NULL);
+  }
+  else
+  {
+    struct stream_slot *slot = &pipe->slots[0];
+    for (frame = 0; frame < pipe->frames; frame++)
+    {
+      slot->start = now_seconds();
+      stream_load(pipe, slot, frame);
+      team_conv_sparse(slot->image, pipe->kernels, slot->output, pipe->width, pipe->height,
+                       pipe->nchannels, pipe->nkernels, pipe->kernel_order);
+      stream_write(pipe, slot);
+      pipe->latencies[frame] = now_seconds() - slot->start;
+    }
+  }
+  seconds = now_seconds() - start;
+
+  printf("Stream %s: %d frames in %.3f s, %.2f frames/s\n",
+         overlapped ? "pipelined" : "sequential", pipe->frames, seconds, pipe->frames / seconds);
+  compute_timing_stats(pipe->latencies, pipe->frames, &stats);
+  print_timing_stats(overlapped ? "Pipelined frame latency" : "Sequential frame latency", &stats);
+  if (pipe->out == NULL)
+  {
+    // the same frames either way, so the two runs must agree
+    printf("Stream %s checksum: %.17g\n", overlapped ? "pipelined" : "sequential", pipe->checksum);
+  }
+}
+
+/* stream frames through team_conv_sparse with the given buffers */
+void run_stream(struct sparse_matrix ***kernels, float ***source, int width, int height,
+                int nchannels, int nkernels, int kernel_order, int frames, int nslots,
+                const char *out_path)
+{
+  struct stream_pipeline *pipe = malloc(sizeof(struct stream_pipeline));
+  int i;
+
+  assert(pipe != NULL && nslots >= 2 && nslots <= 3);
+  pthread_mutex_init(&pipe->lock, NULL);
+  pthread_cond_init(&pipe->changed, NULL);
+  pipe->nslots = nslots;
+  pipe->frames = frames;
+  pipe->width = width;
+  pipe->height = height;
+  pipe->nchannels = nchannels;
+  pipe->nkernels = nkernels;
+  pipe->kernel_order = kernel_order;
+  pipe->kernels = kernels;
+  pipe->source = source;
+  pipe->checksum = 0.0;
+  pipe->latencies = malloc(sizeof(double) * frames);
+  assert(pipe->latencies != NULL);
+  for (i = 0; i < nslots; i++)
+  {
+    pipe->slots[i].image = new_empty_3d_matrix(width + kernel_order, height + kernel_order, nchannels);
+    pipe->slots[i].output = new_empty_3d_matrix(nkernels, width, height);
+  }
+  pipe->out = NULL;
+  if (out_path != NULL)
+  {
+    pipe->out = fopen(out_path, "wb");
+    if (pipe->out == NULL)
+    {
+      fprintf(stderr, "FATAL: cannot create %s\n", out_path);
+      exit(1);
+    }
+  }
+
+  stream_run(pipe, 0);
+  if (pipe->out != NULL)
+  {
+    rewind(pipe->out);
+  }
+  stream_run(pipe, 1);
+
+  if (pipe->out != NULL)
+  {
+    fclose(pipe->out);
+  }
+  for (i = 0; i < nslots; i++)
+  {
+    free(pipe->slots[i].image[0][0]);
+    free(pipe->slots[i].image[0]);
+    free(pipe->slots[i].image);
+    free(pipe->slots[i].output[0][0]);
+    free(pipe->slots[i].output[0]);
+    free(pipe->slots[i].output);
+  }
+  pthread_cond_destroy(&pipe->changed);
+  pthread_mutex_destroy(&pipe->lock);
+  free(pipe->latencies);
+  free(pipe);
+}
+
+// optional settings that may follow the six positional arguments
+struct harness_options
+{
+  long long seed;          // -seed <n>: repeatable inputs; -1 if not given
+  const char *golden_path; // -golden <file>: golden output cache file
+  const char *load_image;   // -load-image <file>: dense image tensor file
+  const char *load_kernels; // -load-kernels <file>: sparse kernels file
+  const char *save_image;   // -save-image <file>: save the image used
+  const char *save_kernels; // -save-kernels <file>: save the kernels used
+  const char *plan_cache;   // -plan-cache <dir>: preprocessed kernel cache
+  int fp16;                 // -fp16: also run the half precision storage mode
+  int int8;                 // -int8: also run the quantized int8 engine
+  int index_encoding;       // -index int32|uint16|delta8: channel numbers
+  int codebook_bits;        // -codebook 4|8: also run clustered values
+  int repeats;              // -repeat <n>: timed runs of the team code
+  int warmups;              // -warmup <n>: untimed runs before them
+  int timer;                // -timer clock|tsc
+  size_t flush_bytes;       // -flush <MB>: cache flush buffer, 0 for none
+  int perf;                 // -perf: hardware counters for each phase
+  const char *trace_path;   // -trace <file>: Chrome trace of the timed runs
+  int roofline;             // -roofline: place the run on the machine's roofline
+  int epilogue;             // -epilogue: time bias, batch norm and ReLU fused against a pass
+  int pool;                 // -pool max|avg: time 2x2 pooling fused against a pass
+  int stride;               // -stride <n>: also time a strided convolution
+  int dilation;             // -dilation <n>: also time a dilated convolution
+  int same;                 // -same: also time "same" padding of an unpadded image
+  int groups;               // -groups <n>: also time grouped (or depthwise) kernels
+  int nm;                   // -nm <n>: also time n:4 structured sparse kernels
+  int image_nz[32];         // -image-nz <list>: image nz ratios for the sparse image engine
+  int nimage_nz;
+  int channel_prune;        // -channel-prune <n>: also time kernels with 1 in n channels dense
+  int hybrid;               // -hybrid <percent>: also time per-kernel dense or sparse kernels
+  int reorder;              // -reorder: also time channels renumbered to share cache lines
+  int kernel_groups;        // -kernel-groups: also time kernels grouped by shared channels
+  int stream_frames;        // -stream <frames>: also stream frames through a pipeline
+  int stream_buffers;       // -buffers 2|3: slots of the pipeline
+  const char *stream_out;   // -stream-out <file>: where the streamed results go
+};
+
+/* print the usage message and exit */
+void usage_exit(void)
+{
+  fprintf(stderr, "Usage: conv-harness <image_width> <image_height> <kernel_order> <number of channels> <number of kernels> <non-zero ratio> [options]\n");
+  fprintf(stderr, "   or: conv-harness -sweep <results.csv|results.json> [sweep options]\n");
+  fprintf(stderr, "   or: conv-harness -network <layers file> [network options]\n");
+  fprintf(stderr, "Options:\n");
+  fprintf(stderr, "  -seed <n>        seed the random inputs so that runs are repeatable\n");
+  fprintf(stderr, "  -golden <file>   golden output cache used with -seed (default conv-golden.cache)\n");
+  fprintf(stderr, "  -load-image <file>    mmap the (width + order) x (height + order) x channels image\n");
+  fprintf(stderr, "  -load-kernels <file>  mmap the sparse kernels instead of generating them\n");
+  fprintf(stderr, "  -save-image <file>    save the image in the binary tensor format\n");
+  fprintf(stderr, "  -save-kernels <file>  save the sparse kernels in the binary tensor format\n");
+  fprintf(stderr, "  -plan-cache <dir>     cache preprocessed kernels in this directory\n");
+  fprintf(stderr, "  -fp16            also time half precision storage and report its error\n");
+  fprintf(stderr, "  -int8            also time the quantized int8 engine and report its error\n");
+  fprintf(stderr, "  -index <form>    channel numbers read by team_conv_sparse: int32 (default), uint16 or delta8\n");
+  fprintf(stderr, "  -codebook <bits> also time kernels clustered to 4 or 8 bit codes and report their error\n");
+  fprintf(stderr, "  -repeat <n>      time n runs of the team code and of each mode, and print their distribution\n");
+  fprintf(stderr, "  -warmup <n>      untimed runs before the timed runs\n");
+  fprintf(stderr, "  -timer <timer>   clock (clock_gettime, default) or tsc (rdtsc)\n");
+  fprintf(stderr, "  -flush <MB>      flush the caches with a buffer of this size before every run\n");
+  fprintf(stderr, "  -perf            count hardware events in each phase of team_conv_sparse\n");
+  fprintf(stderr, "  -trace <file>    write a Chrome trace of every thread's work in team_conv_sparse\n");
+  fprintf(stderr, "  -roofline        measure the machine's bandwidth and peak and report the run against them\n");
+  fprintf(stderr, "  -epilogue        time bias, batch norm and ReLU fused into team_conv_sparse against a separate pass\n");
+  fprintf(stderr, "  -pool <max|avg>  time 2x2 pooling fused into team_conv_sparse against a separate pass\n");
+  fprintf(stderr, "  -stride <n>      also time a convolution with this stride on a larger image\n");
+  fprintf(stderr, "  -dilation <n>    also time a convolution with this dilation on a larger image\n");
+  fprintf(stderr, "  -same            also time \"same\" padding of an unpadded image against copying it into a halo\n");
+  fprintf(stderr, "  -groups <n>      also time the kernels split into n groups; n = channels = kernels is depthwise\n");
+  fprintf(stderr, "  -nm <n>          also time kernels pruned to n:4 structured sparsity (n = 1 or 2) against CSR\n");
+  fprintf(stderr, "  -image-nz <list> also time the sparse image engine on images with these nz ratios, e.g. 1,2,4,10\n");
+  fprintf(stderr, "  -channel-prune <n>  also time kernels where 1 in n channels survived pruning, dense over them\n");
+  fprintf(stderr, "  -hybrid <percent>   also time kernels of uneven density, each dense if at least this percent non-zero\n");
+  fprintf(stderr, "  -reorder            also time the channels renumbered so kernels read fewer cache lines\n");
+  fprintf(stderr, "  -kernel-groups      also time output kernels in groups of 4 and 8 that share channel patterns\n");
+  fprintf(stderr, "  -stream <frames>    also stream frames through overlapped load, convolution and write threads\n");
+  fprintf(stderr, "  -buffers <n>        buffer slots of the stream, 2 (default) or 3\n");
+  fprintf(stderr, "  -stream-out <file>  write the streamed results to this file\n");
+  exit(1);
+}
+
+/* parse the options that follow the positional arguments */
+void parse_options(int argc, char **argv, int first, struct harness_options *opts)
+{
+  int i;
+
+  opts->seed = -1;
+  opts->golden_path = "conv-golden.cache";
+  opts->load_image = NULL;
+  opts->load_kernels = NULL;
+  opts->save_image = NULL;
+  opts->save_kernels = NULL;
+  opts->plan_cache = NULL;
+  opts->fp16 = 0;
+  opts->int8 = 0;
+  opts->index_encoding = INDEX_INT32;
+  opts->codebook_bits = 0;
+  opts->repeats = 1;
+  opts->warmups = 0;
+  opts->timer = TIMER_CLOCK;
+  opts->flush_bytes = 0;
+  opts->perf = 0;
+  opts->trace_path = NULL;
+  opts->roofline = 0;
+  opts->epilogue = 0;
+  opts->pool = POOL_NONE;
+  opts->stride = 1;
+  opts->dilation = 1;
+  opts->same = 0;
+  opts->groups = 1;
+  opts->nm = 0;
+  opts->nimage_nz = 0;
+  opts->channel_prune = 0;
+  opts->hybrid = -1;
+  opts->reorder = 0;
+  opts->kernel_groups = 0;
+  opts->stream_frames = 0;
+  opts->stream_buffers = 2;
+  opts->stream_out = NULL;
+
+  for (i = first; i < argc; i++)
+  {
+    if (strcmp(argv[i], "-seed") == 0 && i + 1 < argc)
+    {
+      opts->seed = atoll(argv[++i]);
+      if (opts->seed < 0)
+      {
+        fprintf(stderr, "FATAL: seed must not be negative\n");
+        exit(1);
+      }
+    }
+    else if (strcmp(argv[i], "-golden") == 0 && i + 1 < argc)
+    {
+      opts->golden_path = argv[++i];
+    }
+    else if (strcmp(argv[i], "-load-image") == 0 && i + 1 < argc)
+    {
+      opts->load_image = argv[++i];
+    }
+    else if (strcmp(argv[i], "-load-kernels") == 0 && i + 1 < argc)
+    {
+      opts->load_kernels = argv[++i];
+    }
+    else if (strcmp(argv[i], "-save-image") == 0 && i + 1 < argc)
+    {
+      opts->save_image = argv[++i];
+    }
+    else if (strcmp(argv[i], "-save-kernels") == 0 && i + 1 < argc)
+    {
+      opts->save_kernels = argv[++i];
+    }
+    else if (strcmp(argv[i], "-plan-cache") == 0 && i + 1 < argc)
+    {
+      opts->plan_cache = argv[++i];
+    }
+    else if (strcmp(argv[i], "-fp16") == 0)
+    {
+      opts->fp16 = 1;
+    }
+    else if (strcmp(argv[i], "-int8") == 0)
+    {
+      opts->int8 = 1;
+    }
+    else if (strcmp(argv[i], "-index") == 0 && i + 1 < argc)
+    {
+      i++;
+      if (strcmp(argv[i], "int32") == 0)
+      {
+        opts->index_encoding = INDEX_INT32;
+      }
+      else if (strcmp(argv[i], "uint16") == 0)
+      {
+        opts->index_encoding = INDEX_UINT16;
+      }
+      else if (strcmp(argv[i], "delta8") == 0)
+      {
+        opts->index_encoding = INDEX_DELTA8;
+      }
+      else
+      {
+        fprintf(stderr, "FATAL: unknown index encoding %s\n", argv[i]);
+        usage_exit();
+      }
+    }
+    else if (strcmp(argv[i], "-codebook") == 0 && i + 1 < argc)
+    {
+      opts->codebook_bits = atoi(argv[++i]);
+      if (opts->codebook_bits != 4 && opts->codebook_bits != 8)
+      {
+        fprintf(stderr, "FATAL: codebook codes must be 4 or 8 bits\n");
+        exit(1);
+      }
+    }
+    else if (strcmp(argv[i], "-repeat") == 0 && i + 1 < argc)
+    {
+      opts->repeats = atoi(argv[++i]);
+      if (opts->repeats < 1)
+      {
+        fprintf(stderr, "FATAL: need at least one timed run\n");
+        exit(1);
+      }
+    }
+    else if (strcmp(argv[i], "-warmup") == 0 && i + 1 < argc)
+    {
+      opts->warmups = atoi(argv[++i]);
+      if (opts->warmups < 0)
+      {
+        fprintf(stderr, "FATAL: warmup runs must not be negative\n");
+        exit(1);
+      }
+    }
+    else if (strcmp(argv[i], "-timer") == 0 && i + 1 < argc)
+    {
+      i++;
+      if (strcmp(argv[i], "clock") == 0)
+      {
+        opts->timer = TIMER_CLOCK;
+      }
+      else if (strcmp(argv[i], "tsc") == 0)
+      {
+        opts->timer = TIMER_TSC;
+      }
+      else
+      {
+        fprintf(stderr, "FATAL: unknown timer %s\n", argv[i]);
+        usage_exit();
+      }
+    }
+    else if (strcmp(argv[i], "-flush") == 0 && i + 1 < argc)
+    {
+      long long megabytes = atoll(argv[++i]);
+      if (megabytes < 1 || (unsigned long long)megabytes > (SIZE_MAX >> 20))
+      {
+        fprintf(stderr, "FATAL: -flush takes a buffer size of at least 1 MB, not %s\n", argv[i]);
+        exit(1);
+      }
+      opts->flush_bytes = (size_t)megabytes << 20;
+    }
+    else if (strcmp(argv[i], "-perf") == 0)
+    {
+      opts->perf = 1;
+    }
+    else if (strcmp(argv[i], "-trace") == 0 && i + 1 < argc)
+    {
+      opts->trace_path = argv[++i];
+    }
+    else if (strcmp(argv[i], "-roofline") == 0)
+    {
+      opts->roofline = 1;
+    }
+    else if (strcmp(argv[i], "-epilogue") == 0)
+    {
+      opts->epilogue = 1;
+    }
+    else if (strcmp(argv[i], "-stride") == 0 && i + 1 < argc)
+    {
+      opts->stride = atoi(argv[++i]);
+      if (opts->stride < 1)
+      {
+        fprintf(stderr, "FATAL: the stride must be at least 1\n");
+        exit(1);
+      }
+    }
+    else if (strcmp(argv[i], "-dilation") == 0 && i + 1 < argc)
+    {
+      opts->dilation = atoi(argv[++i]);
+      if (opts->dilation < 1)
+      {
+        fprintf(stderr, "FATAL: the dilation must be at least 1\n");
+        exit(1);
+      }
+    }
+    else if (strcmp(argv[i], "-groups") == 0 && i + 1 < argc)
+    {
+      opts->groups = atoi(argv[++i]);
+      if (opts->groups < 1)
+      {
+        fprintf(stderr, "FATAL: -groups takes a number of groups of at least 1, not %s\n", argv[i]);
+        exit(1);
+      }
+    }
+    else if (strcmp(argv[i], "-nm") == 0 && i + 1 < argc)
+    {
+      opts->nm = atoi(argv[++i]);
+      if (opts->nm != 1 && opts->nm != 2)
+      {
+        fprintf(stderr, "FATAL: -nm takes 1 or 2, not %d\n", opts->nm);
+        exit(1);
+      }
+    }
+    else if (strcmp(argv[i], "-image-nz") == 0 && i + 1 < argc)
+    {
+      opts->nimage_nz = parse_int_list(argv[++i], opts->image_nz, 32);
+    }
+    else if (strcmp(argv[i], "-channel-prune") == 0 && i + 1 < argc)
+    {
+      opts->channel_prune = atoi(argv[++i]);
+      if (opts->channel_prune < 1)
+      {
+        fprintf(stderr, "FATAL: -channel-prune takes a ratio of at least 1\n");
+        exit(1);
+      }
+    }
+    else if (strcmp(argv[i], "-hybrid") == 0 && i + 1 < argc)
+    {
+      opts->hybrid = atoi(argv[++i]);
+      if (opts->hybrid < 0 || opts->hybrid > 100)
+      {
+        fprintf(stderr, "FATAL: -hybrid takes a percentage\n");
+        exit(1);
+      }
+    }
+    else if (strcmp(argv[i], "-reorder") == 0)
+    {
+      opts->reorder = 1;
+    }
+    else if (strcmp(argv[i], "-kernel-groups") == 0)
+    {
+      opts->kernel_groups = 1;
+    }
+    else if (strcmp(argv[i], "-stream") == 0 && i + 1 < argc)
+    {
+      opts->stream_frames = atoi(argv[++i]);
+      if (opts->stream_frames < 1)
+      {
+        fprintf(stderr, "FATAL: -stream takes a number of frames of at least 1, not %s\n", argv[i]);
+        exit(1);
+      }
+    }
+    else if (strcmp(argv[i], "-buffers") == 0 && i + 1 < argc)
+    {
+      opts->stream_buffers = atoi(argv[++i]);
+      if (opts->stream_buffers != 2 && opts->stream_buffers != 3)
+      {
+        fprintf(stderr, "FATAL: -buffers takes 2 or 3\n");
+        exit(1);
+      }
+    }
+    else if (strcmp(argv[i], "-stream-out") == 0 && i + 1 < argc)
+    {
+      opts->stream_out = argv[++i];
+    }
+    else if (strcmp(argv[i], "-same") == 0)
+    {
+      opts->same = 1;
+    }
+    else if (strcmp(argv[i], "-pool") == 0 && i + 1 < argc)
+    {
+      i++;
+      if (strcmp(argv[i], "max") == 0)
+      {
+        opts->pool = POOL_MAX2;
+      }
+      else if (strcmp(argv[i], "avg") == 0)
+      {
+        opts->pool = POOL_AVG2;
+      }
+      else
+      {
+        fprintf(stderr, "FATAL: -pool takes max or avg, not %s\n", argv[i]);
+        exit(1);
+      }
+    }
+    else
+    {
+      fprintf(stderr, "FATAL: unknown or incomplete option %s\n", argv[i]);
+      usage_exit();
+    }
+  }
+}
+
+int main(int argc, char **argv)
+{
+  //float image[W][H][C];
+  //float kernels[M][C][K][K];
+  //float output[M][W][H];
+
+  float ***image;
+  float ****kernels = NULL;
+  struct sparse_matrix ***sparse_kernels = NULL;
+  float ***control_output = NULL, ***output;
+  int width, height, kernel_order, nchannels, nkernels;
+  struct harness_timing timing;
+  struct timing_stats stats;
+  int nz_ratio = 1; // by default we just have a dense matrix
+  struct harness_options opts;
+  struct golden_key golden_key;
+  struct golden_entry golden;
+  int golden_hit = 0;
+  int use_sparse;
+  struct conv_plan *plan = NULL;
+
+  if (argc >= 2 && strcmp(argv[1], "-sweep") == 0)
+  {
+    return run_sweep(argc, argv);
+  }
+  if (argc >= 2 && strcmp(argv[1], "-network") == 0)
+  {
+    return run_network(argc, argv);
+  }
+
+  if (argc < 7)
+  {
+    usage_exit();
+  }
+  else
+  {
+    width = atoi(argv[1]);
+    height = atoi(argv[2]);
+    kernel_order = atoi(argv[3]);
+    nchannels = atoi(argv[4]);
+    nkernels = atoi(argv[5]);
+    nz_ratio = atoi(argv[6]);
+    parse_options(argc, argv, 7, &opts);
+  }
+  switch (kernel_order)
+  {
+  case 1:
+  case 3:
+  case 5:
+  case 7:
+    break;
+  default:
+    fprintf(stderr, "FATAL: kernel_order must be 1, 3, 5 or 7, not %d\n",
+            kernel_order);
+    exit(1);
+  }
+
+  assert(width >= 1);
+  assert(height >= 1);
+  assert(nchannels >= 1);
+  assert(nkernels >= 1);
+  assert(nz_ratio >= 1);
+
+  random_seed = opts.seed;
+
+  /* loaded kernels are always sparse, whatever the nz_ratio argument */
+  use_sparse = nz_ratio > 1 || opts.load_kernels != NULL;
+
+  /* 2x2 pooling halves the output, so check its sizes before anything
+     is allocated or run */
+  if (opts.pool != POOL_NONE && (!use_sparse || width % 2 != 0 || height % 2 != 0))
+  {
+    fprintf(stderr, "FATAL: -pool needs sparse kernels (nz_ratio > 1) and an even width and height\n");
+    exit(1);
+  }
+
+  /* the cache key only describes generated inputs */
+  if (opts.seed >= 0 && (opts.load_image != NULL || opts.load_kernels != NULL))
+  {
+    printf("COMMENT: golden cache not used with inputs loaded from files\n");
+    opts.seed = -1;
+  }
+
+  /* with repeatable inputs the control output can come from the cache */
+  if (opts.seed >= 0)
+  {
+    golden_key.version = GOLDEN_VERSION;
+    golden_key.seed = opts.seed;
+    golden_key.width = width;
+    golden_key.height = height;
+    golden_key.kernel_order = kernel_order;
+    golden_key.nchannels = nchannels;
+    golden_key.nkernels = nkernels;
+    golden_key.nz_ratio = nz_ratio;
+    golden_hit = golden_cache_lookup(opts.golden_path, &golden_key, &golden);
+  }
+
+  /* allocate the matrices */
+  if (opts.load_image != NULL)
+  {
+    image = load_dense_3d_file(opts.load_image, width + kernel_order,
+                               height + kernel_order, nchannels);
+  }
+  else
+  {
+    image = gen_random_3d_matrix(width + kernel_order, height + kernel_order,
+                                 nchannels, 1); // nz_ratio == 1, ie no sparsity
+  }
+  if (opts.load_kernels != NULL)
+  {
+    sparse_kernels = load_sparse_kernels_file(opts.load_kernels, kernel_order,
+                                              nkernels, nchannels);
+  }
+  else
+  {
+    kernels = gen_random_4d_matrix(kernel_order, kernel_order, nkernels, nchannels, nz_ratio);
+  }
+
+  /* preprocess the kernels, or fetch the preprocessed kernels from the cache */
+  if (use_sparse || opts.save_kernels != NULL)
+  { // we have sparsity
+    double plan_start = now_seconds();
+    uint64_t weights_hash = 0;
+    int plan_cached;
+
+    if (opts.plan_cache != NULL)
+    {
+      if (kernels != NULL)
+      {
+        weights_hash = hash_dense_kernels(kernels, kernel_order, nkernels, nchannels);
+      }
+      else
+      {
+        weights_hash = hash_sparse_kernels(sparse_kernels, kernel_order, nkernels, nchannels);
+      }
+      plan = conv_plan_load(opts.plan_cache, weights_hash, kernel_order, nkernels, nchannels);
+    }
+    plan_cached = plan != NULL;
+    if (plan == NULL)
+    {
+      if (kernels != NULL)
+      {
+        plan = conv_plan_from_dense(kernels, weights_hash, kernel_order, nkernels, nchannels);
+      }
+      else
+      {
+        plan = conv_plan_from_sparse(sparse_kernels, weights_hash, kernel_order, nkernels, nchannels);
+      }
+      if (opts.plan_cache != NULL)
+      {
+        conv_plan_save(opts.plan_cache, plan);
+      }
+    }
+    if (opts.plan_cache != NULL)
+    {
+      printf("Plan time: %lld microseconds%s\n", microseconds_since(plan_start),
+             plan_cached ? " (cached)" : "");
+    }
+    sparse_kernels = plan->kernels;
+
+    if (opts.index_encoding != INDEX_INT32)
+    {
+      if (nchannels > 65536)
+      {
+        fprintf(stderr, "FATAL: compact channel numbers need at most 65536 channels\n");
+        exit(1);
+      }
+      if (conv_plan_use_encoding(plan, opts.index_encoding) && opts.plan_cache != NULL)
+      {
+        conv_plan_save(opts.plan_cache, plan);
+      }
+      report_index_bytes(sparse_kernels, kernel_order, nkernels);
+    }
+    else
+    {
+      conv_plan_use_encoding(plan, INDEX_INT32);
+    }
+  }
+
+  if (opts.save_image != NULL)
+  {
+    save_dense_3d_file(opts.save_image, image, width + kernel_order,
+                       height + kernel_order, nchannels);
+  }
+  if (opts.save_kernels != NULL)
+  {
+    save_sparse_kernels_file(opts.save_kernels, sparse_kernels, kernel_order,
+                             nkernels, nchannels);
+  }
+
+  output = new_empty_3d_matrix(nkernels, width, height);
+
+  if (!golden_hit)
+  {
+    control_output = new_empty_3d_matrix(nkernels, width, height);
+
+    /* use a simple multichannel convolution routine to produce control result */
+    if (kernels != NULL)
+    {
+      multichannel_conv_dense(image, kernels, control_output, width,
+                              height, nchannels, nkernels, kernel_order);
+    }
+    else
+    { // only the sparse form of loaded kernels exists
+      multichannel_conv_sparse(image, sparse_kernels, control_output, width,
+                               height, nchannels, nkernels, kernel_order);
+    }
+
+    if (opts.seed >= 0)
+    {
+      golden_record(control_output, nkernels, width, height, &golden);
+      golden_cache_store(opts.golden_path, &golden_key, &golden);
+    }
+  }
+
+  /* run the team's code, timing all but the warmup runs; the other
+     modes below time their calls with the same settings */
+  harness_timing_init(&timing, opts.repeats, opts.warmups, opts.timer, opts.flush_bytes);
+  {
+    int run;
+
+    perf_enabled = opts.perf;
+    trace_enabled = opts.trace_path != NULL;
+    for (run = 0; run < opts.warmups + opts.repeats; run++)
+    {
+      uint64_t start;
+
+      if (run == opts.warmups)
+      {
+        perf_reset();
+        trace_reset();
+      }
+
+      harness_timing_flush(&timing);
+
+      /* record starting time of team's code*/
+      start = read_timer(opts.timer);
+
+      if (use_sparse)
+      { // we're working on a sparse matrix
+        /* perform student team's sparse multichannel convolution */
+        team_conv_sparse(image, sparse_kernels, output, width,
+                         height, nchannels, nkernels, kernel_order);
+      }
+      else
+      { // we're working on a dense matrix
+        multichannel_conv_dense(image, kernels, output, width,
+                                height, nchannels, nkernels, kernel_order);
+      }
+      /* record finishing time */
+      harness_timing_record(&timing, run, start);
+    }
+
+    // a single run is reported as before; repeated runs by their median
+    compute_timing_stats(timing.samples, opts.repeats, &stats);
+    report_timing("Team conv time", &stats);
+    if (opts.trace_path != NULL)
+    {
+      trace_enabled = 0;
+      trace_write(opts.trace_path);
+    }
+    if (opts.perf)
+    {
+      perf_enabled = 0;
+      if (!use_sparse)
+      {
+        printf("COMMENT: hardware counters only cover team_conv_sparse (nz_ratio > 1)\n");
+      }
+      else
+      {
+        perf_report(opts.repeats);
+      }
+    }
+    if (opts.roofline)
+    {
+      struct machine_roofs roofs = {0.0, 0.0, 0.0};
+      double flops, bytes;
+
+      if (use_sparse)
+      {
+        flops = conv_flops(sparse_kernels, kernel_order, width, height);
+        bytes = conv_traffic_bytes(sparse_kernels, kernel_order, width, height, nchannels, nkernels);
+      }
+      else
+      {
+        // the dense code does every multiply and reads every weight
+        flops = 2.0 * kernel_order * kernel_order * nchannels * nkernels * (double)width * height;
+        bytes = ((double)(width + kernel_order) * (height + kernel_order) * nchannels +
+                 (double)kernel_order * kernel_order * nkernels * nchannels +
+                 (double)nkernels * width * height) * sizeof(float);
+      }
+      measure_machine_roofs(&roofs);
+      report_roofline(&roofs, flops, bytes, stats.median);
+    }
+  }
 
   DEBUGGING(write_out(output, nkernels, width, height));
 
   /* now check that the team's multichannel convolution routine
      gives the same answer as the known working version */
-  check_result(output, control_output, nkernels, width, height);
+  if (golden_hit)
+  {
+    check_result_golden(output, &golden, nkernels, width, height);
+  }
+  else
+  {
+    check_result(output, control_output, nkernels, width, height);
+  }
+
+  /* time the half precision storage mode against the single precision
+     result just computed, then measure its error on inputs that do not
+     fit half precision exactly */
+  if (opts.fp16)
+  {
+    float ***output_f16 = new_empty_3d_matrix(nkernels, width, height);
+    uint16_t *image_f16;
+
+    if (!use_sparse)
+    {
+      fprintf(stderr, "FATAL: -fp16 needs sparse kernels (nz_ratio > 1)\n");
+      exit(1);
+    }
+    if (!__builtin_cpu_supports("f16c"))
+    {
+      fprintf(stderr, "FATAL: -fp16 needs a CPU with F16C\n");
+      exit(1);
+    }
+    image_f16 = image_to_f16(image, width + kernel_order, height + kernel_order, nchannels);
+    kernels_make_f16(sparse_kernels, kernel_order);
+
+    HARNESS_TIME(&timing, &stats,
+                 team_conv_sparse_f16(image_f16, sparse_kernels, output_f16, width,
+                                      height, nchannels, nkernels, kernel_order));
+    report_timing("Team conv fp16 time", &stats);
+    report_difference("fp16 against fp32", output_f16, output, nkernels, width, height);
+
+    {
+      float ***scaled_image = scaled_3d_matrix(image, width + kernel_order, height + kernel_order,
+                                               nchannels, FP16_ERROR_SCALE);
+      struct sparse_matrix ***scaled_kernels = scaled_sparse_kernels(sparse_kernels, kernel_order,
+                                                                     nkernels, nchannels,
+                                                                     FP16_ERROR_SCALE);
+      float ***output_scaled = new_empty_3d_matrix(nkernels, width, height);
+
+      free(image_f16);
+      image_f16 = image_to_f16(scaled_image, width + kernel_order, height + kernel_order, nchannels);
+      kernels_make_f16(scaled_kernels, kernel_order);
+      team_conv_sparse(scaled_image, scaled_kernels, output_scaled, width, height, nchannels,
+                       nkernels, kernel_order);
+      team_conv_sparse_f16(image_f16, scaled_kernels, output_f16, width, height, nchannels,
+                           nkernels, kernel_order);
+      report_difference("fp16 against fp32 on inputs scaled by 1/3", output_f16, output_scaled,
+                        nkernels, width, height);
+    }
+  }
+
+  /* time the quantized engine; quantizing the kernels is part of
+     planning, but quantizing the image must be done for every image */
+  if (opts.int8)
+  {
+    float ***output_q8 = new_empty_3d_matrix(nkernels, width, height);
+    struct quantized_kernels *quantized_kernels;
+    struct quantized_image quantized_image;
+
+    if (!use_sparse)
+    {
+      fprintf(stderr, "FATAL: -int8 needs sparse kernels (nz_ratio > 1)\n");
+      exit(1);
+    }
+    quantized_kernels = quantize_kernels(sparse_kernels, kernel_order, nkernels, nchannels);
+
+    // every image is quantized into a new buffer, so each run frees the
+    // one before
+    quantized_image.data = NULL;
+    HARNESS_TIME(&timing, &stats, free(quantized_image.data),
+                 quantize_image(image, width + kernel_order, height + kernel_order, nchannels,
+                                &quantized_image));
+    report_timing("Image quantization time", &stats);
+
+    HARNESS_TIME(&timing, &stats,
+                 team_conv_sparse_q8(&quantized_image, quantized_kernels, output_q8, width, height));
+    report_timing("Team conv int8 time", &stats);
+    report_difference("int8 against fp32", output_q8, output, nkernels, width, height);
+  }
+
+  /* time the codebook form; clustering is part of planning */
+  if (opts.codebook_bits != 0)
+  {
+    float ***output_codebook = new_empty_3d_matrix(nkernels, width, height);
+    struct codebook_kernels *codebook;
+
+    if (!use_sparse)
+    {
+      fprintf(stderr, "FATAL: -codebook needs sparse kernels (nz_ratio > 1)\n");
+      exit(1);
+    }
+    if (!__builtin_cpu_supports("avx2"))
+    {
+      fprintf(stderr, "FATAL: -codebook needs a CPU with AVX2\n");
+      exit(1);
+    }
+    codebook = cluster_kernels(sparse_kernels, kernel_order, nkernels, opts.codebook_bits);
+
+    HARNESS_TIME(&timing, &stats,
+                 team_conv_sparse_codebook(image, codebook, output_codebook, width, height,
+                                           nchannels, nkernels, kernel_order));
+    report_timing("Team conv codebook time", &stats);
+    printf("Value bytes per non-zero: float 4.00, codebook %.2f\n", opts.codebook_bits / 8.0);
+    report_codebook_bytes(codebook);
+    report_difference("codebook against fp32", output_codebook, output, nkernels, width, height);
+    codebook_kernels_free(codebook);
+  }
+
+  /* time a strided or dilated convolution of the same output size on a
+     larger image of its own, against the extended reference; with unit
+     dilation it is also timed as the full resolution convolution that
+     is then subsampled */
+  if (opts.stride != 1 || opts.dilation != 1)
+  {
+    int extent_w = conv_input_extent(width, kernel_order, opts.stride, opts.dilation);
+    int extent_h = conv_input_extent(height, kernel_order, opts.stride, opts.dilation);
+    float ***strided_image;
+    float ***output_reference = new_empty_3d_matrix(nkernels, width, height);
+    float ***output_strided = new_empty_3d_matrix(nkernels, width, height);
+
+    if (!use_sparse)
+    {
+      fprintf(stderr, "FATAL: -stride and -dilation need sparse kernels (nz_ratio > 1)\n");
+      exit(1);
+    }
+    strided_image = gen_random_3d_matrix(extent_w, extent_h, nchannels, 1);
+    multichannel_conv_sparse_strided(strided_image, sparse_kernels, output_reference, width, height,
+                                     nchannels, nkernels, kernel_order, opts.stride, opts.dilation);
+
+    if (opts.dilation == 1)
+    {
+      // the image is exactly the one a full resolution convolution reads
+      float ***output_full = new_empty_3d_matrix(nkernels, width * opts.stride, height * opts.stride);
+      int m, h, w;
+
+      HARNESS_TIME(&timing, &stats,
+                   team_conv_sparse(strided_image, sparse_kernels, output_full, width * opts.stride,
+                                    height * opts.stride, nchannels, nkernels, kernel_order);
+                   for (m = 0; m < nkernels; m++)
+                   {
+                     for (h = 0; h < height; h++)
+                     {
+                       for (w = 0; w < width; w++)
+                       {
+                         output_strided[m][h][w] = output_full[m][h * opts.stride][w * opts.stride];
+                       }
+                     }
+                   });
+      report_timing("Team conv full resolution and subsample time", &stats);
+      report_difference("subsampled against strided reference", output_strided, output_reference,
+                        nkernels, width, height);
+    }
+
+    HARNESS_TIME(&timing, &stats,
+                 team_conv_sparse_strided_generic(strided_image, sparse_kernels, output_strided,
+                                                  width, height, nchannels, nkernels, kernel_order,
+                                                  opts.stride, opts.dilation));
+    report_timing("Team conv strided generic time", &stats);
+
+    HARNESS_TIME(&timing, &stats,
+                 team_conv_sparse_strided(strided_image, sparse_kernels, output_strided, width,
+                                          height, nchannels, nkernels, kernel_order, opts.stride,
+                                          opts.dilation));
+    report_timing("Team conv strided time", &stats);
+    report_difference("strided against strided reference", output_strided, output_reference,
+                      nkernels, width, height);
+  }
+
+  /* time "same" padding of an unpadded image of its own, first by
+     copying the image into the inside of a zero halo as the harness's
+     layout needs, then in place */
+  if (opts.same)
+  {
+    float ***unpadded = gen_random_3d_matrix(width, height, nchannels, 1);
+    float ***padded = new_empty_3d_matrix(width + kernel_order, height + kernel_order, nchannels);
+    float ***output_copy = new_empty_3d_matrix(nkernels, width, height);
+    float ***output_same = new_empty_3d_matrix(nkernels, width, height);
+    int pad = kernel_order / 2, w, h;
+
+    if (!use_sparse)
+    {
+      fprintf(stderr, "FATAL: -same needs sparse kernels (nz_ratio > 1)\n");
+      exit(1);
+    }
+    HARNESS_TIME(&timing, &stats,
+                 memset(&(padded[0][0][0]), 0,
+                        sizeof(float) * (size_t)(width + kernel_order) * (height + kernel_order) *
+                            nchannels);
+                 for (w = 0; w < width; w++)
+                 {
+                   for (h = 0; h < height; h++)
+                   {
+                     memcpy(padded[w + pad][h + pad], unpadded[w][h], sizeof(float) * nchannels);
+                   }
+                 }
+                 team_conv_sparse(padded, sparse_kernels, output_copy, width,
+                                  height, nchannels, nkernels, kernel_order));
+    report_timing("Team conv with padding copy time", &stats);
+
+    HARNESS_TIME(&timing, &stats,
+                 team_conv_sparse_same(unpadded, sparse_kernels, output_same, width,
+                                       height, nchannels, nkernels, kernel_order));
+    report_timing("Team conv same padding time", &stats);
+    report_difference("same padding against padding copy", output_same, output_copy,
+                      nkernels, width, height);
+  }
+
+  /* time grouped kernels, made by leaving out the non-zeros outside each
+     kernel's group: in team_conv_sparse, in the grouped path and, when
+     every channel is a group, in the depthwise engine */
+  if (opts.groups > 1)
+  {
+    struct sparse_matrix ***grouped_sparse;
+    struct grouped_kernels *grouped;
+    float ***output_reference = new_empty_3d_matrix(nkernels, width, height);
+    float ***output_grouped = new_empty_3d_matrix(nkernels, width, height);
+    long long non_zeros = 0;
+    char name[64];
+    int x, y;
+
+    if (nchannels % opts.groups != 0 || nkernels % opts.groups != 0 || nchannels / opts.groups > 65536)
+    {
+      fprintf(stderr, "FATAL: -groups needs groups that divide the channels and the kernels "
+                      "into at most 65536 channels each\n");
+      exit(1);
+    }
+    // grouped kernels are often dense within their groups
+    grouped_sparse = kernels_group_mask(use_sparse ? sparse_kernels
+                                                   : kernels_dense2sparse(kernels, kernel_order, nkernels, nchannels),
+                                        kernel_order, nkernels, nchannels, opts.groups);
+    for (x = 0; x < kernel_order; x++)
+    {
+      for (y = 0; y < kernel_order; y++)
+      {
+        non_zeros += grouped_sparse[x][y]->non_zeros;
+      }
+    }
+    multichannel_conv_sparse(image, grouped_sparse, output_reference, width,
+                             height, nchannels, nkernels, kernel_order);
+
+    HARNESS_TIME(&timing, &stats,
+                 team_conv_sparse(image, grouped_sparse, output_grouped, width,
+                                  height, nchannels, nkernels, kernel_order));
+    snprintf(name, sizeof(name), "Team conv of %d groups as one time", opts.groups);
+    report_timing(name, &stats);
+
+    grouped = kernels_to_grouped(grouped_sparse, kernel_order, nkernels, nchannels, opts.groups);
+    HARNESS_TIME(&timing, &stats,
+                 team_conv_sparse_grouped(image, grouped, output_grouped, width,
+                                          height, nchannels, nkernels, kernel_order));
+    report_timing("Team conv grouped time", &stats);
+    report_difference("grouped against reference", output_grouped, output_reference,
+                      nkernels, width, height);
+
+    if (opts.groups == nchannels && opts.groups == nkernels)
+    {
+      struct depthwise_kernels *depthwise = kernels_to_depthwise(grouped_sparse, kernel_order, nchannels);
+
+      HARNESS_TIME(&timing, &stats, team_conv_depthwise(image, depthwise, output_grouped, width, height));
+      report_timing("Team conv depthwise time", &stats);
+      report_difference("depthwise against reference", output_grouped, output_reference,
+                        nkernels, width, height);
+      printf("Kernel bytes: sparse %lld, grouped %lld, depthwise %lld\n",
+             non_zeros * 8 + (long long)kernel_order * kernel_order * (nkernels + 1) * 4,
+             non_zeros * 6 + (long long)kernel_order * kernel_order * (nkernels + 1) * 4,
+             (long long)kernel_order * kernel_order * nchannels * 4);
+    }
+    else
+    {
+      printf("Kernel bytes: sparse %lld, grouped %lld\n",
+             non_zeros * 8 + (long long)kernel_order * kernel_order * (nkernels + 1) * 4,
+             non_zeros * 6 + (long long)kernel_order * kernel_order * (nkernels + 1) * 4);
+    }
+  }
+
+  /* time kernels of their own, dense random ones pruned to n:4, in the
+     N:M form and in CSR form at the same density */
+  if (opts.nm != 0)
+  {
+    float ****pruned;
+    struct nm_kernels *nm;
+    struct sparse_matrix ***csr;
+    float ***output_reference = new_empty_3d_matrix(nkernels, width, height);
+    float ***output_nm = new_empty_3d_matrix(nkernels, width, height);
+    long long non_zeros;
+    char name[64];
+
+    if (nchannels % 16 != 0)
+    {
+      fprintf(stderr, "FATAL: -nm needs a multiple of 16 channels\n");
+      exit(1);
+    }
+    pruned = gen_random_4d_matrix(kernel_order, kernel_order, nkernels, nchannels, 1);
+    nm = kernels_prune_nm(pruned, kernel_order, nkernels, nchannels, opts.nm);
+    csr = kernels_dense2sparse(pruned, kernel_order, nkernels, nchannels);
+    non_zeros = (long long)kernel_order * kernel_order * nkernels * nm->per_kernel;
+    multichannel_conv_sparse(image, csr, output_reference, width,
+                             height, nchannels, nkernels, kernel_order);
+
+    HARNESS_TIME(&timing, &stats,
+                 team_conv_sparse(image, csr, output_nm, width,
+                                  height, nchannels, nkernels, kernel_order));
+    snprintf(name, sizeof(name), "Team conv %d:4 as CSR time", opts.nm);
+    report_timing(name, &stats);
+    report_difference("CSR against reference", output_nm, output_reference, nkernels, width, height);
+
+    HARNESS_TIME(&timing, &stats,
+                 team_conv_nm(image, nm, output_nm, width, height, nchannels, nkernels, kernel_order));
+    snprintf(name, sizeof(name), "Team conv %d:4 time", opts.nm);
+    report_timing(name, &stats);
+    report_difference("N:M against reference", output_nm, output_reference, nkernels, width, height);
+    printf("Kernel bytes: CSR %lld, %d:4 %lld\n",
+           non_zeros * 8 + (long long)kernel_order * kernel_order * (nkernels + 1) * 4,
+           opts.nm, non_zeros * 4 + non_zeros / 4);
+  }
+
+  /* time the sparse image engine against team_conv_sparse on images of
+     their own with each nz ratio, and find where it starts to win */
+  if (opts.nimage_nz > 0)
+  {
+    struct transposed_kernels *transposed;
+    float ***output_reference = new_empty_3d_matrix(nkernels, width, height);
+    float ***output_image = new_empty_3d_matrix(nkernels, width, height);
+    double break_even = 0.0;
+    int i;
+
+    if (!use_sparse)
+    {
+      fprintf(stderr, "FATAL: -image-nz needs sparse kernels (nz_ratio > 1)\n");
+      exit(1);
+    }
+    transposed = transpose_kernels(sparse_kernels, kernel_order, nkernels, nchannels);
+    for (i = 0; i < opts.nimage_nz; i++)
+    {
+      float ***sparse_image = gen_random_3d_matrix(width + kernel_order, height + kernel_order,
+                                                   nchannels, opts.image_nz[i]);
+      struct sparse_image compressed = {0, 0, NULL, NULL, NULL};
+      long long dense_time, compress_time, sparse_time;
+      double density;
+
+      multichannel_conv_sparse(sparse_image, sparse_kernels, output_reference, width,
+                               height, nchannels, nkernels, kernel_order);
+
+      HARNESS_TIME(&timing, &stats,
+                   team_conv_sparse(sparse_image, sparse_kernels, output_image, width,
+                                    height, nchannels, nkernels, kernel_order));
+      dense_time = median_microseconds(&stats);
+
+      // every image is compressed into new arrays, so each run frees the
+      // ones before
+      HARNESS_TIME(&timing, &stats, sparse_image_free(&compressed),
+                   compress_image(sparse_image, width + kernel_order, height + kernel_order,
+                                  nchannels, &compressed));
+      compress_time = median_microseconds(&stats);
+
+      HARNESS_TIME(&timing, &stats,
+                   team_conv_sparse_image(&compressed, transposed, output_image, width,
+                                          height, nchannels, nkernels, kernel_order));
+      sparse_time = median_microseconds(&stats);
+
+      density = (double)compressed.pixel_starts[(width + kernel_order) * (height + kernel_order)] /
+                ((double)(width + kernel_order) * (height + kernel_order) * nchannels);
+      printf("Image density %5.1f%%: team conv %lld us, compress %lld us + sparse image conv %lld us\n",
+             100.0 * density, dense_time, compress_time, sparse_time);
+      report_difference("sparse image against reference", output_image, output_reference,
+                        nkernels, width, height);
+      if (compress_time + sparse_time < dense_time && density > break_even)
+      {
+        break_even = density;
+      }
+      sparse_image_free(&compressed);
+      free(sparse_image[0][0]);
+      free(sparse_image[0]);
+      free(sparse_image);
+    }
+    if (break_even > 0.0)
+    {
+      printf("COMMENT: the sparse image engine wins at image densities up to %.1f%% of those measured\n",
+             100.0 * break_even);
+    }
+    else
+    {
+      printf("COMMENT: the sparse image engine did not win at any image density measured\n");
+    }
+  }
+
+  /* time kernels of their own as structured channel pruning leaves them:
+     1 in channel_prune channels dense in every kernel and position, the
+     others with the scattered non-zeros of the nz ratio */
+  if (opts.channel_prune != 0)
+  {
+    float ****pruned = gen_random_4d_matrix(kernel_order, kernel_order, nkernels, nchannels, nz_ratio);
+    struct sparse_matrix ***csr;
+    struct channel_plan *plan;
+    float ***output_reference = new_empty_3d_matrix(nkernels, width, height);
+    float ***output_pruned = new_empty_3d_matrix(nkernels, width, height);
+    double plan_start;
+    int x, y, m, c;
+
+    for (c = 0; c < nchannels; c++)
+    {
+      if (random() % opts.channel_prune == 0)
+      {
+        for (x = 0; x < kernel_order; x++)
+        {
+          for (y = 0; y < kernel_order; y++)
+          {
+            for (m = 0; m < nkernels; m++)
+            {
+              pruned[x][y][m][c] = (random() % 1023) + 1;
+            }
+          }
+        }
+      }
+    }
+    csr = kernels_dense2sparse(pruned, kernel_order, nkernels, nchannels);
+    multichannel_conv_sparse(image, csr, output_reference, width,
+                             height, nchannels, nkernels, kernel_order);
+
+    HARNESS_TIME(&timing, &stats,
+                 team_conv_sparse(image, csr, output_pruned, width,
+                                  height, nchannels, nkernels, kernel_order));
+    report_timing("Team conv channel pruned as CSR time", &stats);
+    report_difference("channel pruned as CSR against reference", output_pruned, output_reference,
+                      nkernels, width, height);
+
+    plan_start = now_seconds();
+    plan = plan_channel_pruned(csr, kernel_order, nkernels, nchannels, 0.5);
+    printf("Channel plan: %d of %d channels dense, planned in %lld microseconds\n",
+           plan->nsurviving, nchannels, microseconds_since(plan_start));
+
+    HARNESS_TIME(&timing, &stats,
+                 team_conv_channel_pruned(image, plan, output_pruned, width,
+                                          height, nchannels, nkernels, kernel_order));
+    report_timing("Team conv channel pruned time", &stats);
+    report_difference("channel pruned against reference", output_pruned, output_reference,
+                      nkernels, width, height);
+  }
+
+  /* time kernels of their own with uneven density, all sparse, all
+     dense and each as the hybrid planner decides */
+  if (opts.hybrid >= 0)
+  {
+    float ****uneven = gen_uneven_kernels(kernel_order, nkernels, nchannels, nz_ratio);
+    struct sparse_matrix ***uneven_sparse = kernels_dense2sparse(uneven, kernel_order, nkernels, nchannels);
+    float ***output_reference = new_empty_3d_matrix(nkernels, width, height);
+    float ***output_hybrid = new_empty_3d_matrix(nkernels, width, height);
+    double thresholds[3] = {2.0, 0.0, opts.hybrid / 100.0};
+    const char *names[3] = {"all sparse", "all dense", "hybrid"};
+    int i;
+
+    multichannel_conv_sparse(image, uneven_sparse, output_reference, width,
+                             height, nchannels, nkernels, kernel_order);
+    for (i = 0; i < 3; i++)
+    {
+      struct hybrid_kernels *plan = plan_hybrid(uneven_sparse, kernel_order, nkernels, nchannels,
+                                                thresholds[i]);
+      char name[96];
+
+      HARNESS_TIME(&timing, &stats,
+                   team_conv_hybrid(image, plan, output_hybrid, width, height, nchannels, nkernels,
+                                    kernel_order));
+      snprintf(name, sizeof(name), "Team conv uneven kernels %s (%d of %d dense) time", names[i],
+               plan->ndense, nkernels);
+      report_timing(name, &stats);
+      snprintf(name, sizeof(name), "%s against reference", names[i]);
+      report_difference(name, output_hybrid, output_reference, nkernels, width, height);
+      free(plan->dense);
+      free(plan->dense_index);
+      free(plan);
+    }
+  }
+
+  /* renumber the channels of the harness kernels, and of kernels whose
+     non-zeros cluster in scattered groups of channels, and time the
+     convolution before and after; the plan and the kernels are made
+     once, but every image has to be renumbered */
+  if (opts.reorder)
+  {
+    float ***output_before = new_empty_3d_matrix(nkernels, width, height);
+    float ***output_after = new_empty_3d_matrix(nkernels, width, height);
+    float ***reordered_image =
+        new_empty_3d_matrix(width + kernel_order, height + kernel_order, nchannels);
+    const char *names[2] = {"random kernels", "clustered kernels"};
+    char name[96];
+    int i;
+
+    if (!use_sparse)
+    {
+      fprintf(stderr, "FATAL: -reorder needs sparse kernels (nz_ratio > 1)\n");
+      exit(1);
+    }
+    for (i = 0; i < 2; i++)
+    {
+      struct sparse_matrix ***before = sparse_kernels, ***after;
+      struct timing_stats image_stats, before_stats, after_stats;
+      long long plan_time;
+      double plan_start, saving, noise;
+      double lines_before, lines_after;
+      int *order, order_cached;
+
+      if (i == 1)
+      {
+        float ****clustered = gen_clustered_kernels(kernel_order, nkernels, nchannels, nz_ratio);
+        before = kernels_dense2sparse(clustered, kernel_order, nkernels, nchannels);
+        if (opts.index_encoding != INDEX_INT32)
+        {
+          kernels_encode_indices(before, kernel_order, opts.index_encoding);
+        }
+      }
+      lines_before = kernel_lines_touched(before, kernel_order, nkernels, nchannels);
+
+      plan_start = now_seconds();
+      order_cached = (i == 0 && plan->order != NULL);
+      if (order_cached)
+      {
+        order = plan->order;
+      }
+      else
+      {
+        order = plan_channel_order(before, kernel_order, nkernels, nchannels);
+        if (i == 0)
+        {
+          // the order is part of the plan of the harness kernels
+          plan->order = order;
+          if (opts.plan_cache != NULL)
+          {
+            conv_plan_save(opts.plan_cache, plan);
+          }
+        }
+      }
+      after = reorder_kernels(before, kernel_order, nkernels, nchannels, order);
+      if (opts.index_encoding != INDEX_INT32)
+      {
+        kernels_encode_indices(after, kernel_order, opts.index_encoding);
+      }
+      plan_time = microseconds_since(plan_start);
+      lines_after = kernel_lines_touched(after, kernel_order, nkernels, nchannels);
+
+      HARNESS_TIME(&timing, &image_stats,
+                   reorder_image_into(reordered_image, image, width, height, nchannels,
+                                      kernel_order, order));
+      HARNESS_TIME(&timing, &before_stats,
+                   team_conv_sparse(image, before, output_before, width, height, nchannels,
+                                    nkernels, kernel_order));
+      HARNESS_TIME(&timing, &after_stats,
+                   team_conv_sparse(reordered_image, after, output_after, width, height,
+                                    nchannels, nkernels, kernel_order));
+
+      printf("Channel reorder %s: %.2f cache lines per kernel row before, %.2f after\n",
+             names[i], lines_before, lines_after);
+      printf("Channel reorder %s: plan %lld%s, image renumbering %lld microseconds\n",
+             names[i], plan_time, order_cached ? " (cached order)" : "",
+             median_microseconds(&image_stats));
+      snprintf(name, sizeof(name), "Team conv %s original order time", names[i]);
+      report_timing(name, &before_stats);
+      snprintf(name, sizeof(name), "Team conv %s reordered time", names[i]);
+      report_timing(name, &after_stats);
+
+      // a saving per image is only believed when it is wider than the
+      // p5 to p95 spread of the two runs it is the difference of
+      saving = before_stats.median - after_stats.median - image_stats.median;
+      noise = (before_stats.p95 - before_stats.p5) + (after_stats.p95 - after_stats.p5);
+      if (timing.repeats < 2)
+      {
+        printf("Channel reorder %s: one run cannot tell a saving from noise, use -repeat\n",
+               names[i]);
+      }
+      else if (saving > noise)
+      {
+        printf("Channel reorder %s: plan repaid after %lld images\n", names[i],
+               (long long)(plan_time / (saving * 1e6)) + 1);
+      }
+      else if (saving > 0.0)
+      {
+        printf("Channel reorder %s: saving of %.1f microseconds per image is within the noise of %.1f\n",
+               names[i], saving * 1e6, noise * 1e6);
+      }
+      else
+      {
+        printf("Channel reorder %s: not repaid while each image is renumbered\n", names[i]);
+      }
+      report_difference(names[i], output_after, output_before, nkernels, width, height);
+      if (order != plan->order)
+      {
+        free(order);
+      }
+    }
+    free(reordered_image[0][0]);
+    free(reordered_image[0]);
+    free(reordered_image);
+  }
+
+  /* group output kernels that share channels, for the harness kernels
+     and for kernels whose non-zeros cluster, and time the groups
+     against team_conv_sparse on the same kernels */
+  if (opts.kernel_groups)
+  {
+    float ***output_sparse = new_empty_3d_matrix(nkernels, width, height);
+    float ***output_groups = new_empty_3d_matrix(nkernels, width, height);
+    const char *names[2] = {"random kernels", "clustered kernels"};
+    int i;
+
+    if (!use_sparse)
+    {
+      fprintf(stderr, "FATAL: -kernel-groups needs sparse kernels (nz_ratio > 1)\n");
+      exit(1);
+    }
+    for (i = 0; i < 2; i++)
+    {
+      struct sparse_matrix ***kernels = sparse_kernels;
+      struct kernel_groups *groups;
+      long long plan_time;
+      double plan_start;
+      char name[64];
+      int group_size;
+
+      if (i == 1)
+      {
+        float ****clustered = gen_clustered_kernels(kernel_order, nkernels, nchannels, nz_ratio);
+        kernels = kernels_dense2sparse(clustered, kernel_order, nkernels, nchannels);
+      }
+      HARNESS_TIME(&timing, &stats,
+                   team_conv_sparse(image, kernels, output_sparse, width, height, nchannels,
+                                    nkernels, kernel_order));
+      snprintf(name, sizeof(name), "Team conv %s time", names[i]);
+      report_timing(name, &stats);
+
+      // groups of four with SSE, then groups of eight when the CPU has AVX2
+      for (group_size = 4; group_size <= KERNEL_GROUP_MAX; group_size *= 2)
+      {
+        if (group_size == KERNEL_GROUP_MAX && !__builtin_cpu_supports("avx2"))
+        {
+          printf("Kernel groups of %d skipped: the CPU has no AVX2\n", group_size);
+          continue;
+        }
+        plan_start = now_seconds();
+        groups = plan_kernel_groups(kernels, kernel_order, nkernels, nchannels, group_size);
+        plan_time = microseconds_since(plan_start);
+        printf("Kernel groups of %d %s: %lld non-zeros, %lld in the unions (%.2fx), plan %lld microseconds\n",
+               group_size, names[i], groups->non_zeros, groups->union_non_zeros,
+               (double)groups->union_non_zeros * group_size / groups->non_zeros, plan_time);
+
+        HARNESS_TIME(&timing, &stats,
+                     team_conv_kernel_groups(image, groups, output_groups, width, height, nchannels,
+                                             nkernels, kernel_order));
+        snprintf(name, sizeof(name), "Team conv %s in groups of %d time", names[i], group_size);
+        report_timing(name, &stats);
+        snprintf(name, sizeof(name), "%s in groups of %d", names[i], group_size);
+        report_difference(name, output_groups, output_sparse, nkernels, width, height);
+        kernel_groups_free(groups);
+      }
+    }
+  }
+
+  /* stream frames of the same shape through the pipeline; a loaded
+     image stands in for every decoded frame */
+  if (opts.stream_frames > 0)
+  {
+    if (!use_sparse)
+    {
+      fprintf(stderr, "FATAL: -stream needs sparse kernels (nz_ratio > 1)\n");
+      exit(1);
+    }
+    run_stream(sparse_kernels, (opts.load_image != NULL) ? image : NULL, width, height,
+               nchannels, nkernels, kernel_order, opts.stream_frames, opts.stream_buffers,
+               opts.stream_out);
+  }
+
+  /* time a convolution followed by 2x2 pooling, first as a separate pass
+     over the output and then fused into the convolution's tiles */
+  if (opts.pool != POOL_NONE)
+  {
+    float ***output_full = new_empty_3d_matrix(nkernels, width, height);
+    float ***output_pass = new_empty_3d_matrix(nkernels, width / 2, height / 2);
+    float ***output_fused = new_empty_3d_matrix(nkernels, width / 2, height / 2);
+    struct conv_epilogue epilogue = {NULL, ACTIVATION_NONE, opts.pool};
+
+    HARNESS_TIME(&timing, &stats,
+                 team_conv_sparse(image, sparse_kernels, output_full, width,
+                                  height, nchannels, nkernels, kernel_order);
+                 pool_pass(opts.pool, output_full, output_pass, width, height, nchannels, nkernels,
+                           kernel_order));
+    report_timing("Team conv with pooling pass time", &stats);
+
+    HARNESS_TIME(&timing, &stats,
+                 team_conv_sparse_epilogue(image, sparse_kernels, output_fused, width,
+                                           height, nchannels, nkernels, kernel_order, &epilogue));
+    report_timing("Team conv with fused pooling time", &stats);
+    report_difference("fused pooling against pass", output_fused, output_pass,
+                      nkernels, width / 2, height / 2);
+  }
+
+  /* time a convolution followed by a bias, a batch norm and a ReLU, first
+     as a separate pass over the output and then folded and fused; this
+     changes the kernel values, so it comes last */
+  if (opts.epilogue)
+  {
+    float ***output_pass = new_empty_3d_matrix(nkernels, width, height);
+    float ***output_fused = new_empty_3d_matrix(nkernels, width, height);
+    float *bias = malloc(sizeof(float) * nkernels);
+    float *gamma = malloc(sizeof(float) * nkernels);
+    float *beta = malloc(sizeof(float) * nkernels);
+    float *mean = malloc(sizeof(float) * nkernels);
+    float *variance = malloc(sizeof(float) * nkernels);
+    const float epsilon = 1e-5f;
+    struct conv_epilogue epilogue;
+    double fold_start;
+    int m, h, w;
+
+    if (!use_sparse)
+    {
+      fprintf(stderr, "FATAL: -epilogue needs sparse kernels (nz_ratio > 1)\n");
+      exit(1);
+    }
+    assert(bias != NULL && gamma != NULL && beta != NULL && mean != NULL && variance != NULL);
+    // batch norm statistics like those a trained network would have seen,
+    // so that the ReLU clears about half of the outputs
+    for (m = 0; m < nkernels; m++)
+    {
+      double sum = 0.0, sum_squares = 0.0;
+      for (h = 0; h < height; h++)
+      {
+        for (w = 0; w < width; w++)
+        {
+          sum += output[m][h][w];
+          sum_squares += (double)output[m][h][w] * output[m][h][w];
+        }
+      }
+      mean[m] = sum / (width * height);
+      variance[m] = sum_squares / (width * height) - (double)mean[m] * mean[m];
+      bias[m] = (random() % 2048) - 1024;
+      gamma[m] = 0.5f + (random() % 1024) / 1024.0f;
+      beta[m] = ((random() % 2048) - 1024) / 1024.0f;
+    }
+
+    HARNESS_TIME(&timing, &stats,
+                 team_conv_sparse(image, sparse_kernels, output_pass, width,
+                                  height, nchannels, nkernels, kernel_order);
+                 epilogue_pass(output_pass, bias, gamma, beta, mean, variance, epsilon, width,
+                               height, nchannels, nkernels, kernel_order));
+    report_timing("Team conv with epilogue pass time", &stats);
+
+    // folding changes the kernel values, so it is done and timed once
+    fold_start = now_seconds();
+    fold_batch_norm(sparse_kernels, kernel_order, nkernels, gamma, beta, mean, variance,
+                    epsilon, bias);
+    printf("Batch norm folding time: %lld microseconds\n", microseconds_since(fold_start));
+
+    epilogue.bias = bias;
+    epilogue.activation = ACTIVATION_RELU;
+    epilogue.pool = POOL_NONE;
+    HARNESS_TIME(&timing, &stats,
+                 team_conv_sparse_epilogue(image, sparse_kernels, output_fused, width,
+                                           height, nchannels, nkernels, kernel_order, &epilogue));
+    report_timing("Team conv with fused epilogue time", &stats);
+    report_difference("fused epilogue against pass", output_fused, output_pass, nkernels, width, height);
+  }
 
   return 0;
 }